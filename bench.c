@@ -0,0 +1,391 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* Microbenchmarks of the block store layers.  Usage:
+ *
+ *	benchmark [-r repetitions] [-n ops] [-w warmup] [-o file.csv] [benchmark ...]
+ *
+ * Each benchmark runs 'warmup' operations that are not measured, and then
+ * 'repetitions' rounds of 'ops' operations each.  The time per operation
+ * of each round is a sample; the report gives the median, 10th and 90th
+ * percentile, and minimum over the rounds in nanoseconds per operation.
+ * With -o, the results are also written as CSV, so that they can be
+ * compared across builds.  Without benchmark names, all are run.
+ *
+ * "make bench" builds this program and runs it ("make bench
+ * BENCH_CSV=file.csv" to also write the CSV).
+ *
+ * The disk benchmarks use files in the current directory; run from a
+ * tmpfs directory (such as /dev/shm) to leave out the device.  The
+ * stripeN benchmarks read or write runs of BENCH_STRIPE_RUN blocks on a
+ * stripedisk over N disks, showing how throughput scales with the number
+ * of members.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include "block_store.h"
+
+#define BENCH_DISK_FILE		"bench.dev"
+#define BENCH_DISK_SIZE		(64 * 1024)		// blocks
+#define BENCH_INODES		16
+#define BENCH_CACHE_SIZE	64
+#define BENCH_STRIPE_MAX	4				// max # members of a stripedisk
+#define BENCH_STRIPE_BLOCKS	8				// stripe size
+#define BENCH_STRIPE_RUN	64				// blocks per readv or writev
+
+/* State shared by the set up, run, and tear down of a benchmark.
+ */
+struct bench_ctx {
+	block_store_t *disk;			// bottom layer
+	block_store_t *top;				// layer being measured
+	block_t *cache;					// cachedisk memory
+	block_t block;
+	block_no nblocks;				// size of the file (treedisk)
+	unsigned long i;				// operation counter
+	block_store_t *members[BENCH_STRIPE_MAX];	// stripedisk members
+	unsigned int nmembers;
+	block_t *run[BENCH_STRIPE_RUN];	// buffers of a readv or writev
+};
+
+struct bench {
+	char *name;
+	void (*setup)(struct bench_ctx *bc);
+	int (*op)(struct bench_ctx *bc);				// one operation
+	void (*teardown)(struct bench_ctx *bc);
+};
+
+static uint64_t bench_now(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Scatter operations over the block store, but deterministically.
+ */
+static block_no bench_offset(struct bench_ctx *bc, block_no range){
+	return (block_no) ((bc->i++ * 2654435761U) % range);
+}
+
+/*************************************************************************
+ * ramdisk and disk
+ ************************************************************************/
+
+static void ramdisk_setup(struct bench_ctx *bc){
+	bc->disk = bc->top = ramdisk_init_sparse(BENCH_DISK_SIZE);
+}
+
+static void disk_setup(struct bench_ctx *bc){
+	bc->disk = bc->top = disk_init(BENCH_DISK_FILE, BENCH_DISK_SIZE);
+}
+
+static int store_read(struct bench_ctx *bc){
+	return (*bc->top->read)(bc->top, bench_offset(bc, BENCH_DISK_SIZE), &bc->block);
+}
+
+static int store_write(struct bench_ctx *bc){
+	return (*bc->top->write)(bc->top, bench_offset(bc, BENCH_DISK_SIZE), &bc->block);
+}
+
+static void store_teardown(struct bench_ctx *bc){
+	if (bc->top != bc->disk) {
+		(*bc->top->destroy)(bc->top);
+	}
+	(*bc->disk->destroy)(bc->disk);
+	free(bc->cache);
+	unlink(BENCH_DISK_FILE);
+}
+
+/*************************************************************************
+ * cachedisk
+ ************************************************************************/
+
+static void cachedisk_setup(struct bench_ctx *bc){
+	bc->disk = ramdisk_init_sparse(BENCH_DISK_SIZE);
+	bc->cache = malloc(BENCH_CACHE_SIZE * BLOCK_SIZE);
+	bc->top = cachedisk_init(bc->disk, bc->cache, BENCH_CACHE_SIZE);
+}
+
+/* Stays within the cache after the first few operations.
+ */
+static int cachedisk_hit(struct bench_ctx *bc){
+	return (*bc->top->read)(bc->top, bc->i++ % (BENCH_CACHE_SIZE / 2), &bc->block);
+}
+
+/* Cycles through more blocks than fit, so LRU always misses.
+ */
+static int cachedisk_miss(struct bench_ctx *bc){
+	return (*bc->top->read)(bc->top, bc->i++ % (BENCH_CACHE_SIZE * 4), &bc->block);
+}
+
+/*************************************************************************
+ * treedisk.  A file of 1 block has a tree of depth 0 (the root is the
+ * data block), up to REFS_PER_BLOCK blocks depth 1, and so on.
+ ************************************************************************/
+
+static void treedisk_setup_size(struct bench_ctx *bc, block_no nblocks){
+	bc->disk = ramdisk_init_sparse(BENCH_DISK_SIZE);
+	if (treedisk_create(bc->disk, BENCH_INODES) < 0) {
+		panic("bench: treedisk_create");
+	}
+	bc->top = treedisk_init(bc->disk, 0);
+	bc->nblocks = nblocks;
+	block_no b;
+	for (b = 0; b < nblocks; b++) {
+		if ((*bc->top->write)(bc->top, b, &bc->block) < 0) {
+			panic("bench: treedisk fill");
+		}
+	}
+}
+
+static void treedisk_setup_depth0(struct bench_ctx *bc){
+	treedisk_setup_size(bc, 1);
+}
+
+static void treedisk_setup_depth1(struct bench_ctx *bc){
+	treedisk_setup_size(bc, BLOCK_SIZE / sizeof(block_no));
+}
+
+static void treedisk_setup_depth2(struct bench_ctx *bc){
+	treedisk_setup_size(bc, 4 * BLOCK_SIZE / sizeof(block_no));
+}
+
+static void treedisk_setup_empty(struct bench_ctx *bc){
+	treedisk_setup_size(bc, 0);
+}
+
+static int treedisk_read_op(struct bench_ctx *bc){
+	return (*bc->top->read)(bc->top, bench_offset(bc, bc->nblocks), &bc->block);
+}
+
+/* Each write goes to a new block, so it allocates.  Truncate every so
+ * often so that the disk does not fill up; this is part of the cost.
+ */
+static int treedisk_alloc_op(struct bench_ctx *bc){
+	if (bc->nblocks == 1024) {
+		(*bc->top->setsize)(bc->top, 0);
+		bc->nblocks = 0;
+	}
+	return (*bc->top->write)(bc->top, bc->nblocks++, &bc->block);
+}
+
+/* Truncate a file of 16 blocks.  Refilling it is part of the cost.
+ */
+static int treedisk_setsize_op(struct bench_ctx *bc){
+	block_no b;
+
+	for (b = 0; b < 16; b++) {
+		if ((*bc->top->write)(bc->top, b, &bc->block) < 0) {
+			return -1;
+		}
+	}
+	return (*bc->top->setsize)(bc->top, 0);
+}
+
+/*************************************************************************
+ * stripedisk over 1 to BENCH_STRIPE_MAX disks of the same total size
+ ************************************************************************/
+
+static void stripe_setup(struct bench_ctx *bc, unsigned int n){
+	char file[64];
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		snprintf(file, sizeof(file), "%s%u", BENCH_DISK_FILE, i);
+		bc->members[i] = disk_init(file, BENCH_DISK_SIZE / n);
+	}
+	bc->nmembers = n;
+	bc->top = stripedisk_init(bc->members, n, BENCH_STRIPE_BLOCKS);
+	for (i = 0; i < BENCH_STRIPE_RUN; i++) {
+		bc->run[i] = calloc(1, sizeof(block_t));
+	}
+
+	/* Fill the disks, so that reads do not just hit the end of the files.
+	 */
+	block_no b;
+	for (b = 0; b < BENCH_DISK_SIZE; b += BENCH_STRIPE_RUN) {
+		if (block_store_writev(bc->top, b, bc->run, BENCH_STRIPE_RUN) < 0) {
+			panic("bench: stripedisk fill");
+		}
+	}
+}
+
+static void stripe_setup1(struct bench_ctx *bc){
+	stripe_setup(bc, 1);
+}
+
+static void stripe_setup2(struct bench_ctx *bc){
+	stripe_setup(bc, 2);
+}
+
+static void stripe_setup4(struct bench_ctx *bc){
+	stripe_setup(bc, 4);
+}
+
+static int stripe_readv(struct bench_ctx *bc){
+	block_no offset = bench_offset(bc, BENCH_DISK_SIZE / BENCH_STRIPE_RUN) * BENCH_STRIPE_RUN;
+
+	return block_store_readv(bc->top, offset, bc->run, BENCH_STRIPE_RUN);
+}
+
+static int stripe_writev(struct bench_ctx *bc){
+	block_no offset = bench_offset(bc, BENCH_DISK_SIZE / BENCH_STRIPE_RUN) * BENCH_STRIPE_RUN;
+
+	return block_store_writev(bc->top, offset, bc->run, BENCH_STRIPE_RUN);
+}
+
+static void stripe_teardown(struct bench_ctx *bc){
+	char file[64];
+	unsigned int i;
+
+	(*bc->top->destroy)(bc->top);
+	for (i = 0; i < bc->nmembers; i++) {
+		(*bc->members[i]->destroy)(bc->members[i]);
+		snprintf(file, sizeof(file), "%s%u", BENCH_DISK_FILE, i);
+		unlink(file);
+	}
+	for (i = 0; i < BENCH_STRIPE_RUN; i++) {
+		free(bc->run[i]);
+	}
+}
+
+static struct bench benches[] = {
+	{ "ramdisk_read",		ramdisk_setup,			store_read,			store_teardown },
+	{ "ramdisk_write",		ramdisk_setup,			store_write,		store_teardown },
+	{ "disk_read",			disk_setup,				store_read,			store_teardown },
+	{ "disk_write",			disk_setup,				store_write,		store_teardown },
+	{ "cachedisk_hit",		cachedisk_setup,		cachedisk_hit,		store_teardown },
+	{ "cachedisk_miss",		cachedisk_setup,		cachedisk_miss,		store_teardown },
+	{ "treedisk_read_d0",	treedisk_setup_depth0,	treedisk_read_op,	store_teardown },
+	{ "treedisk_read_d1",	treedisk_setup_depth1,	treedisk_read_op,	store_teardown },
+	{ "treedisk_read_d2",	treedisk_setup_depth2,	treedisk_read_op,	store_teardown },
+	{ "treedisk_write_alloc", treedisk_setup_empty,	treedisk_alloc_op,	store_teardown },
+	{ "treedisk_setsize",	treedisk_setup_empty,	treedisk_setsize_op, store_teardown },
+	{ "stripe1_readv",		stripe_setup1,			stripe_readv,		stripe_teardown },
+	{ "stripe2_readv",		stripe_setup2,			stripe_readv,		stripe_teardown },
+	{ "stripe4_readv",		stripe_setup4,			stripe_readv,		stripe_teardown },
+	{ "stripe1_writev",		stripe_setup1,			stripe_writev,		stripe_teardown },
+	{ "stripe2_writev",		stripe_setup2,			stripe_writev,		stripe_teardown },
+	{ "stripe4_writev",		stripe_setup4,			stripe_writev,		stripe_teardown },
+	{ 0 }
+};
+
+static int cmp_double(const void *a, const void *b){
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(double *sorted, unsigned int n, double fraction){
+	unsigned int i = (unsigned int) (fraction * (n - 1) + 0.5);
+
+	return sorted[i];
+}
+
+static void usage(char *prog){
+	fprintf(stderr, "usage: %s [-r repetitions] [-n ops] [-w warmup] [-o file.csv] [benchmark ...]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv){
+	unsigned int reps = 11, warmup = 1000;
+	unsigned long nops = 10000;
+	char *csv = 0;
+	FILE *out = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "r:n:w:o:")) != -1) {
+		switch (c) {
+		case 'r':
+			reps = atoi(optarg);
+			break;
+		case 'n':
+			nops = strtoul(optarg, 0, 0);
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			break;
+		case 'o':
+			csv = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (reps == 0 || nops == 0) {
+		usage(argv[0]);
+	}
+	if (csv != 0) {
+		if ((out = fopen(csv, "w")) == 0) {
+			perror(csv);
+			return 1;
+		}
+		fprintf(out, "benchmark,repetitions,ops,median_ns,p10_ns,p90_ns,min_ns\n");
+	}
+
+	double *samples = malloc(reps * sizeof(*samples));
+	printf("%-22s %10s %10s %10s %10s\n", "benchmark", "median", "p10", "p90", "min");
+	struct bench *b;
+	for (b = benches; b->name != 0; b++) {
+		int i;
+		for (i = optind; i < argc; i++) {
+			if (strcmp(argv[i], b->name) == 0) {
+				break;
+			}
+		}
+		if (optind < argc && i == argc) {
+			continue;
+		}
+
+		struct bench_ctx bc;
+		memset(&bc, 0, sizeof(bc));
+		(*b->setup)(&bc);
+		unsigned long n;
+		for (n = 0; n < warmup; n++) {
+			if ((*b->op)(&bc) < 0) {
+				fprintf(stderr, "%s: operation failed\n", b->name);
+				return 1;
+			}
+		}
+		/* The results are only checked after each repetition, so as not
+		 * to add a branch to the timed loop.
+		 */
+		unsigned int r;
+		int failed = 0;
+		for (r = 0; r < reps && !failed; r++) {
+			uint64_t start = bench_now();
+			for (n = 0; n < nops; n++) {
+				failed |= (*b->op)(&bc) < 0;
+			}
+			samples[r] = (double) (bench_now() - start) / nops;
+		}
+		(*b->teardown)(&bc);
+		if (failed) {
+			fprintf(stderr, "%s: operation failed\n", b->name);
+			return 1;
+		}
+
+		qsort(samples, reps, sizeof(*samples), cmp_double);
+		double med = percentile(samples, reps, 0.5);
+		double p10 = percentile(samples, reps, 0.1);
+		double p90 = percentile(samples, reps, 0.9);
+		printf("%-22s %10.1f %10.1f %10.1f %10.1f\n", b->name, med, p10, p90, samples[0]);
+		if (out != 0) {
+			fprintf(out, "%s,%u,%lu,%.1f,%.1f,%.1f,%.1f\n", b->name, reps, nops,
+					med, p10, p90, samples[0]);
+		}
+	}
+	free(samples);
+	if (out != 0 && fclose(out) != 0) {
+		perror(csv);
+		return 1;
+	}
+	return 0;
+}
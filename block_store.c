@@ -8,9 +8,173 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "block_store.h"
 
 void panic(char *s){
 	fprintf(stderr, "!!PANIC: %s\n", s);
 	exit(1);
 }
+
+/* Generic sync-to-async shim: use the native asynchronous methods if the
+ * block store has them, and otherwise do the operation synchronously and
+ * invoke the completion right away.
+ */
+int block_store_read_async(block_store_t *bs, block_no offset, block_t *block, block_done_t done, void *arg){
+	if (bs->read_async != 0) {
+		return (*bs->read_async)(bs, offset, block, done, arg);
+	}
+	(*done)(arg, (*bs->read)(bs, offset, block));
+	return 0;
+}
+
+int block_store_write_async(block_store_t *bs, block_no offset, block_t *block, block_done_t done, void *arg){
+	if (bs->write_async != 0) {
+		return (*bs->write_async)(bs, offset, block, done, arg);
+	}
+	(*done)(arg, (*bs->write)(bs, offset, block));
+	return 0;
+}
+
+int block_store_poll(block_store_t *bs, int wait){
+	if (bs->poll != 0) {
+		return (*bs->poll)(bs, wait);
+	}
+	return 0;
+}
+
+/* Borrow a block if the block store can lend it out, and otherwise read
+ * it into 'buf'.
+ */
+const block_t *block_store_borrow(block_store_t *bs, block_no offset, block_t *buf){
+	if (bs->borrow != 0) {
+		return (*bs->borrow)(bs, offset, buf);
+	}
+	return (*bs->read)(bs, offset, buf) < 0 ? 0 : buf;
+}
+
+void block_store_release(block_store_t *bs, const block_t *block){
+	if (bs->release != 0) {
+		(*bs->release)(bs, block);
+	}
+}
+
+/* Read or write a run of blocks in one operation if the block store can,
+ * and otherwise one block at a time.
+ */
+int block_store_readv(block_store_t *bs, block_no offset, block_t **blocks, unsigned int n){
+	if (bs->readv != 0) {
+		return (*bs->readv)(bs, offset, blocks, n);
+	}
+	unsigned int i;
+	for (i = 0; i < n; i++) {
+		if ((*bs->read)(bs, offset + i, blocks[i]) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int block_store_writev(block_store_t *bs, block_no offset, block_t **blocks, unsigned int n){
+	if (bs->writev != 0) {
+		return (*bs->writev)(bs, offset, blocks, n);
+	}
+	unsigned int i;
+	for (i = 0; i < n; i++) {
+		if ((*bs->write)(bs, offset + i, blocks[i]) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* The hints of the current thread.
+ */
+static __thread unsigned int hint_owner = BLOCK_NO_OWNER;
+static __thread int hint_class = BLOCK_CLASS_DATA;
+
+unsigned int block_store_set_owner(unsigned int owner){
+	unsigned int prev = hint_owner;
+
+	hint_owner = owner;
+	return prev;
+}
+
+unsigned int block_store_owner(void){
+	return hint_owner;
+}
+
+int block_store_set_class(int cls){
+	int prev = hint_class;
+
+	hint_class = cls;
+	return prev;
+}
+
+int block_store_class(void){
+	return hint_class;
+}
+
+/* State of block_store_stats_json() while it collects one kind of metric
+ * of one layer.
+ */
+struct stats_json {
+	FILE *fp;
+	int kind;						// kind of metric being written
+	int n;							// # written so far
+};
+
+static void stats_json_emit(void *arg, char *name, int kind, double value){
+	struct stats_json *sj = arg;
+
+	if (kind != sj->kind) {
+		return;
+	}
+	fprintf(sj->fp, "%s\n        \"%s\": ", sj->n++ == 0 ? "" : ",", name);
+	if (value == (long long) value) {
+		fprintf(sj->fp, "%lld", (long long) value);
+	}
+	else {
+		fprintf(sj->fp, "%.6f", value);
+	}
+}
+
+int block_store_stats_json(block_store_t *top, char *file){
+	static char *kinds[] = { "counters", "gauges" };
+	struct stats_json sj;
+	block_store_t *bs;
+	int level, kind;
+
+	if (strcmp(file, "-") == 0) {
+		sj.fp = stdout;
+	}
+	else if ((sj.fp = fopen(file, "w")) == 0) {
+		perror(file);
+		return -1;
+	}
+
+	fprintf(sj.fp, "{\n  \"layers\": [");
+	for (bs = top, level = 0; bs != 0; bs = bs->below, level++) {
+		fprintf(sj.fp, "%s\n    {\n      \"level\": %d,\n      \"name\": \"%s\"",
+				level == 0 ? "" : ",", level, bs->name == 0 ? "unknown" : bs->name);
+		for (kind = BLOCK_STAT_COUNTER; kind <= BLOCK_STAT_GAUGE; kind++) {
+			fprintf(sj.fp, ",\n      \"%s\": {", kinds[kind]);
+			sj.kind = kind;
+			sj.n = 0;
+			if (bs->stats != 0) {
+				(*bs->stats)(bs, stats_json_emit, &sj);
+			}
+			fprintf(sj.fp, "%s}", sj.n == 0 ? "" : "\n      ");
+		}
+		fprintf(sj.fp, "\n    }");
+	}
+	fprintf(sj.fp, "\n  ]\n}\n");
+
+	if (sj.fp != stdout) {
+		fclose(sj.fp);
+	}
+	else {
+		fflush(sj.fp);
+	}
+	return 0;
+}
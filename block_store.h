@@ -34,6 +34,91 @@
  *
  * A block_store_t * also maintains a void* pointer called 'state' to internal
  * state the block store module needs to keep.
+ *
+ * Block stores may also implement the following optional asynchronous
+ * methods (they are 0 otherwise):
+ *
+ *		int read_async(block_store_t *this_bs, block_no offset, block_t *block,
+ *											block_done_t done, void *arg)
+ *		int write_async(block_store_t *this_bs, block_no offset, block_t *block,
+ *											block_done_t done, void *arg)
+ *			start a read or write and return 0; (*done)(arg, result) is
+ *			invoked exactly once when the operation has finished, which
+ *			may be before read_async/write_async returns.  A read fills
+ *			in *block, so it must stay valid until done is invoked.  A
+ *			write may use *block until done is invoked.  Returns -1 (and
+ *			done is not invoked) if the operation could not be started.
+ *
+ *		int poll(block_store_t *this_bs, int wait)
+ *			make progress on outstanding operations, invoking their
+ *			completions.  If 'wait' is set, block until at least one
+ *			completes (if any are outstanding).  returns 0
+ *
+ * Use block_store_read_async(), block_store_write_async(), and
+ * block_store_poll() below rather than the methods themselves: these
+ * fall back to the synchronous methods for block stores that have no
+ * native asynchronous support.
+ *
+ * A block store that keeps blocks in memory (a cache) may also lend them
+ * out without copying them:
+ *
+ *		const block_t *borrow(block_store_t *this_bs, block_no offset, block_t *buf)
+ *			return a pointer to the block at offset, which stays valid
+ *			until it is released.  It may be 'buf' after reading the
+ *			block into it.  returns 0 upon error
+ *
+ *		void release(block_store_t *this_bs, const block_t *block)
+ *			give back a block returned by borrow
+ *
+ * The borrowed block must not be modified.  Use block_store_borrow() and
+ * block_store_release(), which read into 'buf' for other block stores.
+ *
+ * A block store may also read or write a run of consecutive blocks in one
+ * operation (such as a single preadv or pwritev system call):
+ *
+ *		int readv(block_store_t *this_bs, block_no offset, block_t **blocks,
+ *											unsigned int n)
+ *		int writev(block_store_t *this_bs, block_no offset, block_t **blocks,
+ *											unsigned int n)
+ *			read or write the n blocks starting at offset into or from
+ *			*blocks[0] through *blocks[n - 1].  returns 0
+ *
+ * Use block_store_readv() and block_store_writev(), which fall back to one
+ * read or write per block.
+ *
+ * For introspection, a block store has a 'name' (the type of layer, such
+ * as "cachedisk"), a pointer 'below' to the block store it is stacked on
+ * (0 for the bottom layer), and optionally a method
+ *
+ *		void stats(block_store_t *this_bs, block_stat_t emit, void *arg)
+ *			invoke (*emit)(arg, name, kind, value) for each of its
+ *			metrics.  'kind' is BLOCK_STAT_COUNTER for numbers that only
+ *			go up (like the number of reads) or BLOCK_STAT_GAUGE for
+ *			current values (like the number of blocks cached).
+ *
+ * block_store_stats_json() walks a stack from the top down through the
+ * 'below' pointers and writes the metrics of every layer as JSON.
+ *
+ * Layers can pass hints about the I/O they do to the layers below without
+ * changing the methods above.  A hint applies to all operations that the
+ * current thread starts until it is changed:
+ *
+ *		unsigned int block_store_set_owner(unsigned int owner)
+ *			tag the operations with the owner (tenant) on whose behalf
+ *			they are done, such as an inode number, or BLOCK_NO_OWNER
+ *			(the default); returns the previous owner
+ *
+ *		unsigned int block_store_owner(void)
+ *			the owner of the operations of the current thread
+ *
+ *		int block_store_set_class(int cls)
+ *			tag the operations as accessing data (BLOCK_CLASS_DATA, the
+ *			default) or meta-data (BLOCK_CLASS_META), such as the
+ *			superblock, inode blocks, and indirect blocks of a file
+ *			system; returns the previous class
+ *
+ *		int block_store_class(void)
+ *			the class of the operations of the current thread
  */
 
 #define BLOCK_SIZE		512			// # bytes in a block
@@ -44,6 +129,18 @@ typedef struct block {
 	char bytes[BLOCK_SIZE];
 } block_t;
 
+typedef void (*block_done_t)(void *arg, int result);
+
+#define BLOCK_STAT_COUNTER	0
+#define BLOCK_STAT_GAUGE	1
+
+typedef void (*block_stat_t)(void *arg, char *name, int kind, double value);
+
+#define BLOCK_NO_OWNER		((unsigned int) -1)
+
+#define BLOCK_CLASS_DATA	0
+#define BLOCK_CLASS_META	1
+
 typedef struct block_store {
 	void *state;
 	int (*nblocks)(struct block_store *this_bs);
@@ -51,26 +148,126 @@ typedef struct block_store {
 	int (*write)(struct block_store *this_bs, block_no offset, block_t *block);
 	int (*setsize)(struct block_store *this_bs, block_no size);
 	void (*destroy)(struct block_store *this_bs);
+
+	/* Optional asynchronous methods.
+	 */
+	int (*read_async)(struct block_store *this_bs, block_no offset, block_t *block, block_done_t done, void *arg);
+	int (*write_async)(struct block_store *this_bs, block_no offset, block_t *block, block_done_t done, void *arg);
+	int (*poll)(struct block_store *this_bs, int wait);
+
+	/* Optional zero-copy reads.
+	 */
+	const block_t *(*borrow)(struct block_store *this_bs, block_no offset, block_t *buf);
+	void (*release)(struct block_store *this_bs, const block_t *block);
+
+	/* Optional vectored methods.
+	 */
+	int (*readv)(struct block_store *this_bs, block_no offset, block_t **blocks, unsigned int n);
+	int (*writev)(struct block_store *this_bs, block_no offset, block_t **blocks, unsigned int n);
+
+	/* Introspection.
+	 */
+	char *name;							// type of layer
+	struct block_store *below;			// layer below, or 0
+	void (*stats)(struct block_store *this_bs, block_stat_t emit, void *arg);
 } block_store_t;
 
 /* Convenient function for error handling.
  */
 void panic(char *s);
 
+/* Asynchronous access to any block store (see above).
+ */
+int block_store_read_async(block_store_t *bs, block_no offset, block_t *block, block_done_t done, void *arg);
+int block_store_write_async(block_store_t *bs, block_no offset, block_t *block, block_done_t done, void *arg);
+int block_store_poll(block_store_t *bs, int wait);
+
+/* Zero-copy reads from any block store (see above).
+ */
+const block_t *block_store_borrow(block_store_t *bs, block_no offset, block_t *buf);
+void block_store_release(block_store_t *bs, const block_t *block);
+
+/* Vectored access to any block store (see above).
+ */
+int block_store_readv(block_store_t *bs, block_no offset, block_t **blocks, unsigned int n);
+int block_store_writev(block_store_t *bs, block_no offset, block_t **blocks, unsigned int n);
+
+/* Hints to the layers below (see above).
+ */
+unsigned int block_store_set_owner(unsigned int owner);
+unsigned int block_store_owner(void);
+int block_store_set_class(int cls);
+int block_store_class(void);
+
+/* Write the metrics of 'top' and all layers below it as JSON to the given
+ * file ("-" for standard output).  Returns 0, or -1 upon error.
+ */
+int block_store_stats_json(block_store_t *top, char *file);
+
 /* Each block store module has an 'init' function that returns a
  * 'block_store_t *' type.  Here are the 'init' functions of various
  * available block store types.
  */
+block_store_t *disk_init(char *file_name, block_no nblocks);
 block_store_t *ramdisk_init(block_t *blocks, block_no nblocks);
+block_store_t *ramdisk_init_sparse(block_no nblocks);
 block_store_t *treedisk_init(block_store_t *below, unsigned int inode_no);
 block_store_t *debugdisk_init(block_store_t *below, char *descr);
 block_store_t *cachedisk_init(block_store_t *below, block_t *blocks, block_no nblocks);
+block_store_t *cachedisk_init_policy(block_store_t *below, block_t *blocks, block_no nblocks, char *policy);
+block_store_t *cachedisk_init_concurrent(block_store_t *below, block_t *blocks, block_no nblocks, char *policy, unsigned int nshards);
+block_store_t *cachedisk_init_warm(block_store_t *below, block_t *blocks, block_no nblocks, char *policy, char *state_file);
 block_store_t *statdisk_init(block_store_t *below);
 block_store_t *checkdisk_init(block_store_t *below, char *descr);
+block_store_t *checkdisk_init_digest(block_store_t *below, char *descr);
 block_store_t *tracedisk_init(block_store_t *below, char *trace, unsigned int n_inodes);
+block_store_t *tracedisk_init_async(block_store_t *below, char *trace, unsigned int n_inodes, unsigned int depth);
+block_store_t *tracedisk_init_parallel(block_store_t *below, char *trace, unsigned int n_inodes, unsigned int nthreads);
+block_store_t *tracedisk_init_digest(block_store_t *below, char *trace, unsigned int n_inodes, unsigned int depth, unsigned int nthreads);
+block_store_t *uringdisk_init(char *file_name, block_no nblocks, unsigned int depth);
+block_store_t *profiledisk_init(block_store_t *below);
+block_store_t *tiercache_init(block_store_t *below, block_store_t *fast, block_t *blocks, block_no nblocks);
+block_store_t *schedisk_init(block_store_t *below, unsigned int depth);
+block_store_t *stripedisk_init(block_store_t **stores, unsigned int n, block_no stripe_blocks);
+block_store_t *mirrordisk_init(block_store_t **stores, unsigned int n);
 
 /* Some useful functions on some block store types.
  */
 int treedisk_create(block_store_t *below, unsigned int n_inodes);
 int treedisk_check(block_store_t *below);
 void statdisk_dump_stats(block_store_t *this_bs);
+void cachedisk_dump_stats(block_store_t *this_bs);
+int cachedisk_set_quota(block_store_t *this_bs, unsigned int owner, block_no min, block_no max);
+int cachedisk_set_meta_reserve(block_store_t *this_bs, block_no nblocks);
+void cachedisk_set_dedup(block_store_t *this_bs, int on);
+int cachedisk_save_state(block_store_t *this_bs, char *path);
+int cachedisk_load_state(block_store_t *this_bs, char *path);
+void tracedisk_dump_stats(block_store_t *this_bs);
+int profiledisk_write_csv(block_store_t *this_bs, char *file);
+void tiercache_reset(block_store_t *this_bs);
+void tiercache_dump_stats(block_store_t *this_bs);
+void schedisk_dump_stats(block_store_t *this_bs);
+int mirrordisk_set_online(block_store_t *this_bs, unsigned int replica, int online);
+void mirrordisk_dump_stats(block_store_t *this_bs);
+
+/* Building a stack of block stores from a specification such as
+ * "ram:16384|stat|cache:lru:16|check" (see stack.c).
+ */
+struct stack;
+struct stack *stack_init(char *spec, unsigned int n_inodes);
+block_store_t *stack_top(struct stack *st);
+block_store_t *stack_bottom(struct stack *st);
+block_store_t *stack_find(struct stack *st, char *name);
+void stack_destroy(struct stack *st);
+
+/* Asynchronous interface of the uringdisk.  Each completion carries the
+ * tag given at submission and the result (0 or -1) of the request.
+ */
+struct uringdisk_completion {
+	void *tag;
+	int result;
+};
+int uringdisk_submit_read(block_store_t *this_bs, block_no offset, block_t *block, void *tag);
+int uringdisk_submit_write(block_store_t *this_bs, block_no offset, block_t *block, void *tag);
+int uringdisk_poll(block_store_t *this_bs, struct uringdisk_completion *done, int max);
+int uringdisk_wait(block_store_t *this_bs, struct uringdisk_completion *done, int max);
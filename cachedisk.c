@@ -13,226 +13,1325 @@
  *          NO OTHER MEMORY MAY BE USED FOR STORING DATA.  However,
  *          malloc etc. may be used for meta-data.
  *
+ *      block_store_t *cachedisk_init_policy(block_store_t *below,
+ *                                  block_t *blocks, block_no nblocks,
+ *                                  char *policy)
+ *          Same, but with the given replacement policy: "lru" (the
+ *          default), "fifo", "clock", "lfu", "random", or "gds".  Returns
+ *          0 if the policy is unknown.
+ *
+ *          "gds" is GreedyDual-Size: it measures the latency of reads
+ *          below per region of 1024 blocks, and prefers to keep blocks
+ *          that are expensive to get back, aging the others.  It also
+ *          runs an LRU cache of the same size on the side (offsets only)
+ *          to report how much miss cost it saved compared to LRU.
+ *
+ *      block_store_t *cachedisk_init_concurrent(block_store_t *below,
+ *                                  block_t *blocks, block_no nblocks,
+ *                                  char *policy, unsigned int nshards)
+ *          Same, but for many threads at once: the cache is split into
+ *          'nshards' shards by offset, each with its own lock, and a hit
+ *          only takes its lock for reading.  Hits then just mark the
+ *          block as referenced, so "lru" becomes an approximation that
+ *          gives referenced blocks at the tail a second chance ("lfu" and
+ *          "gds" still take the lock for writing).
+ *
+ *      block_store_t *cachedisk_init_warm(block_store_t *below,
+ *                                  block_t *blocks, block_no nblocks,
+ *                                  char *policy, char *state_file)
+ *          Same, but if 'state_file' exists, the cache starts out warm
+ *          with the blocks listed in it (see cachedisk_load_state), and
+ *          upon destroy the cached blocks are saved to it again.
+ *
+ *      int cachedisk_save_state(block_store_t *this_bs, char *path)
+ *          Writes the offsets of the cached blocks, in the order of the
+ *          replacement policy (the block to keep longest first), to the
+ *          given file.  Only meta-data is saved.  Returns 0, or -1 upon
+ *          error.
+ *
+ *      int cachedisk_load_state(block_store_t *this_bs, char *path)
+ *          Fills an empty cache with the blocks listed in the file,
+ *          reading their content from the layer below into the cache
+ *          memory.  Returns 0, or -1 upon error (leaving the cache
+ *          empty).
+ *
+ *      int cachedisk_set_quota(block_store_t *this_bs, unsigned int owner,
+ *                                  block_no min, block_no max)
+ *          Reserves 'min' blocks of the cache for the given owner (see
+ *          block_store_set_owner), and caps it at 'max' blocks (0 for
+ *          no cap).  A reservation keeps the blocks of the owner from
+ *          being evicted for other owners while it has no more than
+ *          'min' blocks cached; it does not set aside empty blocks.  An
+ *          owner at its cap replaces its own blocks.  Returns 0, or -1
+ *          if the owner is out of range or the reservations do not fit.
+ *
+ *      int cachedisk_set_meta_reserve(block_store_t *this_bs, block_no nblocks)
+ *          Gives meta-data (accesses of class BLOCK_CLASS_META, see
+ *          block_store_set_class) a protected segment of 'nblocks'
+ *          blocks: while no more meta-data than that is cached, it is
+ *          only evicted for other meta-data, so that scans through data
+ *          do not flush it.  Returns 0, or -1 if it does not fit.
+ *
+ *      void cachedisk_set_dedup(block_store_t *this_bs, int on)
+ *          If 'on', a write that hits a cached block with the same
+ *          content is not passed on to the layer below (it is counted
+ *          as a write hit), unless an asynchronous write of that block
+ *          is still on its way there.  Off by default, so that every
+ *          write goes through.
+ *
  *      void cachedisk_dump_stats(block_store_t *this_bs)
- *          Prints cache statistics.
+ *          Prints cache statistics, including hits and misses per owner
+ *          and of meta-data.
+ *
+ * A cachedisk implements borrow and release (see block_store.h): a read
+ * hit can be lent out as a pointer into the cache memory, which pins the
+ * block until it is released.  A borrowed block is never evicted or
+ * overwritten: a write of its offset detaches the frame from the offset
+ * and caches the new content in another slot (or not at all if every
+ * candidate is borrowed), and the frame is reused after its last release.
+ *
+ * Cache slot i holds its block in blocks[i].  The slots caching a block
+ * are found through a hash table on the offset.  Each cachedisk has its
+ * own state, so several may be used at the same time.  A cachedisk may
+ * also be used by several threads at once: each shard has a read-write
+ * lock that is not held while waiting for the layer below.  A write also
+ * holds a lock on its offset (one of CACHE_WRITE_LOCKS, hashed) from the
+ * write below until the cache is updated, so that writes of the same block
+ * reach the cache in the same order as the layer below.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 #include "block_store.h"
 
-/* State contains the pointer to the block module below as well as caching
- * information and caching statistics.
+#define NIL     ((block_no) -1)     // no slot
+
+/* Owners are tracked by index: 0 for untagged operations and owner + 1
+ * for the others.  Owners beyond the table are counted as untagged.
  */
-struct cachedisk_state {
-    block_store_t *below;               // block store below
+#define CACHE_MAX_OWNERS    256
+
+#define CACHE_WRITE_LOCKS   64                  // per offset, hashed
+
+enum cache_policy { POLICY_LRU, POLICY_FIFO, POLICY_CLOCK, POLICY_LFU, POLICY_RANDOM, POLICY_GDS };
+
+static char *policy_names[] = { "lru", "fifo", "clock", "lfu", "random", "gds" };
+
+/* GreedyDual-Size keeps an estimate of the cost of a miss per region of
+ * the block store below, measured as the latency of reads below.
+ */
+#define CACHE_REGION_SHIFT  10                  // 1024 blocks per region
+#define CACHE_NREGIONS      4096                // the last one takes the rest
+
+/* Meta-data of a cache slot.  'prev' and 'next' link the slots on the
+ * LRU or FIFO list (most recent first), and 'heap' is the position in
+ * the LFU or GDS heap.
+ */
+struct cache_slot {
+    block_no offset;            // block cached here
+    block_no chain;             // next slot in hash bucket
+    block_no prev, next;
+    block_no heap;
+    uint64_t key;               // LFU: frequency and age; GDS: value
+    int referenced;             // CLOCK, lazy LRU: referenced since last sweep
+    unsigned int owner;         // index of the owner that brought it in
+    int meta;                   // holds meta-data
+    unsigned int pins;          // # times borrowed and not yet released
+    unsigned int writing;       // # async writes of the frame still going below
+};
+
+/* Quota and stats of an owner within a shard.
+ */
+struct cache_owner {
+    block_no min, max;          // reservation and cap (0 = none)
+    block_no resident;          // # blocks cached
+    unsigned int read_hit, read_miss, write_hit, write_miss;
+};
+
+/* A shard of the cache: a share of the cache memory with its own slots,
+ * replacement state, stats, and lock.  A cachedisk has one shard unless
+ * it was created with cachedisk_init_concurrent.
+ */
+struct cache_shard {
     block_t *blocks;            // memory for caching blocks
-    block_no nblocks;           // size of cache (not size of block store!)
+    block_no nblocks;           // size of the shard
+
+    enum cache_policy policy;
+    int lazy;                   // hits only take the lock for reading
+    struct cache_slot *slots;
+    block_no nused;             // slots 0..nused-1 are in use
+    block_no *buckets;          // hash table of slots by offset
+    block_no nbuckets;          // power of 2
+    block_no head, tail;        // LRU/FIFO list
+    block_no hand;              // CLOCK hand
+    block_no *heap;             // LFU/GDS min-heap of slots
+    uint64_t tick;              // LFU: # accesses so far
+    uint64_t inflation;         // GDS: value of the last block evicted
+    uint64_t *costs;            // GDS: miss cost per region (shared), or 0
+    unsigned int seed;          // RANDOM
 
-    /* Stats.
+    struct cache_owner *owners; // CACHE_MAX_OWNERS of them
+    block_no meta_min;          // size of the meta-data segment
+    block_no meta_resident;     // # blocks of meta-data cached
+    int restricted;             // there are quotas or a meta-data segment
+    unsigned int npinned;       // # borrowed blocks (updated atomically)
+
+    /* Stats.  The read counters are updated atomically, as lazy hits
+     * only hold the lock for reading.
      */
     unsigned int read_hit, read_miss, write_hit, write_miss;
+    unsigned int meta_read_hit, meta_read_miss;
+    uint64_t miss_cost;         // GDS: estimated cost of the read misses
+    unsigned long copied;       // # bytes copied out on read hits (atomic)
+    unsigned long borrowed;     // # read hits lent out instead (atomic)
+    unsigned int write_dedup;   // # write hits not written below
+
+    /* GDS: a cache of the same size without the blocks themselves, to
+     * see what the misses would have cost under LRU.
+     */
+    struct cache_shard *shadow;
+
+    unsigned long write_seq;    // #writes so far (for concurrent misses)
+
+    /* Protects the shard.  It is not held while waiting for the layer
+     * below, so that misses can proceed in parallel.
+     */
+    pthread_rwlock_t lock;
 };
 
-// a double linkedlist
-struct LinkedList{
-    block_no key;
-    int cache_offset;
-    struct LinkedList *pre;
-    struct LinkedList *next;
+/* State contains the pointer to the block module below as well as the
+ * shards of the cache.
+ */
+struct cachedisk_state {
+    block_store_t *below;       // block store below
+    block_t *blocks;            // memory for caching blocks
+    block_no nblocks;           // size of cache (not size of block store!)
+    enum cache_policy policy;
+
+    struct cache_shard *shards;
+    unsigned int nshards;
+
+    char *state_file;           // where to save the index upon destroy, or 0
+    block_no warm_loaded;       // # blocks loaded from a saved index
+
+    struct cache_quota {
+        block_no min, max;
+    } *quotas;                  // per owner index, or 0 if none were set
+    block_no reserved;          // sum of the reservations
+    block_no meta_reserve;      // size of the meta-data segment
+
+    uint64_t *costs;            // GDS: miss cost (ns) per region, or 0
+    int dedup;                  // skip writes that do not change the block
+
+    pthread_mutex_t write_locks[CACHE_WRITE_LOCKS];     // per offset
 };
-//def DLL as double linkedlist pointer
-typedef struct LinkedList *DLL;
-
-struct cache {
-    DLL head;
-    DLL tail;
-    block_no capacity;
-    block_no cnt;
+
+static block_no cache_hash(struct cache_shard *sh, block_no offset) {
+    return (offset * 2654435761U) & (sh->nbuckets - 1);
+}
+
+/* Find the slot caching 'offset', or NIL if it is not cached.
+ */
+static block_no lookup(struct cache_shard *sh, block_no offset) {
+    block_no s;
+
+    for (s = sh->buckets[cache_hash(sh, offset)]; s != NIL; s = sh->slots[s].chain) {
+        if (sh->slots[s].offset == offset) {
+            break;
+        }
+    }
+    return s;
+}
+
+static void hash_insert(struct cache_shard *sh, block_no s) {
+    block_no h = cache_hash(sh, sh->slots[s].offset);
+
+    sh->slots[s].chain = sh->buckets[h];
+    sh->buckets[h] = s;
+}
+
+static void hash_remove(struct cache_shard *sh, block_no s) {
+    block_no *ps = &sh->buckets[cache_hash(sh, sh->slots[s].offset)];
+
+    while (*ps != s) {
+        ps = &sh->slots[*ps].chain;
+    }
+    *ps = sh->slots[s].chain;
+}
+
+/* The LRU/FIFO list.
+ */
+static void list_remove(struct cache_shard *sh, block_no s) {
+    struct cache_slot *cl = &sh->slots[s];
+
+    if (cl->prev == NIL) {
+        sh->head = cl->next;
+    } else {
+        sh->slots[cl->prev].next = cl->next;
+    }
+    if (cl->next == NIL) {
+        sh->tail = cl->prev;
+    } else {
+        sh->slots[cl->next].prev = cl->prev;
+    }
+}
+
+static void list_push(struct cache_shard *sh, block_no s) {
+    struct cache_slot *cl = &sh->slots[s];
+
+    cl->prev = NIL;
+    cl->next = sh->head;
+    if (sh->head == NIL) {
+        sh->tail = s;
+    } else {
+        sh->slots[sh->head].prev = s;
+    }
+    sh->head = s;
+}
+
+/* The LFU heap, ordered by key.
+ */
+static void heap_set(struct cache_shard *sh, block_no i, block_no s) {
+    sh->heap[i] = s;
+    sh->slots[s].heap = i;
+}
+
+static void heap_down(struct cache_shard *sh, block_no i) {
+    block_no s = sh->heap[i];
+
+    for (;;) {
+        block_no c = 2 * i + 1;
+        if (c >= sh->nused) {
+            break;
+        }
+        if (c + 1 < sh->nused && sh->slots[sh->heap[c + 1]].key < sh->slots[sh->heap[c]].key) {
+            c++;
+        }
+        if (sh->slots[sh->heap[c]].key >= sh->slots[s].key) {
+            break;
+        }
+        heap_set(sh, i, sh->heap[c]);
+        i = c;
+    }
+    heap_set(sh, i, s);
+}
+
+static void heap_up(struct cache_shard *sh, block_no i) {
+    block_no s = sh->heap[i];
+
+    while (i > 0 && sh->slots[sh->heap[(i - 1) / 2]].key > sh->slots[s].key) {
+        heap_set(sh, i, sh->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heap_set(sh, i, s);
+}
+
+/* LFU key: frequency first, then least recently used.
+ */
+static void lfu_touch(struct cache_shard *sh, block_no s, int fresh) {
+    uint64_t freq = fresh ? 1 : (sh->slots[s].key >> 40) + 1;
+
+    sh->slots[s].key = (freq << 40) | (++sh->tick & ((1ULL << 40) - 1));
+}
+
+static uint64_t region_cost(uint64_t *costs, block_no offset) {
+    block_no r = offset >> CACHE_REGION_SHIFT;
+
+    return __atomic_load_n(&costs[r < CACHE_NREGIONS ? r : CACHE_NREGIONS - 1], __ATOMIC_RELAXED);
+}
+
+/* GDS value: what it would cost to get the block back, on top of the
+ * value of the last block evicted, so that blocks that are not accessed
+ * again age.
+ */
+static void gds_touch(struct cache_shard *sh, block_no s) {
+    sh->slots[s].key = sh->inflation + region_cost(sh->costs, sh->slots[s].offset);
+}
+
+/* The replacement policy hooks.  'policy_insert' is called for a slot that
+ * just got a new block, 'policy_hit' for a slot that was accessed again,
+ * and 'policy_victim' picks the slot to evict from a full cache.
+ */
+static void policy_insert(struct cache_shard *sh, block_no s, int fresh) {
+    sh->slots[s].referenced = 0;
+    switch (sh->policy) {
+    case POLICY_LRU:
+    case POLICY_FIFO:
+        if (!fresh) {
+            list_remove(sh, s);
+        }
+        list_push(sh, s);
+        break;
+    case POLICY_CLOCK:
+        break;
+    case POLICY_LFU:
+        lfu_touch(sh, s, 1);
+        if (fresh) {
+            sh->heap[sh->nused - 1] = s;
+            heap_up(sh, sh->nused - 1);
+        } else {
+            block_no i = sh->slots[s].heap;
+            heap_up(sh, i);
+            heap_down(sh, sh->slots[s].heap);
+        }
+        break;
+    case POLICY_GDS:
+        if (!fresh && sh->slots[s].key > sh->inflation) {
+            sh->inflation = sh->slots[s].key;   // the victim's
+        }
+        gds_touch(sh, s);
+        if (fresh) {
+            sh->heap[sh->nused - 1] = s;
+            heap_up(sh, sh->nused - 1);
+        } else {
+            heap_up(sh, sh->slots[s].heap);
+            heap_down(sh, sh->slots[s].heap);
+        }
+        break;
+    case POLICY_RANDOM:
+        break;
+    }
+}
+
+static void policy_hit(struct cache_shard *sh, block_no s) {
+    if (sh->lazy) {
+        if (!sh->slots[s].referenced) {
+            __atomic_store_n(&sh->slots[s].referenced, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    switch (sh->policy) {
+    case POLICY_LRU:
+        list_remove(sh, s);
+        list_push(sh, s);
+        break;
+    case POLICY_CLOCK:
+        sh->slots[s].referenced = 1;
+        break;
+    case POLICY_LFU:
+        lfu_touch(sh, s, 0);
+        heap_down(sh, sh->slots[s].heap);
+        break;
+    case POLICY_GDS:
+        gds_touch(sh, s);
+        heap_up(sh, sh->slots[s].heap);
+        heap_down(sh, sh->slots[s].heap);
+        break;
+    case POLICY_FIFO:
+    case POLICY_RANDOM:
+        break;
+    }
+}
+
+static block_no policy_victim(struct cache_shard *sh) {
+    block_no s;
+
+    switch (sh->policy) {
+    case POLICY_CLOCK:
+        for (;;) {
+            s = sh->hand;
+            sh->hand = (sh->hand + 1) % sh->nblocks;
+            if (!sh->slots[s].referenced) {
+                return s;
+            }
+            sh->slots[s].referenced = 0;
+        }
+    case POLICY_LFU:
+    case POLICY_GDS:
+        return sh->heap[0];
+    case POLICY_RANDOM:
+        return rand_r(&sh->seed) % sh->nblocks;
+    default:
+        /* A lazy LRU gives referenced blocks a second chance instead.
+         */
+        while (sh->lazy && sh->policy == POLICY_LRU && sh->slots[sh->tail].referenced) {
+            s = sh->tail;
+            sh->slots[s].referenced = 0;
+            list_remove(sh, s);
+            list_push(sh, s);
+        }
+        return sh->tail;
+    }
+}
+
+static unsigned int owner_index(unsigned int owner) {
+    return owner < CACHE_MAX_OWNERS - 1 ? owner + 1 : 0;
+}
+
+/* The hints of the layers above about the current access.
+ */
+struct cache_hint {
+    unsigned int owner;         // owner index
+    int meta;                   // meta-data (BLOCK_CLASS_META)
 };
-// A hash (Collection of pointers to Queue Nodes)
-typedef struct Hash {
-    int capacity; // how many pages can be there
-    DLL *array; // an array of queue nodes
-} Hash;
-
-// A utility function to create an empty Hash of given capacity
-Hash* createHash(int capacity ) {
-    // Allocate memory for hash
-    Hash* hash = (Hash *) malloc( sizeof( Hash) );
-    hash->capacity = capacity;
-
-    // Create an array of pointers for refering queue nodes
-    hash->array = (DLL*) malloc( hash->capacity * sizeof( DLL ) );
-
-    // Initialize all hash entries as empty
-    int i;
-    for( i = 0; i < hash->capacity; ++i )
-        hash->array[i] = NULL;
-    return hash;
-}
-
-DLL createNode(){
-    DLL temp; // declare a node
-    temp = (DLL) malloc(sizeof(struct LinkedList)); // allocate memory using malloc()
-    temp->pre = NULL;
-    temp->next = NULL;// make next point to NULL
-    return temp;//return the new node
-}
-
-static struct cache *mycache;
-static Hash* hashmap;
-
-void init_cache() {
-    mycache = malloc(sizeof(*mycache));
-    mycache->cnt = 0;
-    mycache->head = createNode();
-    mycache->tail = createNode();
-    mycache->head->key = -1;
-    mycache->tail->key = -1; //unsigned ???
-    mycache->head->next = mycache->tail;
-    mycache->tail->pre = mycache->head;
-}
-
-// static DLL find(struct cache *mycache, block_no offset) {
-//     DLL ptr = mycache->head;
-//     while (ptr->next != NULL && ptr->key != offset) {
-//         ptr = ptr->next;
-//     }
-//     //printf("go out");
-//     return ptr;
-// }
-
-static int add_to_head(struct cache *mycache, DLL ptr) {
-    DLL tmp_next = mycache->head->next;
-    ptr->next = tmp_next;
-    ptr->pre = mycache->head;
-    tmp_next->pre = ptr;
-    mycache->head->next = ptr;
-    hashmap->array[ptr->key % hashmap->capacity] = ptr;
-    return 0;
+
+static const struct cache_hint untagged = { 0, 0 };
+
+static void cache_hint_get(struct cache_hint *h) {
+    h->owner = owner_index(block_store_owner());
+    h->meta = block_store_class() == BLOCK_CLASS_META;
 }
 
-static int delete(DLL ptr) {
-    DLL tmp_pre = ptr->pre;
-    DLL tmp_next = ptr->next;
-    tmp_pre->next = tmp_next;
-    tmp_next->pre = tmp_pre;
-    //need to free ptr???
-    return 0;
+static int owner_full(struct cache_shard *sh, unsigned int o) {
+    return sh->owners[o].max != 0 && sh->owners[o].resident >= sh->owners[o].max;
 }
 
+static int slot_pinned(struct cache_shard *sh, block_no s) {
+    return __atomic_load_n(&sh->slots[s].pins, __ATOMIC_RELAXED) != 0;
+}
 
-static int cachedisk_read(block_store_t *this_bs, block_no offset, block_t *block){
-    struct cachedisk_state *cs = this_bs->state;
+/* May slot s be evicted to make room for a block with hints h?  Borrowed
+ * blocks are never evicted.  Meta-data
+ * is not evicted for data while it fits in its segment.  An owner at its
+ * cap has to give up one of its own blocks, and other owners keep their
+ * reservations.
+ */
+static int victim_ok(struct cache_shard *sh, block_no s, const struct cache_hint *h) {
+    struct cache_owner *co = &sh->owners[sh->slots[s].owner];
+
+    if (slot_pinned(sh, s)) {
+        return 0;
+    }
+    if (sh->slots[s].meta && !h->meta && sh->meta_resident <= sh->meta_min) {
+        return 0;
+    }
+    if (owner_full(sh, h->owner)) {
+        return sh->slots[s].owner == h->owner;
+    }
+    return sh->slots[s].owner == h->owner || co->resident > co->min;
+}
+
+/* The victim of the policy if it is not borrowed, else any slot that is
+ * not, or NIL if all of them are.
+ */
+static block_no policy_victim_unpinned(struct cache_shard *sh) {
+    block_no s = policy_victim(sh);
+
+    if (!slot_pinned(sh, s)) {
+        return s;
+    }
+    for (s = 0; s < sh->nused; s++) {
+        if (!slot_pinned(sh, s)) {
+            return s;
+        }
+    }
+    return NIL;
+}
+
+/* Like policy_victim, but only picks a slot that victim_ok allows (if
+ * there is one), and never a borrowed one.  The cache need not be full.
+ * Returns NIL if every slot is borrowed.
+ */
+static block_no policy_victim_for(struct cache_shard *sh, const struct cache_hint *h) {
+    block_no s, i, best = NIL;
 
-    // TODO: check the cache first.  Otherwise read from the underlying
-    //       store and, if so desired, place the new block in the cache,
-    //       possibly evicting a block if there is no space.
-    DLL node = hashmap->array[offset % hashmap->capacity];
-    if (node == NULL || node->key != offset) {
-        cs->read_miss++;
-        (*cs->below->read)(cs->below, offset, block);
-        if (mycache->cnt == mycache->capacity) {
-            DLL evictNode = mycache->tail->pre;
-            evictNode->key = offset;
-            memcpy(&cs->blocks[evictNode->cache_offset], block, BLOCK_SIZE);
-            delete(evictNode);
-            add_to_head(mycache, evictNode);
-            hashmap->array[offset % hashmap->capacity] = evictNode;
+    if (sh->nused == sh->nblocks && victim_ok(sh, s = policy_victim(sh), h)) {
+        return s;
+    }
+    switch (sh->policy) {
+    case POLICY_LRU:
+    case POLICY_FIFO:
+        for (s = sh->tail; s != NIL; s = sh->slots[s].prev) {
+            if (victim_ok(sh, s, h)) {
+                return s;
+            }
+        }
+        break;
+    case POLICY_CLOCK:
+        for (i = 0; i < 2 * sh->nused; i++) {
+            s = sh->hand % sh->nused;
+            sh->hand = (s + 1) % sh->nblocks;
+            if (victim_ok(sh, s, h)) {
+                if (!sh->slots[s].referenced) {
+                    return s;
+                }
+                sh->slots[s].referenced = 0;
+            }
+        }
+        break;
+    case POLICY_LFU:
+    case POLICY_GDS:
+        for (i = 0; i < sh->nused; i++) {
+            s = sh->heap[i];
+            if (victim_ok(sh, s, h) && (best == NIL || sh->slots[s].key < sh->slots[best].key)) {
+                best = s;
+            }
+        }
+        if (best != NIL) {
+            return best;
+        }
+        break;
+    case POLICY_RANDOM:
+        s = rand_r(&sh->seed) % sh->nused;
+        for (i = 0; i < sh->nused; i++, s = (s + 1) % sh->nused) {
+            if (victim_ok(sh, s, h)) {
+                return s;
+            }
+        }
+        break;
+    }
+
+    /* Everybody is within their reservation.  (An owner at its cap has
+     * blocks of its own, so the cache is full here.)
+     */
+    return policy_victim_unpinned(sh);
+}
+
+/* Set whether slot s holds meta-data.
+ */
+static void slot_set_meta(struct cache_shard *sh, block_no s, int meta) {
+    sh->meta_resident += meta - sh->slots[s].meta;
+    sh->slots[s].meta = meta;
+}
+
+/* Find or make the slot for 'offset' for an access with hints h, evicting
+ * a block according to the replacement policy (and the quotas) if needed,
+ * and count it as an access.  Returns NIL if every slot is borrowed.
+ */
+static block_no cache_slot(struct cache_shard *sh, block_no offset, const struct cache_hint *h) {
+    block_no s = lookup(sh, offset);
+
+    if (s != NIL) {
+        policy_hit(sh, s);
+    } else {
+        int fresh = sh->nused < sh->nblocks && !(sh->restricted && owner_full(sh, h->owner));
+        if (fresh) {
+            s = sh->nused++;
+            sh->slots[s].meta = 0;
         } else {
-            DLL newnode = createNode(); // need allocate???
-            newnode->key = offset;
-            newnode->cache_offset = mycache->cnt;
-            memcpy(&cs->blocks[newnode->cache_offset], block, BLOCK_SIZE);
-            mycache->cnt++;
-            add_to_head(mycache, newnode);
-            hashmap->array[offset % hashmap->capacity] = newnode;
+            s = sh->restricted || __atomic_load_n(&sh->npinned, __ATOMIC_RELAXED) != 0 ?
+                            policy_victim_for(sh, h) : policy_victim(sh);
+            if (s == NIL) {
+                return NIL;
+            }
+            if (sh->slots[s].offset != NIL) {
+                hash_remove(sh, s);
+            }
+            sh->owners[sh->slots[s].owner].resident--;
+        }
+        sh->slots[s].offset = offset;
+        sh->slots[s].owner = h->owner;
+        sh->owners[h->owner].resident++;
+        hash_insert(sh, s);
+        policy_insert(sh, s, fresh);
+    }
+    slot_set_meta(sh, s, h->meta);
+    return s;
+}
+
+/* Store *block as the content of 'offset'.  A borrowed frame is not
+ * overwritten but detached: it no longer caches any offset, and is evicted
+ * like any other slot once it is released.
+ */
+static void cache_put(struct cache_shard *sh, block_no offset, block_t *block,
+                                            const struct cache_hint *h) {
+    block_no s = lookup(sh, offset);
+
+    if (s != NIL && slot_pinned(sh, s)) {
+        hash_remove(sh, s);
+        sh->slots[s].offset = NIL;
+    }
+    s = cache_slot(sh, offset, h);
+    if (s != NIL) {
+        memcpy(&sh->blocks[s], block, BLOCK_SIZE);
+    }
+}
+
+/* GDS: run an access through the shadow LRU cache, and add up the cost
+ * of the read misses of both.
+ */
+static void shadow_access(struct cache_shard *sh, block_no offset, int read, int miss) {
+    uint64_t cost = region_cost(sh->costs, offset);
+
+    if (read && miss) {
+        sh->miss_cost += cost;
+    }
+    if (read && lookup(sh->shadow, offset) == NIL) {
+        sh->shadow->miss_cost += cost;
+    }
+    cache_slot(sh->shadow, offset, &untagged);
+}
+
+/* Look up 'offset' for a read and count it.  Returns the slot on a hit.
+ * Otherwise, remembers the write sequence number in *seq and returns NIL.
+ * Called with the lock held (for reading only if the shard is lazy).
+ */
+static block_no cache_access(struct cache_shard *sh, block_no offset,
+                                            unsigned long *seq, const struct cache_hint *h) {
+    block_no s = lookup(sh, offset);
+    if (s == NIL) {
+        __atomic_add_fetch(&sh->read_miss, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&sh->owners[h->owner].read_miss, 1, __ATOMIC_RELAXED);
+        if (h->meta) {
+            __atomic_add_fetch(&sh->meta_read_miss, 1, __ATOMIC_RELAXED);
         }
+        if (sh->shadow != 0) {
+            shadow_access(sh, offset, 1, 1);
+        }
+        *seq = sh->write_seq;
+        return NIL;
+    }
+    __atomic_add_fetch(&sh->read_hit, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sh->owners[h->owner].read_hit, 1, __ATOMIC_RELAXED);
+    if (h->meta) {
+        __atomic_add_fetch(&sh->meta_read_hit, 1, __ATOMIC_RELAXED);
+    }
+    if (sh->shadow != 0) {
+        shadow_access(sh, offset, 1, 0);
+    }
+    policy_hit(sh, s);
+    return s;
+}
 
+/* On a hit, copy the block out and return 1.  Otherwise return 0 (see
+ * cache_access).
+ */
+static int cache_get(struct cache_shard *sh, block_no offset, block_t *block,
+                                            unsigned long *seq, const struct cache_hint *h) {
+    block_no s = cache_access(sh, offset, seq, h);
+
+    if (s == NIL) {
+        return 0;
+    }
+    memcpy(block, &sh->blocks[s], BLOCK_SIZE);
+    __atomic_add_fetch(&sh->copied, BLOCK_SIZE, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* Cache a block read from below after a miss.  If there was a write in
+ * the mean time, the block may be stale, so it is not cached.  Called with
+ * the lock held.
+ */
+static void cache_fill(struct cache_shard *sh, block_no offset, block_t *block,
+                                            unsigned long seq, const struct cache_hint *h) {
+    if (seq == sh->write_seq) {
+        cache_put(sh, offset, block, h);
+    }
+}
+
+/* Update the cache for a write.  Called with the lock held.
+ */
+static void cache_write(struct cache_shard *sh, block_no offset, block_t *block,
+                                            const struct cache_hint *h) {
+    sh->write_seq++;
+    if (lookup(sh, offset) == NIL) {
+        sh->write_miss++;
+        sh->owners[h->owner].write_miss++;
     } else {
-        cs->read_hit++;
-        //printf("here %i, %i\n", node->key, node->cache_offset);
+        sh->write_hit++;
+        sh->owners[h->owner].write_hit++;
+    }
+    if (sh->shadow != 0) {
+        shadow_access(sh, offset, 0, 0);
+    }
+    cache_put(sh, offset, block, h);
+}
+
+static uint64_t cache_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* GDS: fold the latency of a read below into the cost of its region (a
+ * moving average).  Races between threads only lose a sample.
+ */
+static void cache_cost_sample(struct cachedisk_state *cs, block_no offset, uint64_t ns) {
+    block_no r = offset >> CACHE_REGION_SHIFT;
+    uint64_t *cost = &cs->costs[r < CACHE_NREGIONS ? r : CACHE_NREGIONS - 1];
+    uint64_t old = __atomic_load_n(cost, __ATOMIC_RELAXED);
 
-        memcpy(block, &cs->blocks[node->cache_offset], BLOCK_SIZE);
-        //memcpy(block, cs->blocks, BLOCK_SIZE);
-        delete(node);
-        add_to_head(mycache, node);
+    __atomic_store_n(cost, old == 0 ? ns : old - old / 8 + ns / 8, __ATOMIC_RELAXED);
+}
+
+/* If the cache already holds *block at 'offset', count a write hit that
+ * need not go below, and return 1.  Otherwise return 0.  As the cache is
+ * write-through, the layer below has the same content, but only once no
+ * asynchronous write from the frame is still on its way there (it may yet
+ * fail).  Called with the lock held.
+ */
+static int cache_write_unchanged(struct cache_shard *sh, block_no offset, block_t *block,
+                                            const struct cache_hint *h) {
+    block_no s = lookup(sh, offset);
+
+    if (s == NIL || sh->slots[s].writing != 0 || memcmp(&sh->blocks[s], block, BLOCK_SIZE) != 0) {
+        return 0;
+    }
+    sh->write_hit++;
+    sh->owners[h->owner].write_hit++;
+    sh->write_dedup++;
+    if (sh->shadow != 0) {
+        shadow_access(sh, offset, 0, 0);
+    }
+    cache_slot(sh, offset, h);
+    return 1;
+}
+
+/* The shard that caches 'offset'.  Uses the high bits of the product, as
+ * the hash table within the shard uses the low bits.
+ */
+static struct cache_shard *shard_of(struct cachedisk_state *cs, block_no offset) {
+    return &cs->shards[((offset * 2654435761U) >> 16) % cs->nshards];
+}
+
+/* Take the lock of a shard for a lookup that may be a hit.
+ */
+static void shard_lock_get(struct cache_shard *sh) {
+    if (sh->lazy) {
+        pthread_rwlock_rdlock(&sh->lock);
+    } else {
+        pthread_rwlock_wrlock(&sh->lock);
+    }
+}
+
+static int cachedisk_read(block_store_t *this_bs, block_no offset, block_t *block){
+    struct cachedisk_state *cs = this_bs->state;
+    struct cache_shard *sh = shard_of(cs, offset);
+    struct cache_hint h;
+    unsigned long seq;
+
+    cache_hint_get(&h);
+    shard_lock_get(sh);
+    int hit = cache_get(sh, offset, block, &seq, &h);
+    pthread_rwlock_unlock(&sh->lock);
+    if (hit) {
+        return 0;
+    }
+
+    uint64_t start = cs->costs == 0 ? 0 : cache_now();
+    if ((*cs->below->read)(cs->below, offset, block) < 0) {
+        return -1;
+    }
+    if (cs->costs != 0) {
+        cache_cost_sample(cs, offset, cache_now() - start);
     }
+    pthread_rwlock_wrlock(&sh->lock);
+    cache_fill(sh, offset, block, seq, &h);
+    pthread_rwlock_unlock(&sh->lock);
     return 0;
 }
 
 static int cachedisk_write(block_store_t *this_bs, block_no offset, block_t *block){
     struct cachedisk_state *cs = this_bs->state;
+    struct cache_shard *sh = shard_of(cs, offset);
+    struct cache_hint h;
 
-    // TODO: check the cache first.  Otherwise read from the underlying
-    //       store and, if so desired, place the new block in the cache,
-    //       possibly evicting a block if there is no space.
+    pthread_mutex_t *wlock = &cs->write_locks[offset % CACHE_WRITE_LOCKS];
+
+    cache_hint_get(&h);
+    pthread_mutex_lock(wlock);
+    if (cs->dedup) {
+        pthread_rwlock_wrlock(&sh->lock);
+        int same = cache_write_unchanged(sh, offset, block, &h);
+        pthread_rwlock_unlock(&sh->lock);
+        if (same) {
+            pthread_mutex_unlock(wlock);
+            return 0;
+        }
+    }
     if ((*cs->below->write)(cs->below, offset, block) < 0 ) {
+        pthread_mutex_unlock(wlock);
         return -1;
     }
-    DLL node = hashmap->array[offset % hashmap->capacity];
-    if (node == NULL || node->key != offset) {
-        cs->write_miss++;
-        if (mycache->cnt == mycache->capacity) {
-            DLL evictNode = mycache->tail->pre;
-            evictNode->key = offset;
-            //printf("full%i\n", evictNode->cache_offset);
-            memcpy(&cs->blocks[evictNode->cache_offset], block, BLOCK_SIZE);
-            delete(evictNode);
-            add_to_head(mycache, evictNode);
-            hashmap->array[offset % hashmap->capacity] = evictNode;
-            //memcpy(cs->blocks, block, BLOCK_SIZE);
-            //memset(&cs->blocks + node->cache_offset, 0, BLOCK_SIZE);
-            //free(evictNode);
-            //(*cs->below->read)(cs->below, offset, &cs->blocks[node->cache_offset]);
-        } else {
-            DLL newnode = createNode(); // need allocate???
-            newnode->key = offset;
-            newnode->cache_offset = mycache->cnt;
-            memcpy(&cs->blocks[newnode->cache_offset], block, BLOCK_SIZE);
-            //memcpy(cs->blocks, block, BLOCK_SIZE);
-            //(*cs->below->read)(cs->below, offset, &cs->blocks[mycache->cnt]);
-            mycache->cnt++;
-            //printf("new node offset, %i, %i\n", newnode->key, newnode->cache_offset);
-            add_to_head(mycache, newnode);
-            hashmap->array[offset % hashmap->capacity] = newnode;
+    pthread_rwlock_wrlock(&sh->lock);
+    cache_write(sh, offset, block, &h);
+    pthread_rwlock_unlock(&sh->lock);
+    pthread_mutex_unlock(wlock);
+    return 0;
+}
+
+/* Lend out the frame on a hit, pinning it.  A miss is read into 'buf'
+ * and cached as usual.
+ */
+static const block_t *cachedisk_borrow(block_store_t *this_bs, block_no offset, block_t *buf){
+    struct cachedisk_state *cs = this_bs->state;
+    struct cache_shard *sh = shard_of(cs, offset);
+    struct cache_hint h;
+    unsigned long seq;
+
+    cache_hint_get(&h);
+    shard_lock_get(sh);
+    block_no s = cache_access(sh, offset, &seq, &h);
+    if (s != NIL) {
+        __atomic_add_fetch(&sh->slots[s].pins, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&sh->npinned, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&sh->borrowed, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    if (s != NIL) {
+        return &sh->blocks[s];
+    }
+
+    uint64_t start = cs->costs == 0 ? 0 : cache_now();
+    if ((*cs->below->read)(cs->below, offset, buf) < 0) {
+        return 0;
+    }
+    if (cs->costs != 0) {
+        cache_cost_sample(cs, offset, cache_now() - start);
+    }
+    pthread_rwlock_wrlock(&sh->lock);
+    cache_fill(sh, offset, buf, seq, &h);
+    pthread_rwlock_unlock(&sh->lock);
+    return buf;
+}
+
+/* Unpin a frame, which is found by its address.  Blocks that were read
+ * into the caller's buffer are not pinned.  Releasing a frame that is not
+ * borrowed is an error and leaves the counts alone.
+ */
+static void cachedisk_release(block_store_t *this_bs, const block_t *block){
+    struct cachedisk_state *cs = this_bs->state;
+    unsigned int k;
+
+    if (block < cs->blocks || block >= cs->blocks + cs->nblocks) {
+        return;
+    }
+    for (k = 0; k < cs->nshards; k++) {
+        struct cache_shard *sh = &cs->shards[k];
+        if (block < sh->blocks + sh->nblocks) {
+            unsigned int *pins = &sh->slots[block - sh->blocks].pins;
+            unsigned int n = __atomic_load_n(pins, __ATOMIC_RELAXED);
+            do {
+                if (n == 0) {
+                    fprintf(stderr, "cachedisk_release: block not borrowed\n");
+                    return;
+                }
+            } while (!__atomic_compare_exchange_n(pins, &n, n - 1, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+            __atomic_sub_fetch(&sh->npinned, 1, __ATOMIC_RELAXED);
+            return;
         }
+    }
+}
 
-    } else {
-        cs->write_hit++;
-        //printf("here %i, %i\n", node->key, node->cache_offset);
+/* An asynchronous read miss waiting for the layer below.
+ */
+struct cachedisk_miss {
+    struct cachedisk_state *cs;
+    struct cache_shard *sh;
+    uint64_t start;             // GDS: when the read was issued
+    unsigned long write_seq;    // sh->write_seq when the miss was issued
+    struct cache_hint hint;     // of the read
+    block_no offset;
+    block_t *block;
+    block_done_t done;
+    void *arg;
+};
+
+static void cachedisk_read_done(void *arg, int result){
+    struct cachedisk_miss *cm = arg;
+
+    if (result == 0) {
+        if (cm->cs->costs != 0) {
+            cache_cost_sample(cm->cs, cm->offset, cache_now() - cm->start);
+        }
+        pthread_rwlock_wrlock(&cm->sh->lock);
+        cache_fill(cm->sh, cm->offset, cm->block, cm->write_seq, &cm->hint);
+        pthread_rwlock_unlock(&cm->sh->lock);
+    }
+    (*cm->done)(cm->arg, result);
+    free(cm);
+}
+
+/* A hit completes right away.  A miss is forwarded and the block is
+ * cached once it arrives.
+ */
+static int cachedisk_read_async(block_store_t *this_bs, block_no offset, block_t *block,
+                                            block_done_t done, void *arg){
+    struct cachedisk_state *cs = this_bs->state;
+    struct cache_shard *sh = shard_of(cs, offset);
+    struct cache_hint h;
+    unsigned long seq;
 
-        memcpy(&cs->blocks[node->cache_offset], block, BLOCK_SIZE);
-        //memcpy(block, cs->blocks, BLOCK_SIZE);
-        delete(node);
-        add_to_head(mycache, node);
+    cache_hint_get(&h);
+    shard_lock_get(sh);
+    int hit = cache_get(sh, offset, block, &seq, &h);
+    pthread_rwlock_unlock(&sh->lock);
+    if (hit) {
+        (*done)(arg, 0);
+        return 0;
+    }
+
+    struct cachedisk_miss *cm = malloc(sizeof(*cm));
+    cm->cs = cs;
+    cm->sh = sh;
+    cm->start = cs->costs == 0 ? 0 : cache_now();
+    cm->write_seq = seq;
+    cm->hint = h;
+    cm->offset = offset;
+    cm->block = block;
+    cm->done = done;
+    cm->arg = arg;
+    if (block_store_read_async(cs->below, offset, block, cachedisk_read_done, cm) < 0) {
+        free(cm);
+        return -1;
     }
     return 0;
 }
 
-void freeList(DLL head) {
-    DLL tmp;
-    while (head != NULL){
-        tmp = head;
-        head = head->next;
-        free(tmp);
+/* Drop the cached copy of 'offset' after a write below failed, as the
+ * layer below may still have the old content.  A borrowed frame is
+ * detached rather than dropped (see cache_put).  Called with the lock held.
+ */
+static void cache_invalidate(struct cache_shard *sh, block_no offset) {
+    block_no s = lookup(sh, offset);
+
+    if (s != NIL) {
+        hash_remove(sh, s);
+        sh->slots[s].offset = NIL;
+    }
+}
+
+/* An asynchronous write waiting for the layer below.  It is counted in
+ * the slot it was cached in, which keeps the count even if the slot is
+ * evicted in the mean time; that only makes dedup more careful.
+ */
+struct cachedisk_pending {
+    struct cache_shard *sh;
+    block_no offset;
+    block_no slot;              // NIL if the block was not cached
+    block_done_t done;
+    void *arg;
+};
+
+/* The write below is done.  Called with the lock held.
+ */
+static void cache_write_finish(struct cachedisk_pending *cp, int result) {
+    if (cp->slot != NIL) {
+        cp->sh->slots[cp->slot].writing--;
+    }
+    if (result < 0) {
+        cache_invalidate(cp->sh, cp->offset);
+    }
+}
+
+static void cachedisk_write_done(void *arg, int result){
+    struct cachedisk_pending *cp = arg;
+
+    pthread_rwlock_wrlock(&cp->sh->lock);
+    cache_write_finish(cp, result);
+    pthread_rwlock_unlock(&cp->sh->lock);
+    (*cp->done)(cp->arg, result);
+    free(cp);
+}
+
+/* The cache is updated when the write is issued, so that reads issued
+ * after it see the new content even before the layer below is done; if
+ * the write below fails, the cached copy is dropped again.  The offset
+ * stays locked until the write is submitted below, so that both see the
+ * same order.
+ */
+static int cachedisk_write_async(block_store_t *this_bs, block_no offset, block_t *block,
+                                            block_done_t done, void *arg){
+    struct cachedisk_state *cs = this_bs->state;
+    struct cache_shard *sh = shard_of(cs, offset);
+    struct cache_hint h;
+    pthread_mutex_t *wlock = &cs->write_locks[offset % CACHE_WRITE_LOCKS];
+
+    cache_hint_get(&h);
+    pthread_mutex_lock(wlock);
+    pthread_rwlock_wrlock(&sh->lock);
+    if (cs->dedup && cache_write_unchanged(sh, offset, block, &h)) {
+        pthread_rwlock_unlock(&sh->lock);
+        pthread_mutex_unlock(wlock);
+        (*done)(arg, 0);
+        return 0;
+    }
+    cache_write(sh, offset, block, &h);
+    struct cachedisk_pending *cp = malloc(sizeof(*cp));
+    cp->sh = sh;
+    cp->offset = offset;
+    cp->slot = lookup(sh, offset);
+    cp->done = done;
+    cp->arg = arg;
+    if (cp->slot != NIL) {
+        sh->slots[cp->slot].writing++;
+    }
+    pthread_rwlock_unlock(&sh->lock);
+
+    int r = block_store_write_async(cs->below, offset, block, cachedisk_write_done, cp);
+    if (r < 0) {
+        pthread_rwlock_wrlock(&sh->lock);
+        cache_write_finish(cp, -1);
+        pthread_rwlock_unlock(&sh->lock);
+        free(cp);
+    }
+    pthread_mutex_unlock(wlock);
+    return r;
+}
+
+static int cachedisk_poll(block_store_t *this_bs, int wait){
+    struct cachedisk_state *cs = this_bs->state;
+
+    return block_store_poll(cs->below, wait);
+}
+
+/* Warm restart.  A saved index is a CACHE_STATE_MAGIC word, the number of
+ * offsets, and the offsets of the cached blocks, most recently used first.
+ */
+#define CACHE_STATE_MAGIC   0x63647773      // "cdws"
+
+struct lfu_order {
+    uint64_t key;
+    block_no slot;
+};
+
+static int lfu_order_cmp(const void *a, const void *b) {
+    const struct lfu_order *x = a, *y = b;
+
+    return x->key < y->key ? 1 : x->key > y->key ? -1 : 0;
+}
+
+/* Fill in the offsets of the cached blocks, the block to keep longest
+ * first, and return how many there are.  Called with the lock held.
+ */
+static block_no cache_order(struct cache_shard *sh, block_no *order) {
+    block_no s, n = 0;
+
+    switch (sh->policy) {
+    case POLICY_LRU:
+    case POLICY_FIFO:
+        for (s = sh->head; s != NIL; s = sh->slots[s].next) {
+            order[n++] = sh->slots[s].offset;
+        }
+        break;
+    case POLICY_LFU:
+    case POLICY_GDS: {
+        struct lfu_order *lo = malloc(sh->nused * sizeof(*lo));
+        for (s = 0; s < sh->nused; s++) {
+            lo[s].key = sh->slots[s].key;
+            lo[s].slot = s;
+        }
+        qsort(lo, sh->nused, sizeof(*lo), lfu_order_cmp);
+        for (n = 0; n < sh->nused; n++) {
+            order[n] = sh->slots[lo[n].slot].offset;
+        }
+        free(lo);
+        break;
+    }
+    default:
+        for (n = 0; n < sh->nused; n++) {
+            order[n] = sh->slots[n].offset;
+        }
+        break;
+    }
+
+    /* Skip detached frames.
+     */
+    block_no i, m = 0;
+    for (i = 0; i < n; i++) {
+        if (order[i] != NIL) {
+            order[m++] = order[i];
+        }
+    }
+    return m;
+}
+
+int cachedisk_save_state(block_store_t *this_bs, char *path){
+    struct cachedisk_state *cs = this_bs->state;
+    block_no *order = malloc((cs->nblocks + 2) * sizeof(*order));
+    block_no *shard_order = malloc(cs->nblocks * sizeof(*shard_order));
+    block_no *start = malloc((cs->nshards + 1) * sizeof(*start));
+    block_no i, n = 0;
+    unsigned int k;
+    FILE *fp;
+
+    /* Interleave the orders of the shards.
+     */
+    start[0] = 0;
+    for (k = 0; k < cs->nshards; k++) {
+        struct cache_shard *sh = &cs->shards[k];
+        pthread_rwlock_rdlock(&sh->lock);
+        start[k + 1] = start[k] + cache_order(sh, &shard_order[start[k]]);
+        pthread_rwlock_unlock(&sh->lock);
+    }
+    for (i = 0; n < start[cs->nshards]; i++) {
+        for (k = 0; k < cs->nshards; k++) {
+            if (start[k] + i < start[k + 1]) {
+                order[2 + n++] = shard_order[start[k] + i];
+            }
+        }
+    }
+    free(shard_order);
+    free(start);
+    order[0] = CACHE_STATE_MAGIC;
+    order[1] = n;
+
+    if ((fp = fopen(path, "w")) == 0) {
+        perror(path);
+        free(order);
+        return -1;
+    }
+    int ok = fwrite(order, sizeof(*order), n + 2, fp) == n + 2;
+    if (fclose(fp) != 0 || !ok) {
+        perror(path);
+        ok = 0;
+    }
+    free(order);
+    return ok ? 0 : -1;
+}
+
+/* Drop all cached blocks.  Called with the lock held.
+ */
+static void cache_reset(struct cache_shard *sh) {
+    unsigned int o;
+
+    for (o = 0; o < CACHE_MAX_OWNERS; o++) {
+        sh->owners[o].resident = 0;
+    }
+    sh->nused = 0;
+    sh->meta_resident = 0;
+    memset(sh->buckets, 0xff, sh->nbuckets * sizeof(*sh->buckets));   // all NIL
+    sh->head = sh->tail = NIL;
+    sh->hand = 0;
+    if (sh->shadow != 0) {
+        cache_reset(sh->shadow);
+    }
+}
+
+/* Keeps track of the prefetches of a warm load.
+ */
+struct cachedisk_warm {
+    int pending;
+    int failed;
+};
+
+static void cachedisk_warm_done(void *arg, int result){
+    struct cachedisk_warm *cw = arg;
+
+    if (result < 0) {
+        __atomic_store_n(&cw->failed, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_sub_fetch(&cw->pending, 1, __ATOMIC_RELEASE);
+}
+
+struct warm_entry {
+    block_no offset;
+    block_t *frame;
+};
+
+static int warm_entry_cmp(const void *a, const void *b) {
+    const struct warm_entry *x = a, *y = b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* Load the index saved by cachedisk_save_state() into an empty cache:
+ * make room for the offsets in the saved order, and then prefetch their
+ * blocks from below, sorted by offset so the layer below sees one
+ * sequential sweep.  The reads are issued asynchronously, so layers that
+ * batch their I/O (like disk and uringdisk) can overlap them.
+ */
+int cachedisk_load_state(block_store_t *this_bs, char *path){
+    struct cachedisk_state *cs = this_bs->state;
+    block_no header[2], i, n, m = 0;
+    unsigned int k;
+    int empty = 1;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == 0) {
+        perror(path);
+        return -1;
+    }
+    if (fread(header, sizeof(header[0]), 2, fp) != 2 || header[0] != CACHE_STATE_MAGIC) {
+        fprintf(stderr, "cachedisk_load_state: %s: bad state file\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    /* Only the blocks to keep longest fit if the cache got smaller.
+     */
+    n = header[1] < cs->nblocks ? header[1] : cs->nblocks;
+    block_no *order = malloc((n + 1) * sizeof(*order));
+    n = fread(order, sizeof(*order), n, fp);
+    fclose(fp);
+
+    for (k = 0; k < cs->nshards; k++) {
+        pthread_rwlock_wrlock(&cs->shards[k].lock);
+        empty = empty && cs->shards[k].nused == 0;
     }
+    if (!empty) {
+        fprintf(stderr, "cachedisk_load_state: cache not empty\n");
+        n = 0;
+    }
+
+    /* Insert the blocks to keep shortest first, skipping the ones that
+     * do not fit in their shard.
+     */
+    struct warm_entry *we = malloc((n + 1) * sizeof(*we));
+    for (i = n; i > 0; i--) {
+        struct cache_shard *sh = shard_of(cs, order[i - 1]);
+        if (sh->nused < sh->nblocks && lookup(sh, order[i - 1]) == NIL) {
+            we[m].offset = order[i - 1];
+            we[m++].frame = &sh->blocks[cache_slot(sh, order[i - 1], &untagged)];
+        }
+    }
+    free(order);
+    qsort(we, m, sizeof(*we), warm_entry_cmp);
+
+    struct cachedisk_warm cw = { 0, 0 };
+    for (i = 0; i < m && !cw.failed; i++) {
+        __atomic_add_fetch(&cw.pending, 1, __ATOMIC_RELAXED);
+        if (block_store_read_async(cs->below, we[i].offset, we[i].frame,
+                                            cachedisk_warm_done, &cw) < 0) {
+            __atomic_sub_fetch(&cw.pending, 1, __ATOMIC_RELAXED);
+            cw.failed = 1;
+        }
+    }
+    while (__atomic_load_n(&cw.pending, __ATOMIC_ACQUIRE) > 0) {
+        block_store_poll(cs->below, 1);
+    }
+    if (__atomic_load_n(&cw.failed, __ATOMIC_RELAXED)) {
+        for (k = 0; k < cs->nshards; k++) {
+            cache_reset(&cs->shards[k]);
+        }
+        m = 0;
+    }
+    if (empty) {
+        cs->warm_loaded = m;
+    }
+    for (k = 0; k < cs->nshards; k++) {
+        pthread_rwlock_unlock(&cs->shards[k].lock);
+    }
+
+    free(we);
+    return !empty || (m == 0 && n != 0) ? -1 : 0;
 }
 
-void freeHash(Hash* hash) {
-    free(hashmap->array);
+static void shard_free(struct cache_shard *sh){
+    if (sh->shadow != 0) {
+        shard_free(sh->shadow);
+        free(sh->shadow);
+    }
+    free(sh->slots);
+    free(sh->buckets);
+    free(sh->heap);
+    free(sh->owners);
+    pthread_rwlock_destroy(&sh->lock);
 }
 
 static void cachedisk_destroy(block_store_t *this_bs){
     struct cachedisk_state *cs = this_bs->state;
+    unsigned int k;
 
-    // TODO: clean up any allocated meta-data.
-    freeHash(hashmap);
-    freeList(mycache->head);
-    free(hashmap);
-    free(mycache);
+    if (cs->state_file != 0) {
+        cachedisk_save_state(this_bs, cs->state_file);
+        free(cs->state_file);
+    }
+    for (k = 0; k < cs->nshards; k++) {
+        shard_free(&cs->shards[k]);
+    }
+    for (k = 0; k < CACHE_WRITE_LOCKS; k++) {
+        pthread_mutex_destroy(&cs->write_locks[k]);
+    }
+    free(cs->shards);
+    free(cs->quotas);
+    free(cs->costs);
     free(cs);
     free(this_bs);
 }
@@ -252,30 +1351,290 @@ static int cachedisk_setsize(block_store_t *this_bs, block_no nblocks){
     return (*cs->below->setsize)(cs->below, nblocks);
 }
 
+/* The stats summed over the shards.
+ */
+struct cachedisk_totals {
+    unsigned int read_hit, read_miss, write_hit, write_miss;
+    unsigned int meta_read_hit, meta_read_miss;
+    block_no cached, meta_cached;
+    uint64_t miss_cost, lru_miss_cost;
+    unsigned long copied, borrowed;
+    unsigned int write_dedup;
+};
+
+static void cachedisk_totals(struct cachedisk_state *cs, struct cachedisk_totals *ct){
+    unsigned int k;
+
+    memset(ct, 0, sizeof(*ct));
+    for (k = 0; k < cs->nshards; k++) {
+        struct cache_shard *sh = &cs->shards[k];
+        pthread_rwlock_rdlock(&sh->lock);
+        ct->read_hit += __atomic_load_n(&sh->read_hit, __ATOMIC_RELAXED);
+        ct->read_miss += __atomic_load_n(&sh->read_miss, __ATOMIC_RELAXED);
+        ct->write_hit += sh->write_hit;
+        ct->write_miss += sh->write_miss;
+        ct->meta_read_hit += __atomic_load_n(&sh->meta_read_hit, __ATOMIC_RELAXED);
+        ct->meta_read_miss += __atomic_load_n(&sh->meta_read_miss, __ATOMIC_RELAXED);
+        ct->copied += __atomic_load_n(&sh->copied, __ATOMIC_RELAXED);
+        ct->borrowed += __atomic_load_n(&sh->borrowed, __ATOMIC_RELAXED);
+        ct->write_dedup += sh->write_dedup;
+        ct->cached += sh->nused;
+        ct->meta_cached += sh->meta_resident;
+        if (sh->shadow != 0) {
+            ct->miss_cost += sh->miss_cost;
+            ct->lru_miss_cost += sh->shadow->miss_cost;
+        }
+        pthread_rwlock_unlock(&sh->lock);
+    }
+}
+
+/* The stats of owner o summed over the shards.
+ */
+static void cachedisk_owner_totals(struct cachedisk_state *cs, unsigned int o, struct cache_owner *co){
+    unsigned int k;
+
+    memset(co, 0, sizeof(*co));
+    for (k = 0; k < cs->nshards; k++) {
+        struct cache_shard *sh = &cs->shards[k];
+        pthread_rwlock_rdlock(&sh->lock);
+        co->read_hit += __atomic_load_n(&sh->owners[o].read_hit, __ATOMIC_RELAXED);
+        co->read_miss += __atomic_load_n(&sh->owners[o].read_miss, __ATOMIC_RELAXED);
+        co->write_hit += sh->owners[o].write_hit;
+        co->write_miss += sh->owners[o].write_miss;
+        co->resident += sh->owners[o].resident;
+        pthread_rwlock_unlock(&sh->lock);
+    }
+    if (cs->quotas != 0) {
+        co->min = cs->quotas[o].min;
+        co->max = cs->quotas[o].max;
+    }
+}
+
 void cachedisk_dump_stats(block_store_t *this_bs){
     struct cachedisk_state *cs = this_bs->state;
+    struct cachedisk_totals ct;
+    struct cache_owner co;
+    unsigned int o;
+
+    cachedisk_totals(cs, &ct);
+    printf("!$CACHE: #read hits:    %u\n", ct.read_hit);
+    printf("!$CACHE: #read misses:  %u\n", ct.read_miss);
+    printf("!$CACHE: #write hits:   %u\n", ct.write_hit);
+    printf("!$CACHE: #write misses: %u\n", ct.write_miss);
+    if (cs->dedup) {
+        printf("!$CACHE: #writes saved: %u\n", ct.write_dedup);
+    }
+    printf("!$CACHE: #bytes copied: %lu (%.1f per read)\n", ct.copied,
+                ct.read_hit + ct.read_miss == 0 ? 0 : (double) ct.copied / (ct.read_hit + ct.read_miss));
+    if (ct.borrowed != 0) {
+        printf("!$CACHE: #borrowed:     %lu\n", ct.borrowed);
+    }
+    if (cs->state_file != 0) {
+        printf("!$CACHE: #warm loaded:  %u\n", cs->warm_loaded);
+    }
+    if (cs->nshards > 1) {
+        printf("!$CACHE: #shards:       %u\n", cs->nshards);
+    }
+    if (cs->costs != 0) {
+        printf("!$CACHE: miss cost:     %.3f ms (LRU: %.3f ms, saved %.3f ms)\n",
+                    ct.miss_cost / 1e6, ct.lru_miss_cost / 1e6,
+                    ((double) ct.lru_miss_cost - ct.miss_cost) / 1e6);
+    }
+    if (ct.meta_read_hit + ct.meta_read_miss != 0) {
+        printf("!$CACHE: meta-data: read %u hits %u misses (%.1f%%), %u cached (segment %u)\n",
+                    ct.meta_read_hit, ct.meta_read_miss,
+                    100.0 * ct.meta_read_hit / (ct.meta_read_hit + ct.meta_read_miss),
+                    ct.meta_cached, cs->meta_reserve);
+    }
+
+    /* Untagged operations are listed only if there are tagged ones.
+     */
+    for (o = 1; o <= CACHE_MAX_OWNERS; o++) {
+        cachedisk_owner_totals(cs, o % CACHE_MAX_OWNERS, &co);
+        if (co.read_hit + co.read_miss + co.write_hit + co.write_miss == 0 ||
+                    (o == CACHE_MAX_OWNERS && co.read_hit + co.read_miss + co.write_hit
+                                + co.write_miss == ct.read_hit + ct.read_miss + ct.write_hit + ct.write_miss)) {
+            continue;
+        }
+        if (o == CACHE_MAX_OWNERS) {
+            printf("!$CACHE: untagged:");
+        } else {
+            printf("!$CACHE: owner %3u:", o - 1);
+        }
+        printf(" read %u hits %u misses, write %u hits %u misses, %u cached",
+                    co.read_hit, co.read_miss, co.write_hit, co.write_miss, co.resident);
+        if (co.min != 0 || co.max != 0) {
+            printf(" (min %u, max %u)", co.min, co.max);
+        }
+        printf("\n");
+    }
+}
+
+int cachedisk_set_quota(block_store_t *this_bs, unsigned int owner, block_no min, block_no max){
+    struct cachedisk_state *cs = this_bs->state;
+    unsigned int o = owner_index(owner), k;
 
-    printf("!$CACHE: #read hits:    %u\n", cs->read_hit);
-    printf("!$CACHE: #read misses:  %u\n", cs->read_miss);
-    printf("!$CACHE: #write hits:   %u\n", cs->write_hit);
-    printf("!$CACHE: #write misses: %u\n", cs->write_miss);
+    if (owner == BLOCK_NO_OWNER || o == 0) {
+        fprintf(stderr, "cachedisk_set_quota: owner %u out of range\n", owner);
+        return -1;
+    }
+    if (max != 0 && min > max) {
+        fprintf(stderr, "cachedisk_set_quota: reservation above cap\n");
+        return -1;
+    }
+    if (cs->quotas == 0) {
+        cs->quotas = calloc(CACHE_MAX_OWNERS, sizeof(*cs->quotas));
+    }
+    if (cs->reserved - cs->quotas[o].min + min > cs->nblocks) {
+        fprintf(stderr, "cachedisk_set_quota: reservations exceed the cache\n");
+        return -1;
+    }
+    cs->reserved += min - cs->quotas[o].min;
+    cs->quotas[o].min = min;
+    cs->quotas[o].max = max;
+
+    /* Split the quota over the shards like the blocks.
+     */
+    for (k = 0; k < cs->nshards; k++) {
+        struct cache_shard *sh = &cs->shards[k];
+        pthread_rwlock_wrlock(&sh->lock);
+        sh->owners[o].min = min / cs->nshards + (k < min % cs->nshards);
+        sh->owners[o].max = max == 0 ? 0 : (max + cs->nshards - 1) / cs->nshards;
+        sh->restricted = 1;
+        pthread_rwlock_unlock(&sh->lock);
+    }
+    return 0;
+}
+
+int cachedisk_set_meta_reserve(block_store_t *this_bs, block_no nblocks){
+    struct cachedisk_state *cs = this_bs->state;
+    unsigned int k;
+
+    if (nblocks > cs->nblocks) {
+        fprintf(stderr, "cachedisk_set_meta_reserve: larger than the cache\n");
+        return -1;
+    }
+    cs->meta_reserve = nblocks;
+    for (k = 0; k < cs->nshards; k++) {
+        struct cache_shard *sh = &cs->shards[k];
+        pthread_rwlock_wrlock(&sh->lock);
+        sh->meta_min = nblocks / cs->nshards + (k < nblocks % cs->nshards);
+        sh->restricted = 1;
+        pthread_rwlock_unlock(&sh->lock);
+    }
+    return 0;
+}
+
+void cachedisk_set_dedup(block_store_t *this_bs, int on){
+    struct cachedisk_state *cs = this_bs->state;
+
+    cs->dedup = on;
+}
+
+static void cachedisk_stats(block_store_t *this_bs, block_stat_t emit, void *arg){
+    struct cachedisk_state *cs = this_bs->state;
+    struct cachedisk_totals ct;
+
+    cachedisk_totals(cs, &ct);
+    (*emit)(arg, "read_hit", BLOCK_STAT_COUNTER, ct.read_hit);
+    (*emit)(arg, "read_miss", BLOCK_STAT_COUNTER, ct.read_miss);
+    (*emit)(arg, "write_hit", BLOCK_STAT_COUNTER, ct.write_hit);
+    (*emit)(arg, "write_miss", BLOCK_STAT_COUNTER, ct.write_miss);
+    (*emit)(arg, "meta_read_hit", BLOCK_STAT_COUNTER, ct.meta_read_hit);
+    (*emit)(arg, "meta_read_miss", BLOCK_STAT_COUNTER, ct.meta_read_miss);
+    (*emit)(arg, "bytes_copied", BLOCK_STAT_COUNTER, ct.copied);
+    (*emit)(arg, "write_dedup", BLOCK_STAT_COUNTER, ct.write_dedup);
+    (*emit)(arg, "borrowed", BLOCK_STAT_COUNTER, ct.borrowed);
+    if (cs->costs != 0) {
+        (*emit)(arg, "miss_cost_ns", BLOCK_STAT_COUNTER, ct.miss_cost);
+        (*emit)(arg, "lru_miss_cost_ns", BLOCK_STAT_COUNTER, ct.lru_miss_cost);
+    }
+    (*emit)(arg, "capacity", BLOCK_STAT_GAUGE, cs->nblocks);
+    (*emit)(arg, "cached", BLOCK_STAT_GAUGE, ct.cached);
+    (*emit)(arg, "meta_cached", BLOCK_STAT_GAUGE, ct.meta_cached);
+    (*emit)(arg, "shards", BLOCK_STAT_GAUGE, cs->nshards);
+    (*emit)(arg, "warm_loaded", BLOCK_STAT_GAUGE, cs->warm_loaded);
+    (*emit)(arg, "read_hit_ratio", BLOCK_STAT_GAUGE,
+                ct.read_hit + ct.read_miss == 0 ? 0 : (double) ct.read_hit / (ct.read_hit + ct.read_miss));
+}
+
+static void shard_init(struct cache_shard *sh, block_t *blocks, block_no nblocks,
+                                            enum cache_policy policy, int lazy){
+    sh->blocks = blocks;
+    sh->nblocks = nblocks;
+    sh->policy = policy;
+    sh->lazy = lazy;
+    sh->slots = calloc(nblocks, sizeof(*sh->slots));
+    sh->nbuckets = 1;
+    while (sh->nbuckets < 2 * nblocks) {
+        sh->nbuckets *= 2;
+    }
+    sh->buckets = malloc(sh->nbuckets * sizeof(*sh->buckets));
+    memset(sh->buckets, 0xff, sh->nbuckets * sizeof(*sh->buckets));   // all NIL
+    sh->head = sh->tail = NIL;
+    if (policy == POLICY_LFU || policy == POLICY_GDS) {
+        sh->heap = malloc(nblocks * sizeof(*sh->heap));
+    }
+    sh->seed = 1;
+    sh->owners = calloc(CACHE_MAX_OWNERS, sizeof(*sh->owners));
+    pthread_rwlock_init(&sh->lock, NULL);
 }
 
 /* Create a new block store module on top of the specified module below.
  * blocks points to a chunk of memory of nblocks blocks that can be used
- * for caching.
+ * for caching, which is split evenly over 'nshards' shards.
  */
-block_store_t *cachedisk_init(block_store_t *below, block_t *blocks, block_no nblocks){
-    /* Create the block store state structure.
+static block_store_t *cachedisk_create(block_store_t *below, block_t *blocks, block_no nblocks,
+                                            char *policy, unsigned int nshards, int lazy){
+    unsigned int p, k;
+
+    for (p = 0; p < sizeof(policy_names) / sizeof(policy_names[0]); p++) {
+        if (strcmp(policy, policy_names[p]) == 0) {
+            break;
+        }
+    }
+    if (p == sizeof(policy_names) / sizeof(policy_names[0])) {
+        fprintf(stderr, "cachedisk_init: unknown policy %s\n", policy);
+        return 0;
+    }
+    if (nblocks == 0) {
+        fprintf(stderr, "cachedisk_init: empty cache\n");
+        return 0;
+    }
+    if (nshards == 0 || nblocks < nshards) {
+        fprintf(stderr, "cachedisk_init: fewer blocks than shards\n");
+        return 0;
+    }
+
+    /* Create the block store state structure.  LFU and GDS reorder their
+     * heap on every hit, so they cannot be lazy.
      */
     struct cachedisk_state *cs = calloc(1, sizeof(*cs));
     cs->below = below;
     cs->blocks = blocks;
     cs->nblocks = nblocks;
+    cs->policy = p;
+    cs->nshards = nshards;
+    cs->shards = calloc(nshards, sizeof(*cs->shards));
+    for (k = 0; k < CACHE_WRITE_LOCKS; k++) {
+        pthread_mutex_init(&cs->write_locks[k], 0);
+    }
+    block_no first = 0;
+    for (k = 0; k < nshards; k++) {
+        block_no size = nblocks / nshards + (k < nblocks % nshards);
+        struct cache_shard *sh = &cs->shards[k];
+        shard_init(sh, &blocks[first], size, p, lazy && p != POLICY_LFU && p != POLICY_GDS);
+        first += size;
+        if (p == POLICY_GDS) {
+            if (cs->costs == 0) {
+                cs->costs = calloc(CACHE_NREGIONS, sizeof(*cs->costs));
+            }
+            sh->costs = cs->costs;
+            sh->shadow = calloc(1, sizeof(*sh->shadow));
+            shard_init(sh->shadow, 0, size, POLICY_LRU, 0);
+        }
+    }
 
-    init_cache();
-    mycache->capacity = nblocks;
-    hashmap = createHash(nblocks);
     /* Return a block interface to this inode.
      */
     block_store_t *this_bs = calloc(1, sizeof(*this_bs));
@@ -285,5 +1644,42 @@ block_store_t *cachedisk_init(block_store_t *below, block_t *blocks, block_no nb
     this_bs->read = cachedisk_read;
     this_bs->write = cachedisk_write;
     this_bs->destroy = cachedisk_destroy;
+    this_bs->read_async = cachedisk_read_async;
+    this_bs->write_async = cachedisk_write_async;
+    this_bs->poll = cachedisk_poll;
+    this_bs->borrow = cachedisk_borrow;
+    this_bs->release = cachedisk_release;
+    this_bs->name = "cachedisk";
+    this_bs->below = below;
+    this_bs->stats = cachedisk_stats;
+    return this_bs;
+}
+
+block_store_t *cachedisk_init_policy(block_store_t *below, block_t *blocks, block_no nblocks, char *policy){
+    return cachedisk_create(below, blocks, nblocks, policy, 1, 0);
+}
+
+block_store_t *cachedisk_init_concurrent(block_store_t *below, block_t *blocks, block_no nblocks,
+                                            char *policy, unsigned int nshards){
+    return cachedisk_create(below, blocks, nblocks, policy, nshards, 1);
+}
+
+block_store_t *cachedisk_init_warm(block_store_t *below, block_t *blocks, block_no nblocks,
+                                            char *policy, char *state_file){
+    block_store_t *this_bs = cachedisk_init_policy(below, blocks, nblocks, policy);
+    FILE *fp;
+
+    if (this_bs == 0) {
+        return 0;
+    }
+    if ((fp = fopen(state_file, "r")) != 0) {
+        fclose(fp);
+        cachedisk_load_state(this_bs, state_file);
+    }
+    ((struct cachedisk_state *) this_bs->state)->state_file = strdup(state_file);
     return this_bs;
 }
+
+block_store_t *cachedisk_init(block_store_t *below, block_t *blocks, block_no nblocks){
+    return cachedisk_init_policy(below, blocks, nblocks, "lru");
+}
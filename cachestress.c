@@ -0,0 +1,241 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* Runs many threads against one cachedisk at a time to check that it
+ * works under concurrency and to see how it scales.  Usage:
+ *
+ *	cachestress [-n ops] [-c cache-size] [-s shards] [-P policy] [nthreads ...]
+ *
+ * For each number of threads (default 1, 2, 4, 8, and 16), each thread
+ * does 'ops' operations on a plain cachedisk and then on one created with
+ * cachedisk_init_concurrent with 'shards' shards.  Most operations are
+ * reads of blocks in the cache, some are reads that miss, and some are
+ * writes.  Every block holds its own offset and a version that each write
+ * of it increments, so each read can be checked for the right block and a
+ * version that was written.  After the threads are done, the cache and the
+ * disk below must hold the same version of every block.  The report gives the throughput in operations per microsecond and the
+ * read hit ratio.
+ *
+ * "make stress" builds this program and runs it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "block_store.h"
+
+#define STRESS_DISK_SIZE	(16 * 1024)		// blocks
+#define STRESS_MAX_THREADS	256
+
+struct stress_ctx {
+	block_store_t *top;
+	unsigned long nops;
+	block_no cache_size;
+	uint32_t *versions;			// last version issued per block
+	unsigned int seed;
+	unsigned long errors;
+};
+
+static uint64_t stress_now(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stamp(block_t *block, block_no offset, uint32_t version){
+	memset(block, 0, BLOCK_SIZE);
+	memcpy(block, &offset, sizeof(offset));
+	memcpy((char *) block + sizeof(offset), &version, sizeof(version));
+}
+
+/* A read must return the right block, with a version that has been issued.
+ */
+static int stamp_check(block_t *block, block_no offset, uint32_t *versions){
+	block_no got;
+	uint32_t version;
+
+	memcpy(&got, block, sizeof(got));
+	memcpy(&version, (char *) block + sizeof(got), sizeof(version));
+	return got == offset && version <= __atomic_load_n(&versions[offset], __ATOMIC_SEQ_CST);
+}
+
+/* 1 in 32 operations is a write, 1 in 16 a read outside the working set
+ * (which is half the cache), and the rest are reads within it.
+ */
+static void *stress_thread(void *arg){
+	struct stress_ctx *sc = arg;
+	block_no working_set = sc->cache_size / 2 == 0 ? 1 : sc->cache_size / 2;
+	block_t block;
+	unsigned long i;
+
+	for (i = 0; i < sc->nops; i++) {
+		unsigned int r = rand_r(&sc->seed);
+		block_no offset;
+		if (r % 16 == 0) {
+			offset = r % STRESS_DISK_SIZE;
+		}
+		else {
+			offset = r % working_set;
+		}
+		if (r % 32 == 1) {
+			stamp(&block, offset,
+				__atomic_add_fetch(&sc->versions[offset], 1, __ATOMIC_SEQ_CST));
+			if ((*sc->top->write)(sc->top, offset, &block) < 0) {
+				sc->errors++;
+			}
+			continue;
+		}
+		if ((*sc->top->read)(sc->top, offset, &block) < 0 ||
+								!stamp_check(&block, offset, sc->versions)) {
+			sc->errors++;
+		}
+	}
+	return 0;
+}
+
+/* The read hit ratio according to the stats of the cache.
+ */
+struct stress_hits {
+	double hit, miss;
+};
+
+static void stress_stat(void *arg, char *name, int kind, double value){
+	struct stress_hits *sh = arg;
+
+	if (strcmp(name, "read_hit") == 0) {
+		sh->hit = value;
+	}
+	else if (strcmp(name, "read_miss") == 0) {
+		sh->miss = value;
+	}
+}
+
+/* Returns the number of operations per microsecond, or -1 upon error.
+ */
+static double stress_run(char *what, block_no cache_size, char *policy, unsigned int nshards,
+								unsigned int nthreads, unsigned long nops){
+	block_store_t *disk = ramdisk_init_sparse(STRESS_DISK_SIZE);
+	block_t *cache = malloc((size_t) cache_size * BLOCK_SIZE);
+	block_store_t *top = nshards == 0 ?
+				cachedisk_init_policy(disk, cache, cache_size, policy) :
+				cachedisk_init_concurrent(disk, cache, cache_size, policy, nshards);
+	if (top == 0) {
+		exit(1);
+	}
+
+	/* Stamp every block.
+	 */
+	uint32_t *versions = calloc(STRESS_DISK_SIZE, sizeof(*versions));
+	block_t block, below;
+	block_no b;
+	for (b = 0; b < STRESS_DISK_SIZE; b++) {
+		stamp(&block, b, 0);
+		(*disk->write)(disk, b, &block);
+	}
+
+	struct stress_ctx sc[STRESS_MAX_THREADS];
+	pthread_t tids[STRESS_MAX_THREADS];
+	unsigned int i;
+	uint64_t start = stress_now();
+	for (i = 0; i < nthreads; i++) {
+		sc[i].top = top;
+		sc[i].nops = nops;
+		sc[i].cache_size = cache_size;
+		sc[i].versions = versions;
+		sc[i].seed = i + 1;
+		sc[i].errors = 0;
+		pthread_create(&tids[i], 0, stress_thread, &sc[i]);
+	}
+	unsigned long errors = 0;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(tids[i], 0);
+		errors += sc[i].errors;
+	}
+	double elapsed = (double) (stress_now() - start);
+	struct stress_hits hits = { 0, 0 };
+	(*top->stats)(top, stress_stat, &hits);
+
+	/* A write that reached the layer below last must also be the one in
+	 * the cache.
+	 */
+	for (b = 0; b < STRESS_DISK_SIZE; b++) {
+		if ((*top->read)(top, b, &block) < 0 || (*disk->read)(disk, b, &below) < 0 ||
+								memcmp(&block, &below, BLOCK_SIZE) != 0) {
+			errors++;
+		}
+	}
+	(*top->destroy)(top);
+	(*disk->destroy)(disk);
+	free(versions);
+	free(cache);
+
+	double rate = nthreads * nops * 1000 / elapsed;
+	printf("%8u %-12s %12.2f %10.3f\n", nthreads, what, rate,
+				hits.hit + hits.miss == 0 ? 0 : hits.hit / (hits.hit + hits.miss));
+	if (errors != 0) {
+		fprintf(stderr, "cachestress: %s with %u threads: %lu bad operations\n",
+					what, nthreads, errors);
+		return -1;
+	}
+	return rate;
+}
+
+static void usage(char *prog){
+	fprintf(stderr, "usage: %s [-n ops] [-c cache-size] [-s shards] [-P policy] [nthreads ...]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv){
+	static unsigned int default_threads[] = { 1, 2, 4, 8, 16 };
+	unsigned long nops = 200000;
+	block_no cache_size = 1024;
+	unsigned int nshards = 16;
+	char *policy = "lru";
+	int c, status = 0;
+
+	while ((c = getopt(argc, argv, "n:c:s:P:")) != -1) {
+		switch (c) {
+		case 'n':
+			nops = strtoul(optarg, 0, 0);
+			break;
+		case 'c':
+			cache_size = strtoul(optarg, 0, 0);
+			break;
+		case 's':
+			nshards = atoi(optarg);
+			break;
+		case 'P':
+			policy = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nops == 0 || cache_size == 0 || nshards == 0) {
+		usage(argv[0]);
+	}
+
+	unsigned int ncounts = argc > optind ? argc - optind : 5;
+	unsigned int i;
+	char sharded[32];
+	snprintf(sharded, sizeof(sharded), "%u-shard", nshards);
+	printf("%8s %-12s %12s %10s\n", "threads", "cache", "ops/us", "hit ratio");
+	for (i = 0; i < ncounts; i++) {
+		unsigned int nthreads = argc > optind ? atoi(argv[optind + i]) : default_threads[i];
+		if (nthreads == 0 || nthreads > STRESS_MAX_THREADS) {
+			usage(argv[0]);
+		}
+		if (stress_run("single", cache_size, policy, 0, nthreads, nops) < 0 ||
+				stress_run(sharded, cache_size, policy, nshards, nthreads, nops) < 0) {
+			status = 1;
+		}
+	}
+	return status;
+}
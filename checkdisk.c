@@ -9,26 +9,156 @@
  * underlying block store, but checks if reads correspond to prior
  * writes.
  *
- *		block_store_t *checkdisk_init(block_store_t *below);
+ *		block_store_t *checkdisk_init(block_store_t *below, char *descr);
+ *			Keeps a copy of every block read or written.
+ *
+ *		block_store_t *checkdisk_init_digest(block_store_t *below, char *descr);
+ *			Keeps only a 128-bit digest of every block read or written,
+ *			which takes much less memory on long traces.
+ *
+ * The shadow state is kept in a hash table indexed by offset.
+ *
+ * A checkdisk may be used by several threads at once.  A read or write
+ * holds a lock on its offset (one of CHECK_NLOCKS, hashed) for the
+ * duration of the operation below, so that what it compares against is
+ * not changed by a concurrent write to the same block.
+ *
+ * Asynchronous reads and writes are passed on to the layer below, and
+ * checked or recorded when they complete.  These hold no offset lock, so
+ * asynchronous operations on the same block must not overlap.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "block_store.h"
 
-struct block_list {
-	struct block_list *next;
+#define CHECK_NLOCKS		64
+#define CHECK_MIN_BUCKETS	64
+
+/* What is known about a block.  In digest mode, 'block' is not allocated.
+ */
+struct block_entry {
+	struct block_entry *next;		// next in hash bucket
 	block_no offset;
-	block_t block;
+	uint64_t digest[2];
+	block_t block[];
 };
 
 struct checkdisk_state {
 	block_store_t *below;			// block store below
 	char *descr;			// to disambiguate multiple instances
-	struct block_list *bl;	// info about data written
+	int digest_only;		// keep digests, not copies
+
+	/* Info about data written, hashed by offset.  'max_offset' is an upper
+	 * bound on the offsets in the table.
+	 */
+	struct block_entry **buckets;
+	unsigned int nbuckets, nentries;
+	block_no max_offset;
+
+	unsigned long nchecked;		// # reads compared with an earlier one
+	unsigned long nrecorded;	// # reads and writes added or updated
+
+	pthread_mutex_t table_lock;					// protects the table
+	pthread_mutex_t locks[CHECK_NLOCKS];		// per offset
 };
 
+/* 128-bit digest of a block: two independent multiply-xorshift hashes
+ * over its 64-bit words.
+ */
+static void checkdisk_digest(block_t *block, uint64_t digest[2]){
+	const uint64_t *w = (const uint64_t *) block;
+	uint64_t h0 = 0x9e3779b97f4a7c15ULL, h1 = 0xc2b2ae3d27d4eb4fULL;
+	unsigned int i;
+
+	for (i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++) {
+		h0 = (h0 ^ w[i]) * 0xff51afd7ed558ccdULL;
+		h0 ^= h0 >> 32;
+		h1 = (h1 + w[i]) * 0xc4ceb9fe1a85ec53ULL;
+		h1 ^= h1 >> 29;
+	}
+	h0 ^= h1 >> 17;
+	h1 ^= h0 >> 23;
+	digest[0] = h0 * 0x94d049bb133111ebULL;
+	digest[1] = h1 * 0xbf58476d1ce4e5b9ULL;
+}
+
+static unsigned int checkdisk_hash(struct checkdisk_state *cs, block_no offset){
+	return (offset * 2654435761U) & (cs->nbuckets - 1);
+}
+
+static struct block_entry **checkdisk_find(struct checkdisk_state *cs, block_no offset){
+	struct block_entry **pbe, *be;
+
+	for (pbe = &cs->buckets[checkdisk_hash(cs, offset)]; (be = *pbe) != 0; pbe = &be->next) {
+		if (be->offset == offset) {
+			break;
+		}
+	}
+	return pbe;
+}
+
+/* Double the number of buckets once the table gets too full.
+ */
+static void checkdisk_grow(struct checkdisk_state *cs){
+	struct block_entry **old = cs->buckets, *be;
+	unsigned int i, n = cs->nbuckets;
+
+	cs->nbuckets *= 2;
+	cs->buckets = calloc(cs->nbuckets, sizeof(*cs->buckets));
+	for (i = 0; i < n; i++) {
+		while ((be = old[i]) != 0) {
+			old[i] = be->next;
+			unsigned int h = checkdisk_hash(cs, be->offset);
+			be->next = cs->buckets[h];
+			cs->buckets[h] = be;
+		}
+	}
+	free(old);
+}
+
+static struct block_entry *checkdisk_insert(struct checkdisk_state *cs, block_no offset){
+	if (cs->nentries >= cs->nbuckets) {
+		checkdisk_grow(cs);
+	}
+
+	struct block_entry *be = calloc(1, sizeof(*be) + (cs->digest_only ? 0 : BLOCK_SIZE));
+	unsigned int h = checkdisk_hash(cs, offset);
+	be->offset = offset;
+	be->next = cs->buckets[h];
+	cs->buckets[h] = be;
+	cs->nentries++;
+	if (offset > cs->max_offset) {
+		cs->max_offset = offset;
+	}
+	return be;
+}
+
+/* Remember the (new) content of a block.
+ */
+static void checkdisk_record(struct checkdisk_state *cs, struct block_entry *be, block_t *block){
+	if (cs->digest_only) {
+		checkdisk_digest(block, be->digest);
+	}
+	else {
+		be->block[0] = *block;
+	}
+}
+
+/* See if the content of a block is what we remember.
+ */
+static int checkdisk_same(struct checkdisk_state *cs, struct block_entry *be, block_t *block){
+	if (cs->digest_only) {
+		uint64_t digest[2];
+		checkdisk_digest(block, digest);
+		return digest[0] == be->digest[0] && digest[1] == be->digest[1];
+	}
+	return memcmp(&be->block[0], block, BLOCK_SIZE) == 0;
+}
+
 static int checkdisk_nblocks(block_store_t *this_bs){
 	struct checkdisk_state *cs = this_bs->state;
 
@@ -37,99 +167,231 @@ static int checkdisk_nblocks(block_store_t *this_bs){
 
 static int checkdisk_setsize(block_store_t *this_bs, block_no nblocks){
 	struct checkdisk_state *cs = this_bs->state;
+	struct block_entry **pbe, *be;
 
 	/* See if I read or wrote any blocks beyond this boundary.  Remove.
+	 * Look up the offsets past the boundary one by one, or scan the
+	 * whole table, whichever is less work.
 	 */
-	struct block_list **pbl, *bl;
-	for (pbl = &cs->bl; (bl = *pbl) != 0;) {
-		if (bl->offset >= nblocks) {
-			*pbl = bl->next;
-			free(bl);
+	pthread_mutex_lock(&cs->table_lock);
+	if (cs->nentries > 0 && nblocks <= cs->max_offset) {
+		if (cs->max_offset - nblocks < cs->nbuckets) {
+			block_no off;
+			for (off = nblocks; off <= cs->max_offset; off++) {
+				if ((be = *(pbe = checkdisk_find(cs, off))) != 0) {
+					*pbe = be->next;
+					free(be);
+					cs->nentries--;
+				}
+			}
 		}
 		else {
-			pbl = &bl->next;
+			unsigned int i;
+			for (i = 0; i < cs->nbuckets; i++) {
+				for (pbe = &cs->buckets[i]; (be = *pbe) != 0;) {
+					if (be->offset >= nblocks) {
+						*pbe = be->next;
+						free(be);
+						cs->nentries--;
+					}
+					else {
+						pbe = &be->next;
+					}
+				}
+			}
 		}
+		cs->max_offset = nblocks == 0 ? 0 : nblocks - 1;
 	}
+	pthread_mutex_unlock(&cs->table_lock);
 
 	return (*cs->below->setsize)(cs->below, nblocks);
 }
 
-static int checkdisk_read(block_store_t *this_bs, block_no offset, block_t *block){
-	struct checkdisk_state *cs = this_bs->state;
-
-	if ((*cs->below->read)(cs->below, offset, block) < 0) {
-		return -1;
-	}
-
+/* Check a block that was read against what is known about it.
+ */
+static void checkdisk_verify(struct checkdisk_state *cs, block_no offset, block_t *block){
 	/* See if I read or wrote the block before.
 	 */
-	struct block_list *bl;
-	for (bl = cs->bl; bl != 0; bl = bl->next) {
-		if (bl->offset == offset) {
-			/* See if it's the same.
-			 */
-			if (memcmp(&bl->block, block, BLOCK_SIZE) != 0) {
-				fprintf(stderr, "!!CHKDISK %s: checkdisk_read: corrupted\n", cs->descr);
-				exit(1);
-			}
-			return 0;
+	struct block_entry *be;
+	pthread_mutex_lock(&cs->table_lock);
+	if ((be = *checkdisk_find(cs, offset)) != 0) {
+		/* See if it's the same.
+		 */
+		if (!checkdisk_same(cs, be, block)) {
+			fprintf(stderr, "!!CHKDISK %s: checkdisk_read: corrupted\n", cs->descr);
+			exit(1);
 		}
+		cs->nchecked++;
+	}
+	else {
+		/* Add to the table.
+		 */
+		checkdisk_record(cs, checkdisk_insert(cs, offset), block);
+		cs->nrecorded++;
 	}
+	pthread_mutex_unlock(&cs->table_lock);
+}
 
-	/* Add to the block list.
-	 */
-	bl = calloc(1, sizeof(*bl));
-	bl->offset = offset;
-	bl->block = *block;
-	bl->next = cs->bl;
-	cs->bl = bl;
+static int checkdisk_do_read(struct checkdisk_state *cs, block_no offset, block_t *block){
+	if ((*cs->below->read)(cs->below, offset, block) < 0) {
+		return -1;
+	}
+	checkdisk_verify(cs, offset, block);
 	return 0;
 }
 
-static int checkdisk_write(block_store_t *this_bs, block_no offset, block_t *block){
+static int checkdisk_read(block_store_t *this_bs, block_no offset, block_t *block){
 	struct checkdisk_state *cs = this_bs->state;
+	pthread_mutex_t *lock = &cs->locks[offset % CHECK_NLOCKS];
 
+	pthread_mutex_lock(lock);
+	int result = checkdisk_do_read(cs, offset, block);
+	pthread_mutex_unlock(lock);
+	return result;
+}
+
+/* Remember a block that was written.
+ */
+static void checkdisk_remember(struct checkdisk_state *cs, block_no offset, block_t *block){
+	/* See if I read or wrote the block before.
+	 */
+	struct block_entry *be;
+	pthread_mutex_lock(&cs->table_lock);
+	if ((be = *checkdisk_find(cs, offset)) == 0) {
+		be = checkdisk_insert(cs, offset);
+	}
+	checkdisk_record(cs, be, block);
+	cs->nrecorded++;
+	pthread_mutex_unlock(&cs->table_lock);
+}
+
+static int checkdisk_do_write(struct checkdisk_state *cs, block_no offset, block_t *block){
 	int result = (*cs->below->write)(cs->below, offset, block);
 	if (result < 0) {
 		return result;
 	}
+	checkdisk_remember(cs, offset, block);
+	return result;
+}
 
-	/* See if I read or wrote the block before.
-	 */
-	struct block_list *bl;
-	for (bl = cs->bl; bl != 0; bl = bl->next) {
-		if (bl->offset == offset) {
-			break;
+static int checkdisk_write(block_store_t *this_bs, block_no offset, block_t *block){
+	struct checkdisk_state *cs = this_bs->state;
+	pthread_mutex_t *lock = &cs->locks[offset % CHECK_NLOCKS];
+
+	pthread_mutex_lock(lock);
+	int result = checkdisk_do_write(cs, offset, block);
+	pthread_mutex_unlock(lock);
+	return result;
+}
+
+/* An asynchronous operation to check or record upon completion.
+ */
+struct checkdisk_op {
+	struct checkdisk_state *cs;
+	int is_read;
+	block_no offset;
+	block_t *block;
+	block_done_t done;
+	void *arg;
+};
+
+static void checkdisk_done(void *arg, int result){
+	struct checkdisk_op *co = arg;
+
+	if (result >= 0) {
+		if (co->is_read) {
+			checkdisk_verify(co->cs, co->offset, co->block);
+		}
+		else {
+			checkdisk_remember(co->cs, co->offset, co->block);
 		}
 	}
-	if (bl == 0) {
-		bl = calloc(1, sizeof(*bl));
-		bl->offset = offset;
-		bl->next = cs->bl;
-		cs->bl = bl;
+	(*co->done)(co->arg, result);
+	free(co);
+}
+
+static int checkdisk_async(block_store_t *this_bs, int is_read, block_no offset,
+							block_t *block, block_done_t done, void *arg){
+	struct checkdisk_state *cs = this_bs->state;
+	struct checkdisk_op *co = malloc(sizeof(*co));
+
+	co->cs = cs;
+	co->is_read = is_read;
+	co->offset = offset;
+	co->block = block;
+	co->done = done;
+	co->arg = arg;
+	int result = is_read ?
+			block_store_read_async(cs->below, offset, block, checkdisk_done, co) :
+			block_store_write_async(cs->below, offset, block, checkdisk_done, co);
+	if (result < 0) {
+		free(co);
 	}
-	bl->block = *block;
 	return result;
 }
 
+static int checkdisk_read_async(block_store_t *this_bs, block_no offset, block_t *block,
+											block_done_t done, void *arg){
+	return checkdisk_async(this_bs, 1, offset, block, done, arg);
+}
+
+static int checkdisk_write_async(block_store_t *this_bs, block_no offset, block_t *block,
+											block_done_t done, void *arg){
+	return checkdisk_async(this_bs, 0, offset, block, done, arg);
+}
+
+static int checkdisk_poll(block_store_t *this_bs, int wait){
+	struct checkdisk_state *cs = this_bs->state;
+
+	return block_store_poll(cs->below, wait);
+}
+
+static void checkdisk_stats(block_store_t *this_bs, block_stat_t emit, void *arg){
+	struct checkdisk_state *cs = this_bs->state;
+
+	pthread_mutex_lock(&cs->table_lock);
+	(*emit)(arg, "nchecked", BLOCK_STAT_COUNTER, cs->nchecked);
+	(*emit)(arg, "nrecorded", BLOCK_STAT_COUNTER, cs->nrecorded);
+	(*emit)(arg, "entries", BLOCK_STAT_GAUGE, cs->nentries);
+	(*emit)(arg, "buckets", BLOCK_STAT_GAUGE, cs->nbuckets);
+	(*emit)(arg, "digest_only", BLOCK_STAT_GAUGE, cs->digest_only);
+	pthread_mutex_unlock(&cs->table_lock);
+}
+
 static void checkdisk_destroy(block_store_t *this_bs){
 	struct checkdisk_state *cs = this_bs->state;
-	struct block_list *bl;
+	struct block_entry *be;
+	unsigned int i;
 
-	while ((bl = cs->bl) != 0) {
-		cs->bl = bl->next;
-		free(bl);
+	for (i = 0; i < cs->nbuckets; i++) {
+		while ((be = cs->buckets[i]) != 0) {
+			cs->buckets[i] = be->next;
+			free(be);
+		}
+	}
+	free(cs->buckets);
+	for (i = 0; i < CHECK_NLOCKS; i++) {
+		pthread_mutex_destroy(&cs->locks[i]);
 	}
+	pthread_mutex_destroy(&cs->table_lock);
 	free(cs);
 	free(this_bs);
 }
 
-block_store_t *checkdisk_init(block_store_t *below, char *descr){
+static block_store_t *checkdisk_create(block_store_t *below, char *descr, int digest_only){
 	/* Create the block store state structure.
 	 */
 	struct checkdisk_state *cs = calloc(1, sizeof(*cs));
 	cs->below = below;
 	cs->descr = descr;
+	cs->digest_only = digest_only;
+	cs->nbuckets = CHECK_MIN_BUCKETS;
+	cs->buckets = calloc(cs->nbuckets, sizeof(*cs->buckets));
+	pthread_mutex_init(&cs->table_lock, 0);
+	int i;
+	for (i = 0; i < CHECK_NLOCKS; i++) {
+		pthread_mutex_init(&cs->locks[i], 0);
+	}
 
 	/* Return a block interface to this inode.
 	 */
@@ -140,5 +402,19 @@ block_store_t *checkdisk_init(block_store_t *below, char *descr){
 	this_bs->read = checkdisk_read;
 	this_bs->write = checkdisk_write;
 	this_bs->destroy = checkdisk_destroy;
+	this_bs->read_async = checkdisk_read_async;
+	this_bs->write_async = checkdisk_write_async;
+	this_bs->poll = checkdisk_poll;
+	this_bs->name = "checkdisk";
+	this_bs->below = below;
+	this_bs->stats = checkdisk_stats;
 	return this_bs;
 }
+
+block_store_t *checkdisk_init(block_store_t *below, char *descr){
+	return checkdisk_create(below, descr, 0);
+}
+
+block_store_t *checkdisk_init_digest(block_store_t *below, char *descr){
+	return checkdisk_create(below, descr, 1);
+}
@@ -9,19 +9,357 @@
  *
  * Returns 0 if the trace is good
  * Returns 1 if the trace is not good
+ *
+ * With "-b file", the trace is also converted to the binary format
+ * described in "tracefile.h" and written to the given file.  The limit
+ * on the number of commands does not apply in that case.
+ *
+ * With "-w", it also characterizes the workload (again without a limit
+ * on the number of commands), using memory that does not grow with the
+ * length of the trace:
+ *
+ *	- the working set of each inode: the number of distinct blocks
+ *	  accessed, estimated with a HyperLogLog sketch per inode;
+ *	- the reuse distance distribution of reads and writes (the number of
+ *	  distinct virtual blocks accessed since the previous access to the
+ *	  same block), estimated from a hash-based sample of at most
+ *	  REUSE_SAMPLE blocks, and from it the LRU miss ratio per cache size;
+ *	- the fraction of reads and writes that are sequential (to the block
+ *	  after the previous one on the same inode);
+ *	- the popularity skew over inodes, as the exponent of a Zipf fit;
+ *	- the treedisk meta-data that replaying the trace would touch: the
+ *	  inode blocks, the (estimated) number of distinct indirect blocks,
+ *	  and the number of meta-data reads per read or write.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include "block_store.h"
+#include "treedisk.h"
+#include "tracefile.h"
 
 #define MAX_INODES			128
 #define MAX_BLOCKS			(1 << 27)
 #define MAX_COMMANDS		10000
 
+#define HLL_BITS			10					// log2 # HyperLogLog registers
+#define HLL_SIZE			(1 << HLL_BITS)
+#define REUSE_SAMPLE		4096				// max # sampled blocks
+#define REUSE_BUCKETS		32					// log2 buckets of reuse distance
+
+/* HyperLogLog estimate of the number of distinct items added.
+ */
+struct hll {
+	uint8_t reg[HLL_SIZE];
+};
+
+/* A block in the reuse distance sample, on an LRU list.
+ */
+struct sample {
+	struct sample *prev, *next;			// LRU list, most recent first
+	struct sample *chain;				// hash chain
+	uint64_t key, hash;
+};
+
+struct workload {
+	struct hll blocks[MAX_INODES];		// distinct blocks per inode
+	struct hll indirect;				// distinct indirect blocks
+	uint64_t accesses[MAX_INODES];		// # reads and writes per inode
+	block_no size[MAX_INODES];			// current size of each inode
+	block_no last[MAX_INODES];			// last block accessed + 1, or 0
+	uint64_t nseq, naccess;				// # sequential, all reads and writes
+	uint64_t meta_reads;				// # meta-data reads projected
+	unsigned int inodeblocks[(MAX_INODES + 31) / 32];	// bitmap of inode blocks touched
+	unsigned int log_rpb;				// log2(REFS_PER_BLOCK)
+
+	/* Reuse distance sample.  A block is sampled if its hash is below
+	 * 'threshold'; the threshold is lowered whenever the sample gets too
+	 * big.  Each sampled access stands for 2^64 / threshold accesses.
+	 */
+	uint64_t threshold;
+	struct sample head;					// sentinel of LRU list
+	struct sample *table[2 * REUSE_SAMPLE];
+	unsigned int nsample;
+	double reuse[REUSE_BUCKETS];		// weighted counts per log2 distance
+	double cold;						// weighted first accesses
+};
+
+static uint64_t mix64(uint64_t x){
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static void hll_add(struct hll *h, uint64_t key){
+	uint64_t x = mix64(key);
+	unsigned int idx = x >> (64 - HLL_BITS);
+	uint64_t rest = (x << HLL_BITS) | ((uint64_t) 1 << (HLL_BITS - 1));
+	uint8_t rank = __builtin_clzll(rest) + 1;
+
+	if (rank > h->reg[idx]) {
+		h->reg[idx] = rank;
+	}
+}
+
+static double hll_count(struct hll *h){
+	double sum = 0, m = HLL_SIZE;
+	unsigned int i, zeros = 0;
+
+	for (i = 0; i < HLL_SIZE; i++) {
+		sum += ldexp(1.0, -h->reg[i]);
+		zeros += h->reg[i] == 0;
+	}
+	double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+	if (e <= 2.5 * m && zeros > 0) {
+		e = m * log(m / zeros);			// small range correction
+	}
+	return e;
+}
+
+static void sample_unlink(struct sample *s){
+	s->prev->next = s->next;
+	s->next->prev = s->prev;
+}
+
+static void sample_push(struct workload *w, struct sample *s){
+	s->next = w->head.next;
+	s->prev = &w->head;
+	w->head.next->prev = s;
+	w->head.next = s;
+}
+
+/* Lower the sampling threshold by half, dropping blocks no longer sampled.
+ */
+static void sample_shrink(struct workload *w){
+	unsigned int i;
+
+	w->threshold /= 2;
+	for (i = 0; i < 2 * REUSE_SAMPLE; i++) {
+		struct sample **ps = &w->table[i], *s;
+		while ((s = *ps) != 0) {
+			if (s->hash >= w->threshold) {
+				*ps = s->chain;
+				sample_unlink(s);
+				free(s);
+				w->nsample--;
+			}
+			else {
+				ps = &s->chain;
+			}
+		}
+	}
+}
+
+static void reuse_access(struct workload *w, uint64_t key){
+	uint64_t hash = mix64(key ^ 0x5bd1e995);
+	if (hash >= w->threshold) {
+		return;
+	}
+	double weight = ldexp(1.0, 64) / (double) w->threshold;
+
+	struct sample **ps = &w->table[hash % (2 * REUSE_SAMPLE)], *s;
+	while ((s = *ps) != 0 && s->key != key) {
+		ps = &s->chain;
+	}
+	if (s == 0) {
+		w->cold += weight;
+		s = calloc(1, sizeof(*s));
+		s->key = key;
+		s->hash = hash;
+		*ps = s;
+		sample_push(w, s);
+		if (++w->nsample > REUSE_SAMPLE) {
+			sample_shrink(w);
+		}
+		return;
+	}
+
+	/* The position in the LRU list is the distance within the sample.
+	 */
+	struct sample *t;
+	double distance = 0;
+	for (t = w->head.next; t != s; t = t->next) {
+		distance++;
+	}
+	unsigned int bucket = 0;
+	while (bucket < REUSE_BUCKETS - 1 && distance * weight >= ldexp(1.0, bucket)) {
+		bucket++;
+	}
+	w->reuse[bucket] += weight;
+	sample_unlink(s);
+	sample_push(w, s);
+}
+
+/* The number of levels of indirect blocks of a treedisk file of 'size'
+ * blocks (as in treedisk_do_read).
+ */
+static unsigned int tree_levels(struct workload *w, block_no size){
+	unsigned int nlevels = 0;
+
+	if (size > 0) {
+		while (nlevels * w->log_rpb < sizeof(block_no) * 8 &&
+						((size - 1) >> (nlevels * w->log_rpb)) != 0) {
+			nlevels++;
+		}
+	}
+	return nlevels;
+}
+
+static void workload_init(struct workload *w){
+	memset(w, 0, sizeof(*w));
+	do {
+		w->log_rpb++;
+	} while (((REFS_PER_BLOCK - 1) >> w->log_rpb) != 0);
+	w->threshold = UINT64_MAX;
+	w->head.next = w->head.prev = &w->head;
+}
+
+static void workload_add(struct workload *w, char cmd, unsigned int inode, unsigned int bno){
+	w->inodeblocks[(inode / INODES_PER_BLOCK) / 32] |= 1U << ((inode / INODES_PER_BLOCK) % 32);
+
+	if (cmd == 'S') {
+		w->size[inode] = bno;
+		return;
+	}
+	if (cmd != 'R' && cmd != 'W') {
+		return;
+	}
+	if (cmd == 'W' && bno >= w->size[inode]) {
+		w->size[inode] = bno + 1;
+	}
+
+	w->naccess++;
+	w->accesses[inode]++;
+	if (w->last[inode] != 0 && w->last[inode] == bno) {
+		w->nseq++;
+	}
+	w->last[inode] = bno + 1;
+
+	uint64_t key = ((uint64_t) inode << 32) | bno;
+	hll_add(&w->blocks[inode], key);
+	reuse_access(w, key);
+
+	/* A read or write goes through the superblock, the inode block, and
+	 * the indirect blocks on the path to the data block.
+	 */
+	unsigned int nlevels = tree_levels(w, w->size[inode]), level;
+	w->meta_reads += 2 + nlevels;
+	for (level = 1; level <= nlevels; level++) {
+		hll_add(&w->indirect, ((uint64_t) inode << 40) | ((uint64_t) level << 32) |
+								((uint64_t) bno >> (level * w->log_rpb)));
+	}
+}
+
+static int cmp_desc(const void *a, const void *b){
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void workload_report(struct workload *w){
+	unsigned int i, ninodes = 0;
+
+	/* Working sets.
+	 */
+	double total_ws = 0;
+	for (i = 0; i < MAX_INODES; i++) {
+		if (w->accesses[i] != 0) {
+			double ws = hll_count(&w->blocks[i]);
+			printf("inode %u: %llu accesses, working set ~%.0f blocks\n", i,
+					(unsigned long long) w->accesses[i], ws);
+			total_ws += ws;
+			ninodes++;
+		}
+	}
+	printf("working set: ~%.0f blocks in %u inodes\n", total_ws, ninodes);
+	printf("sequential: %.1f%% of reads and writes\n",
+			w->naccess == 0 ? 0 : 100.0 * w->nseq / w->naccess);
+
+	/* Zipf fit of inode popularity: least squares of log(count) over
+	 * log(rank); the exponent is minus the slope.
+	 */
+	uint64_t counts[MAX_INODES];
+	memcpy(counts, w->accesses, sizeof(counts));
+	qsort(counts, MAX_INODES, sizeof(counts[0]), cmp_desc);
+	double sx = 0, sy = 0, sxx = 0, sxy = 0, n = 0;
+	for (i = 0; i < MAX_INODES && counts[i] != 0; i++) {
+		double x = log(i + 1), y = log(counts[i]);
+		sx += x; sy += y; sxx += x * x; sxy += x * y; n++;
+	}
+	if (n >= 2 && n * sxx != sx * sx) {
+		printf("inode skew: zipf exponent %.2f\n", -(n * sxy - sx * sy) / (n * sxx - sx * sx));
+	}
+
+	/* Reuse distances and the LRU miss ratio they imply.
+	 */
+	double total = w->cold, cum = 0;
+	for (i = 0; i < REUSE_BUCKETS; i++) {
+		total += w->reuse[i];
+	}
+	if (total > 0) {
+		printf("reuse distance (sampled %.3f%%):\n", 100.0 * w->threshold / ldexp(1.0, 64));
+		printf("  cold: %.1f%%\n", 100.0 * w->cold / total);
+		for (i = 0; i < REUSE_BUCKETS; i++) {
+			cum += w->reuse[i];
+			if (w->reuse[i] > 0) {
+				printf("  < %u: %.1f%%, LRU miss ratio with %u blocks: %.1f%%\n",
+						1U << i, 100.0 * w->reuse[i] / total, 1U << i,
+						100.0 * (total - cum) / total);
+			}
+		}
+	}
+
+	/* Meta-data.
+	 */
+	unsigned int ninodeblocks = 0;
+	for (i = 0; i < (MAX_INODES + 31) / 32; i++) {
+		ninodeblocks += __builtin_popcount(w->inodeblocks[i]);
+	}
+	printf("treedisk meta-data: superblock, %u inode blocks, ~%.0f indirect blocks\n",
+			ninodeblocks, hll_count(&w->indirect));
+	printf("treedisk meta-data reads per read/write: %.2f\n",
+			w->naccess == 0 ? 0 : (double) w->meta_reads / w->naccess);
+}
+
 int main(int argc, char **argv){
-	FILE *fp;
-	char *file;
+	FILE *fp, *out = 0;
+	char *file, *binary = 0;
+	struct workload *w = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "b:w")) != -1) {
+		switch (c) {
+		case 'b':
+			binary = optarg;
+			break;
+		case 'w':
+			w = malloc(sizeof(*w));
+			workload_init(w);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-w] [-b binary-trace] [trace-file]\n", argv[0]);
+			return 1;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	/* Leave room for the header, which is written at the end.
+	 */
+	struct trace_header th;
+	memset(&th, 0, sizeof(th));
+	if (binary != 0) {
+		if ((out = fopen(binary, "w")) == 0) {
+			perror(binary);
+			return 1;
+		}
+		fwrite(&th, sizeof(th), 1, out);
+	}
 
 	if (argc == 1) {
 		file = "standard input";
@@ -38,6 +376,7 @@ int main(int argc, char **argv){
 	char cmd;
 	unsigned int inode, bno, line = 0;
 	unsigned int nread = 0, nwrite = 0, nsetsize = 0;
+	uint64_t ncmds = 0;			// does not wrap around like 'line'
 	for (;;) {
 		int n = fscanf(fp, "%c:%u:%u\n", &cmd, &inode, &bno);
 		if (n <= 0) {
@@ -48,7 +387,8 @@ int main(int argc, char **argv){
 			return 1;
 		}
 		line++;
-		if (line > MAX_COMMANDS) {
+		ncmds++;
+		if (line > MAX_COMMANDS && out == 0 && w == 0) {
 			fprintf(stderr, "too many command in file %s, line %d\n", file, line);
 			return 1;
 		}
@@ -76,14 +416,56 @@ int main(int argc, char **argv){
 			fprintf(stderr, "bad command '%c' in file %s, line %d\n", cmd, file, line);
 			return 1;
 		}
+		if (w != 0) {
+			workload_add(w, cmd, inode, bno);
+		}
+		if (out != 0) {
+			struct trace_record tr;
+			memset(&tr, 0, sizeof(tr));
+			tr.cmd = cmd;
+			tr.inode = inode;
+			tr.block = bno;
+			fwrite(&tr, sizeof(tr), 1, out);
+			if (inode > th.max_inode) {
+				th.max_inode = inode;
+			}
+			if (bno > th.max_block) {
+				th.max_block = bno;
+			}
+		}
 	}
 
 	fclose(fp);
 
-	printf("trace file %s: ncmds=%u, %%rd = %u, %%wr = %u, %%setsize=%u\n", file, line,
-		(nread * 100 + 50) / line, (nwrite * 100 + 50) / line,
-		(nsetsize * 100 + 50) / line
+	if (out != 0) {
+		if (ncmds > TRACE_MAX_CMDS) {
+			fprintf(stderr, "too many commands in file %s for a binary trace (at most %u)\n",
+								file, TRACE_MAX_CMDS);
+			fclose(out);
+			return 1;
+		}
+		memcpy(th.magic, TRACE_MAGIC, TRACE_MAGIC_SIZE);
+		th.ncmds = ncmds;
+		th.nread = nread;
+		th.nwrite = nwrite;
+		th.nsetsize = nsetsize;
+		rewind(out);
+		fwrite(&th, sizeof(th), 1, out);
+		if (fclose(out) != 0) {
+			perror(binary);
+			return 1;
+		}
+	}
+
+	printf("trace file %s: ncmds=%llu, %%rd = %llu, %%wr = %llu, %%setsize=%llu\n",
+		file, (unsigned long long) ncmds,
+		(unsigned long long) ((nread * 100ULL + 50) / ncmds),
+		(unsigned long long) ((nwrite * 100ULL + 50) / ncmds),
+		(unsigned long long) ((nsetsize * 100ULL + 50) / ncmds)
 	);
+	if (w != 0) {
+		workload_report(w);
+	}
 
 	return 0;
 }
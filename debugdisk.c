@@ -85,5 +85,7 @@ block_store_t *debugdisk_init(block_store_t *below, char *descr){
 	this_bs->read = debugdisk_read;
 	this_bs->write = debugdisk_write;
 	this_bs->destroy = debugdisk_destroy;
+	this_bs->name = "debugdisk";
+	this_bs->below = below;
 	return this_bs;
 }
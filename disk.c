@@ -11,6 +11,14 @@
  *		block_store_t *disk_init(char *file_name, block_no nblocks)
  *			Create a new block store, stored in the file by the given
  *			name and with the given number of blocks.
+ *
+ * Asynchronous reads and writes are queued and carried out, in order of
+ * offset, by the next poll.  Runs of consecutive blocks can be read or
+ * written with a single preadv or pwritev (the readv and writev methods).
+ *
+ * A disk may be used by several threads at once: all I/O is done with
+ * pread and pwrite at explicit offsets, a lock protects the queue, and the
+ * stats are updated atomically.
  */
 
 #include <stdio.h>
@@ -18,11 +26,35 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #include "block_store.h"
 
+#define DISK_MAX_IOV	64			// max # blocks per preadv/pwritev
+
+/* A queued asynchronous request.
+ */
+struct disk_request {
+	int is_read;
+	block_no offset;
+	block_t *block;
+	block_done_t done;
+	void *arg;
+	unsigned long seq;			// order of arrival
+};
+
 struct disk_state {
 	block_no nblocks;			// #blocks in the block store
 	int fd;						// POSIX file descriptor of underlying file
+
+	pthread_mutex_t lock;		// protects the queue
+	struct disk_request *queue;	// queued asynchronous requests
+	unsigned int nqueued, queue_size;
+	unsigned long seq;			// sequence number of the next request
+
+	unsigned long nread, nwrite;	// stats (updated atomically)
+	unsigned long nbatches;		// # polls that did I/O
+	unsigned long nvectored;	// # preadv/pwritev calls
 };
 
 static int disk_nblocks(block_store_t *this_bs){
@@ -40,21 +72,24 @@ static int disk_setsize(block_store_t *this_bs, block_no nblocks){
 	return before;
 }
 
-static struct disk_state *disk_seek(block_store_t *this_bs, block_no offset){
+static struct disk_state *disk_check(block_store_t *this_bs, block_no offset){
 	struct disk_state *ds = this_bs->state;
 
 	if (offset >= ds->nblocks) {
 		fprintf(stderr, "--> %u %u\n", offset, ds->nblocks);
-		panic("disk_seek: offset too large");
+		panic("disk_check: offset too large");
 	}
-	lseek(ds->fd, (off_t) offset * BLOCK_SIZE, SEEK_SET);
 	return ds;
 }
 
+static int disk_poll(block_store_t *this_bs, int wait);
+
 static int disk_read(block_store_t *this_bs, block_no offset, block_t *block){
-	struct disk_state *ds = disk_seek(this_bs, offset);
+	disk_poll(this_bs, 0);		// finish queued requests first
+	struct disk_state *ds = disk_check(this_bs, offset);
 
-	int n = read(ds->fd, (void *) block, BLOCK_SIZE);
+	__atomic_add_fetch(&ds->nread, 1, __ATOMIC_RELAXED);
+	int n = pread(ds->fd, (void *) block, BLOCK_SIZE, (off_t) offset * BLOCK_SIZE);
 	if (n < 0) {
 		perror("disk_read");
 		return -1;
@@ -66,9 +101,11 @@ static int disk_read(block_store_t *this_bs, block_no offset, block_t *block){
 }
 
 static int disk_write(block_store_t *this_bs, block_no offset, block_t *block){
-	struct disk_state *ds = disk_seek(this_bs, offset);
+	disk_poll(this_bs, 0);		// finish queued requests first
+	struct disk_state *ds = disk_check(this_bs, offset);
 
-	int n = write(ds->fd, (void *) block, BLOCK_SIZE);
+	__atomic_add_fetch(&ds->nwrite, 1, __ATOMIC_RELAXED);
+	int n = pwrite(ds->fd, (void *) block, BLOCK_SIZE, (off_t) offset * BLOCK_SIZE);
 	if (n < 0) {
 		perror("disk_write");
 		return -1;
@@ -80,9 +117,185 @@ static int disk_write(block_store_t *this_bs, block_no offset, block_t *block){
 	return 0;
 }
 
+/* Read or write n consecutive blocks, DISK_MAX_IOV at a time.  Reads past
+ * the end of the file return zeroes.
+ */
+static int disk_vectored(block_store_t *this_bs, int is_read, block_no offset,
+							block_t **blocks, unsigned int n){
+	struct disk_state *ds = this_bs->state;
+	struct iovec iov[DISK_MAX_IOV];
+
+	disk_poll(this_bs, 0);		// finish queued requests first
+	if (offset >= ds->nblocks || n > ds->nblocks - offset) {
+		fprintf(stderr, "disk_vectored: bad run %u+%u\n", offset, n);
+		return -1;
+	}
+	while (n > 0) {
+		unsigned int i, cnt = n < DISK_MAX_IOV ? n : DISK_MAX_IOV;
+		for (i = 0; i < cnt; i++) {
+			iov[i].iov_base = (void *) blocks[i];
+			iov[i].iov_len = BLOCK_SIZE;
+		}
+		off_t off = (off_t) offset * BLOCK_SIZE;
+		size_t len = (size_t) cnt * BLOCK_SIZE;
+		__atomic_add_fetch(&ds->nvectored, 1, __ATOMIC_RELAXED);
+		if (is_read) {
+			__atomic_add_fetch(&ds->nread, cnt, __ATOMIC_RELAXED);
+			ssize_t r = preadv(ds->fd, iov, cnt, off);
+			if (r < 0) {
+				perror("disk_readv");
+				return -1;
+			}
+			for (i = r / BLOCK_SIZE; i < cnt; i++) {
+				size_t done = i == r / BLOCK_SIZE ? r % BLOCK_SIZE : 0;
+				memset((char *) blocks[i] + done, 0, BLOCK_SIZE - done);
+			}
+		}
+		else {
+			__atomic_add_fetch(&ds->nwrite, cnt, __ATOMIC_RELAXED);
+			ssize_t r = pwritev(ds->fd, iov, cnt, off);
+			if (r < 0) {
+				perror("disk_writev");
+				return -1;
+			}
+			if ((size_t) r != len) {
+				fprintf(stderr, "disk_writev: wrote only %zd bytes\n", r);
+				return -1;
+			}
+		}
+		offset += cnt;
+		blocks += cnt;
+		n -= cnt;
+	}
+	return 0;
+}
+
+static int disk_readv(block_store_t *this_bs, block_no offset, block_t **blocks, unsigned int n){
+	return disk_vectored(this_bs, 1, offset, blocks, n);
+}
+
+static int disk_writev(block_store_t *this_bs, block_no offset, block_t **blocks, unsigned int n){
+	return disk_vectored(this_bs, 0, offset, blocks, n);
+}
+
+static int disk_enqueue(block_store_t *this_bs, int is_read, block_no offset,
+							block_t *block, block_done_t done, void *arg){
+	struct disk_state *ds = this_bs->state;
+
+	if (offset >= ds->nblocks) {
+		fprintf(stderr, "disk_enqueue: bad offset %u\n", offset);
+		return -1;
+	}
+	pthread_mutex_lock(&ds->lock);
+	if (ds->nqueued == ds->queue_size) {
+		ds->queue_size = ds->queue_size == 0 ? 16 : 2 * ds->queue_size;
+		ds->queue = realloc(ds->queue, ds->queue_size * sizeof(*ds->queue));
+	}
+	struct disk_request *dr = &ds->queue[ds->nqueued++];
+	dr->is_read = is_read;
+	dr->offset = offset;
+	dr->block = block;
+	dr->done = done;
+	dr->arg = arg;
+	dr->seq = ds->seq++;
+	pthread_mutex_unlock(&ds->lock);
+	return 0;
+}
+
+static int disk_read_async(block_store_t *this_bs, block_no offset, block_t *block,
+											block_done_t done, void *arg){
+	return disk_enqueue(this_bs, 1, offset, block, done, arg);
+}
+
+static int disk_write_async(block_store_t *this_bs, block_no offset, block_t *block,
+											block_done_t done, void *arg){
+	return disk_enqueue(this_bs, 0, offset, block, done, arg);
+}
+
+/* Sort by offset, keeping submission order for equal offsets.
+ */
+static int disk_request_cmp(const void *a, const void *b){
+	const struct disk_request *x = a, *y = b;
+
+	if (x->offset != y->offset) {
+		return x->offset < y->offset ? -1 : 1;
+	}
+	return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+/* Carry out all queued requests in order of offset.  Completions may queue
+ * new requests, which are left for the next poll.  The lock is only held
+ * to take the queue, not during the I/O and the completions.
+ */
+static int disk_poll(block_store_t *this_bs, int wait){
+	struct disk_state *ds = this_bs->state;
+
+	pthread_mutex_lock(&ds->lock);
+	unsigned int n = ds->nqueued;
+	if (n == 0) {
+		pthread_mutex_unlock(&ds->lock);
+		return 0;
+	}
+	struct disk_request *batch = ds->queue;
+	ds->queue = 0;
+	ds->nqueued = ds->queue_size = 0;
+	pthread_mutex_unlock(&ds->lock);
+	qsort(batch, n, sizeof(*batch), disk_request_cmp);
+	__atomic_add_fetch(&ds->nbatches, 1, __ATOMIC_RELAXED);
+
+	unsigned int i;
+	for (i = 0; i < n; i++) {
+		struct disk_request *dr = &batch[i];
+		off_t off = (off_t) dr->offset * BLOCK_SIZE;
+		int result = 0;
+		if (dr->is_read) {
+			__atomic_add_fetch(&ds->nread, 1, __ATOMIC_RELAXED);
+			int r = pread(ds->fd, (void *) dr->block, BLOCK_SIZE, off);
+			if (r < 0) {
+				perror("disk_read");
+				result = -1;
+			}
+			else if (r < BLOCK_SIZE) {
+				memset((char *) dr->block + r, 0, BLOCK_SIZE - r);
+			}
+		}
+		else {
+			__atomic_add_fetch(&ds->nwrite, 1, __ATOMIC_RELAXED);
+			int r = pwrite(ds->fd, (void *) dr->block, BLOCK_SIZE, off);
+			if (r < 0) {
+				perror("disk_write");
+				result = -1;
+			}
+			else if (r != BLOCK_SIZE) {
+				fprintf(stderr, "disk_write: wrote only %d bytes\n", r);
+				result = -1;
+			}
+		}
+		(*dr->done)(dr->arg, result);
+	}
+	free(batch);
+	return 0;
+}
+
+static void disk_stats(block_store_t *this_bs, block_stat_t emit, void *arg){
+	struct disk_state *ds = this_bs->state;
+
+	(*emit)(arg, "nread", BLOCK_STAT_COUNTER, ds->nread);
+	(*emit)(arg, "nwrite", BLOCK_STAT_COUNTER, ds->nwrite);
+	(*emit)(arg, "nbatches", BLOCK_STAT_COUNTER, ds->nbatches);
+	(*emit)(arg, "nvectored", BLOCK_STAT_COUNTER, ds->nvectored);
+	(*emit)(arg, "nblocks", BLOCK_STAT_GAUGE, ds->nblocks);
+	(*emit)(arg, "queued", BLOCK_STAT_GAUGE, ds->nqueued);
+}
+
 static void disk_destroy(block_store_t *this_bs){
 	struct disk_state *ds = this_bs->state;
 
+	while (ds->nqueued > 0) {
+		disk_poll(this_bs, 1);
+	}
+	free(ds->queue);
+	pthread_mutex_destroy(&ds->lock);
 	close(ds->fd);
 	free(ds);
 	free(this_bs);
@@ -97,6 +310,7 @@ block_store_t *disk_init(char *file_name, block_no nblocks){
 		panic("disk_init");
 	}
 	ds->nblocks = nblocks;
+	pthread_mutex_init(&ds->lock, 0);
 
 	block_store_t *this_bs = calloc(1, sizeof(*this_bs));
 	this_bs->state = ds;
@@ -105,5 +319,12 @@ block_store_t *disk_init(char *file_name, block_no nblocks){
 	this_bs->read = disk_read;
 	this_bs->write = disk_write;
 	this_bs->destroy = disk_destroy;
+	this_bs->read_async = disk_read_async;
+	this_bs->write_async = disk_write_async;
+	this_bs->poll = disk_poll;
+	this_bs->readv = disk_readv;
+	this_bs->writev = disk_writev;
+	this_bs->name = "disk";
+	this_bs->stats = disk_stats;
 	return this_bs;
 }
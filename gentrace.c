@@ -0,0 +1,281 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* Generate a synthetic trace for the tracedisk (see tracedisk.c):
+ *
+ *	gentrace [options] > trace.txt
+ *
+ *		-n ncmds		number of commands (default 10000)
+ *		-i ninodes		number of inodes used (default 16, at most 128)
+ *		-b nblocks		blocks per inode (default 256)
+ *		-p pattern		block popularity within an inode:
+ *							uniform		all blocks equally likely (default)
+ *							zipf		block k with probability ~ 1/k^theta
+ *							seq			sequential scan, wrapping around
+ *							loop		sequential loop over -l blocks, which
+ *										defeats LRU if larger than the cache
+ *		-z theta		Zipf exponent for "-p zipf" (default 0.99)
+ *		-l length		loop length for "-p loop" (default 64)
+ *		-k theta		Zipf exponent of inode popularity (default 0, uniform)
+ *		-r percent		percentage of reads among reads and writes (default 50)
+ *		-t percent		percentage of commands that truncate an inode (default 1)
+ *		-c percent		percentage of commands that check a size (default 1)
+ *		-s seed			random seed (default 1)
+ *		-o file			write to file rather than standard output
+ *		-B				write the binary format (see tracefile.h)
+ *
+ * The generator keeps track of the size of each inode, so that the trace
+ * only reads blocks that exist (a read beyond the end becomes a write),
+ * truncates to size 0 (the only size treedisk supports), and checks sizes
+ * with the right answer.  The same seed gives the same trace.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include "tracefile.h"
+
+#define MAX_INODES		128
+#define MAX_BLOCKS		(1 << 27)
+
+enum { P_UNIFORM, P_ZIPF, P_SEQ, P_LOOP };
+
+static uint64_t rng_state;
+
+/* xorshift64*.
+ */
+static uint64_t rng_next(void){
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+/* Uniform in [0, 1).
+ */
+static double rng_double(void){
+	return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static unsigned int rng_below(unsigned int n){
+	return (unsigned int) (((rng_next() >> 32) * n) >> 32);
+}
+
+/* Cumulative distribution of a Zipf distribution over n items.
+ */
+static double *zipf_cdf(unsigned int n, double theta){
+	double *cdf = malloc(n * sizeof(*cdf)), sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		sum += 1.0 / pow(i + 1, theta);
+		cdf[i] = sum;
+	}
+	for (i = 0; i < n; i++) {
+		cdf[i] /= sum;
+	}
+	return cdf;
+}
+
+static unsigned int zipf_draw(double *cdf, unsigned int n){
+	double u = rng_double();
+	unsigned int lo = 0, hi = n - 1;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		if (cdf[mid] <= u) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static void usage(char *prog){
+	fprintf(stderr, "usage: %s [-n ncmds] [-i ninodes] [-b nblocks] [-p uniform|zipf|seq|loop] [-z theta] [-l length] [-k theta] [-r read%%] [-t truncate%%] [-c check%%] [-s seed] [-o file] [-B]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv){
+	unsigned long ncmds = 10000;
+	unsigned int ninodes = 16, nblocks = 256, loop = 64;
+	int pattern = P_UNIFORM, binary = 0;
+	double theta = 0.99, inode_theta = 0;
+	double read_pct = 50, trunc_pct = 1, check_pct = 1;
+	char *file = 0;
+	int c;
+
+	rng_state = 1;
+	while ((c = getopt(argc, argv, "n:i:b:p:z:l:k:r:t:c:s:o:B")) != -1) {
+		switch (c) {
+		case 'n':
+			ncmds = strtoul(optarg, 0, 0);
+			break;
+		case 'i':
+			ninodes = atoi(optarg);
+			break;
+		case 'b':
+			nblocks = strtoul(optarg, 0, 0);
+			break;
+		case 'p':
+			if (strcmp(optarg, "uniform") == 0) {
+				pattern = P_UNIFORM;
+			}
+			else if (strcmp(optarg, "zipf") == 0) {
+				pattern = P_ZIPF;
+			}
+			else if (strcmp(optarg, "seq") == 0) {
+				pattern = P_SEQ;
+			}
+			else if (strcmp(optarg, "loop") == 0) {
+				pattern = P_LOOP;
+			}
+			else {
+				usage(argv[0]);
+			}
+			break;
+		case 'z':
+			theta = atof(optarg);
+			break;
+		case 'l':
+			loop = atoi(optarg);
+			break;
+		case 'k':
+			inode_theta = atof(optarg);
+			break;
+		case 'r':
+			read_pct = atof(optarg);
+			break;
+		case 't':
+			trunc_pct = atof(optarg);
+			break;
+		case 'c':
+			check_pct = atof(optarg);
+			break;
+		case 's':
+			rng_state = strtoull(optarg, 0, 0) * 0x9e3779b97f4a7c15ULL + 1;
+			break;
+		case 'o':
+			file = optarg;
+			break;
+		case 'B':
+			binary = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || ninodes == 0 || ninodes > MAX_INODES || nblocks == 0 || nblocks > MAX_BLOCKS || loop == 0) {
+		usage(argv[0]);
+	}
+	if (loop > nblocks) {
+		loop = nblocks;
+	}
+	if (binary && ncmds > TRACE_MAX_CMDS) {
+		fprintf(stderr, "%s: at most %u commands in a binary trace\n", argv[0], TRACE_MAX_CMDS);
+		return 1;
+	}
+
+	FILE *out = stdout;
+	if (file != 0 && (out = fopen(file, "w")) == 0) {
+		perror(file);
+		return 1;
+	}
+	static char buf[1 << 20];
+	setvbuf(out, buf, _IOFBF, sizeof(buf));
+
+	struct trace_header th;
+	memset(&th, 0, sizeof(th));
+	if (binary) {
+		fwrite(&th, sizeof(th), 1, out);
+	}
+
+	double *block_cdf = pattern == P_ZIPF ? zipf_cdf(nblocks, theta) : 0;
+	double *inode_cdf = inode_theta > 0 ? zipf_cdf(ninodes, inode_theta) : 0;
+	unsigned int size[MAX_INODES], cursor[MAX_INODES];
+	memset(size, 0, sizeof(size));
+	memset(cursor, 0, sizeof(cursor));
+
+	unsigned long i;
+	for (i = 0; i < ncmds; i++) {
+		unsigned int inode = inode_cdf != 0 ? zipf_draw(inode_cdf, ninodes) : rng_below(ninodes);
+		double u = rng_double() * 100;
+		char cmd;
+		unsigned int arg;
+
+		if (u < trunc_pct) {
+			cmd = 'S';
+			arg = 0;
+			size[inode] = 0;
+			cursor[inode] = 0;
+		}
+		else if (u < trunc_pct + check_pct) {
+			cmd = 'N';
+			arg = size[inode];
+		}
+		else {
+			switch (pattern) {
+			case P_ZIPF:
+				arg = zipf_draw(block_cdf, nblocks);
+				break;
+			case P_SEQ:
+				arg = cursor[inode]++ % nblocks;
+				break;
+			case P_LOOP:
+				arg = cursor[inode]++ % loop;
+				break;
+			default:
+				arg = rng_below(nblocks);
+			}
+			cmd = rng_double() * 100 < read_pct && arg < size[inode] ? 'R' : 'W';
+			if (cmd == 'W' && arg >= size[inode]) {
+				size[inode] = arg + 1;
+			}
+		}
+
+		if (binary) {
+			struct trace_record tr;
+			memset(&tr, 0, sizeof(tr));
+			tr.cmd = cmd;
+			tr.inode = inode;
+			tr.block = arg;
+			fwrite(&tr, sizeof(tr), 1, out);
+			th.nread += cmd == 'R';
+			th.nwrite += cmd == 'W';
+			th.nsetsize += cmd == 'S';
+			if (inode > th.max_inode) {
+				th.max_inode = inode;
+			}
+			if (arg > th.max_block) {
+				th.max_block = arg;
+			}
+		}
+		else {
+			fprintf(out, "%c:%u:%u\n", cmd, inode, arg);
+		}
+	}
+
+	if (binary) {
+		memcpy(th.magic, TRACE_MAGIC, TRACE_MAGIC_SIZE);
+		th.ncmds = ncmds;
+		if (fseek(out, 0, SEEK_SET) < 0) {
+			perror("gentrace: binary output must be seekable");
+			return 1;
+		}
+		fwrite(&th, sizeof(th), 1, out);
+	}
+	if (fclose(out) != 0) {
+		perror(file == 0 ? "standard output" : file);
+		return 1;
+	}
+	free(block_cdf);
+	free(inode_cdf);
+	return 0;
+}
@@ -0,0 +1,281 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* Compares cache replacement policies over traces and cache sizes:
+ *
+ *	matrix [-j nthreads] [-P policy,...] [-c size,...] [-d disk-size] [-o file.csv] trace ...
+ *
+ *		-j nthreads		number of cells run in parallel (default: # cores)
+ *		-P policies		replacement policies (default lru,fifo,clock,lfu,random)
+ *		-c sizes		cache sizes in blocks (default 4,8,...,4096)
+ *		-d disk-size	size of the ramdisk in blocks (default 16K)
+ *		-o file			write the results as CSV rather than as tables
+ *
+ * Each cell of the matrix (a trace, a cache size, and a policy) replays
+ * the trace on the same stack as "./trace", built in this process: a
+ * fresh ramdisk with a new treedisk file system, a statdisk, and a
+ * cachedisk with the given policy and size.  A cell reports the number of
+ * reads that got past the cache (counted by the statdisk) and the time
+ * the replay took.  The cells are spread over worker threads; as each
+ * cell has a file system of its own, they do not share any locks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "block_store.h"
+
+#define DISK_SIZE		(16 * 1024)		// default size of "physical" disk
+#define MAX_INODES		128
+#define MAX_LIST		64				// max # policies or cache sizes
+
+struct cell {
+	char *trace;
+	char *policy;
+	block_no cache_size;
+
+	/* Results.
+	 */
+	double nread;						// reads below the cache
+	double seconds;						// replay time
+	int failed;
+};
+
+struct matrix {
+	struct cell *cells;
+	unsigned int ncells;
+	unsigned int next;					// next cell to run
+	block_no disk_size;
+	pthread_mutex_t lock;
+};
+
+/* Picks the results of a cell out of the stats of its stack.
+ */
+struct cell_stats {
+	struct cell *cell;
+	char *layer;
+};
+
+static void cell_stat(void *arg, char *name, int kind, double value){
+	struct cell_stats *cs = arg;
+
+	if (strcmp(cs->layer, "statdisk") == 0 && strcmp(name, "nread") == 0) {
+		cs->cell->nread = value;
+	}
+	if (strcmp(cs->layer, "tracedisk") == 0 && strcmp(name, "seconds") == 0) {
+		cs->cell->seconds = value;
+	}
+}
+
+static void run_cell(struct matrix *m, struct cell *c){
+	block_store_t *disk, *sdisk, *cdisk, *tdisk, *bs;
+
+	if ((disk = ramdisk_init_sparse(m->disk_size)) == 0 ||
+							treedisk_create(disk, MAX_INODES) < 0) {
+		panic("matrix: can't create treedisk file system");
+	}
+	sdisk = statdisk_init(disk);
+	block_t *cache = malloc(c->cache_size * BLOCK_SIZE);
+	if ((cdisk = cachedisk_init_policy(sdisk, cache, c->cache_size, c->policy)) == 0) {
+		c->failed = 1;
+	}
+	else {
+		tdisk = tracedisk_init(cdisk, c->trace, MAX_INODES);
+		for (bs = tdisk; bs != 0; bs = bs->below) {
+			if (bs->stats != 0) {
+				struct cell_stats cs = { c, bs->name };
+				(*bs->stats)(bs, cell_stat, &cs);
+			}
+		}
+		(*tdisk->destroy)(tdisk);
+		(*cdisk->destroy)(cdisk);
+	}
+	(*sdisk->destroy)(sdisk);
+	(*disk->destroy)(disk);
+	free(cache);
+}
+
+static void *matrix_worker(void *arg){
+	struct matrix *m = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&m->lock);
+		unsigned int i = m->next++;
+		pthread_mutex_unlock(&m->lock);
+		if (i >= m->ncells) {
+			return 0;
+		}
+		run_cell(m, &m->cells[i]);
+	}
+}
+
+/* Split a comma-separated list in place.
+ */
+static unsigned int split(char *list, char **items){
+	unsigned int n = 0;
+	char *item;
+
+	while ((item = strsep(&list, ",")) != 0) {
+		if (*item != 0 && n < MAX_LIST) {
+			items[n++] = item;
+		}
+	}
+	return n;
+}
+
+static void print_table(struct matrix *m, char **traces, unsigned int ntraces,
+						char **policies, unsigned int npolicies, unsigned int nsizes){
+	unsigned int t, s, p;
+
+	for (t = 0; t < ntraces; t++) {
+		printf("%s: reads below the cache (replay ms)\n", traces[t]);
+		printf("%8s", "size");
+		for (p = 0; p < npolicies; p++) {
+			printf(" %18s", policies[p]);
+		}
+		printf("\n");
+		for (s = 0; s < nsizes; s++) {
+			struct cell *row = &m->cells[(t * nsizes + s) * npolicies];
+			printf("%8u", row->cache_size);
+			for (p = 0; p < npolicies; p++) {
+				if (row[p].failed) {
+					printf(" %18s", "-");
+				}
+				else {
+					printf(" %9.0f (%6.1f)", row[p].nread, row[p].seconds * 1000);
+				}
+			}
+			printf("\n");
+		}
+		printf("\n");
+	}
+}
+
+static int write_csv(struct matrix *m, char *file){
+	FILE *out;
+	unsigned int i;
+
+	if ((out = fopen(file, "w")) == 0) {
+		perror(file);
+		return -1;
+	}
+	fprintf(out, "trace,policy,cache_size,nread,seconds\n");
+	for (i = 0; i < m->ncells; i++) {
+		struct cell *c = &m->cells[i];
+		if (!c->failed) {
+			fprintf(out, "%s,%s,%u,%.0f,%.6f\n", c->trace, c->policy,
+									c->cache_size, c->nread, c->seconds);
+		}
+	}
+	if (fclose(out) != 0) {
+		perror(file);
+		return -1;
+	}
+	return 0;
+}
+
+static void usage(char *prog){
+	fprintf(stderr, "usage: %s [-j nthreads] [-P policy,...] [-c size,...] [-d disk-size] [-o file.csv] trace ...\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv){
+	char default_policies[] = "lru,fifo,clock,lfu,random";
+	char *policies[MAX_LIST], *sizes[MAX_LIST], *csv = 0;
+	unsigned int npolicies = split(default_policies, policies), nsizes = 0;
+	block_no cache_sizes[MAX_LIST];
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	struct matrix m;
+	int c;
+	unsigned int i, t, s, p;
+
+	memset(&m, 0, sizeof(m));
+	m.disk_size = DISK_SIZE;
+	while ((c = getopt(argc, argv, "j:P:c:d:o:")) != -1) {
+		switch (c) {
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'P':
+			npolicies = split(optarg, policies);
+			break;
+		case 'c':
+			nsizes = split(optarg, sizes);
+			for (i = 0; i < nsizes; i++) {
+				cache_sizes[i] = strtoul(sizes[i], 0, 0);
+			}
+			break;
+		case 'd':
+			m.disk_size = strtoul(optarg, 0, 0);
+			break;
+		case 'o':
+			csv = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc || npolicies == 0 || nthreads <= 0) {
+		usage(argv[0]);
+	}
+	for (p = 0; p < npolicies; p++) {
+		block_store_t *bs = cachedisk_init_policy(0, 0, 1, policies[p]);
+		if (bs == 0) {
+			usage(argv[0]);
+		}
+		(*bs->destroy)(bs);
+	}
+	if (nsizes == 0) {
+		block_no size;
+		for (size = 4; size <= 4096; size *= 2) {
+			cache_sizes[nsizes++] = size;
+		}
+	}
+
+	/* Lay the cells out by trace, then cache size, then policy.
+	 */
+	char **traces = &argv[optind];
+	unsigned int ntraces = argc - optind;
+	m.ncells = ntraces * nsizes * npolicies;
+	m.cells = calloc(m.ncells, sizeof(*m.cells));
+	for (t = 0; t < ntraces; t++) {
+		for (s = 0; s < nsizes; s++) {
+			for (p = 0; p < npolicies; p++) {
+				struct cell *cl = &m.cells[(t * nsizes + s) * npolicies + p];
+				cl->trace = traces[t];
+				cl->policy = policies[p];
+				cl->cache_size = cache_sizes[s];
+			}
+		}
+	}
+
+	pthread_mutex_init(&m.lock, 0);
+	if (nthreads > m.ncells) {
+		nthreads = m.ncells;
+	}
+	pthread_t *tids = calloc(nthreads, sizeof(*tids));
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&tids[i], 0, matrix_worker, &m) != 0) {
+			panic("matrix: pthread_create");
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(tids[i], 0);
+	}
+	pthread_mutex_destroy(&m.lock);
+
+	int result = 0;
+	if (csv != 0) {
+		result = write_csv(&m, csv) < 0;
+	}
+	else {
+		print_table(&m, traces, ntraces, policies, npolicies, nsizes);
+	}
+	free(tids);
+	free(m.cells);
+	return result;
+}
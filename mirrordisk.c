@@ -0,0 +1,745 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* This block store module keeps a copy of every block on each of several
+ * underlying block stores (the replicas):
+ *
+ *		block_store_t *mirrordisk_init(block_store_t **stores, unsigned int n)
+ *			'stores' is an array of the n replicas.  They are assumed to
+ *			be in sync to begin with.
+ *
+ *		int mirrordisk_set_online(block_store_t *this_bs, unsigned int replica,
+ *											int online)
+ *			Take a replica offline (for example, for maintenance) or
+ *			bring it back.  Returns 0, or -1 if there is no such
+ *			replica or it is the last one online.
+ *
+ *		void mirrordisk_dump_stats(block_store_t *this_bs)
+ *			Prints the reads served, writes missed, and regions resynced
+ *			per replica.
+ *
+ * A write goes to all replicas that are online, in parallel: each replica
+ * has a worker thread, and the calling thread does the write on the
+ * first replica itself.  It succeeds if it succeeds on at least one.
+ *
+ * Each replica has a bitmap of dirty regions of MIRROR_REGION_BLOCKS
+ * blocks: regions with writes that the replica missed, because it was
+ * offline or the write failed.  A read goes to one of the online replicas
+ * on which the region is not dirty: the one with the lowest expected
+ * latency, that is, the number of its reads in progress plus one times
+ * the moving average of its read latency.  So that the averages stay up
+ * to date, every MIRROR_PROBE_INTERVAL-th read goes to the replicas in
+ * turn instead.  If the read fails, another replica is tried, and the
+ * region is marked dirty on the failed one unless it is the last clean
+ * copy; if no replica can read it, the read fails.
+ *
+ * A background thread resyncs the dirty regions of online replicas by
+ * copying just these regions from an online replica on which they are
+ * clean.  It goes around the regions in turn, skipping those without such
+ * a source, so that one region that cannot be copied does not hold up the
+ * others.  Writes wait while a region is copied, so that the copy is not
+ * stale.
+ *
+ * Each replica has a lock, so a mirrordisk may be used by several threads
+ * at once.  The replicas are not destroyed along with the mirrordisk, and
+ * regions that are still dirty are not resynced at that point.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "block_store.h"
+
+#define MIRROR_REGION_BLOCKS	64			// blocks per bit of a dirty bitmap
+#define MIRROR_LAT_SHIFT		3			// weight 1/8 of a new latency sample
+#define MIRROR_LAT_INIT			1000		// initial latency estimate (ns)
+#define MIRROR_RESYNC_PAUSE_MS	100			// retry interval after a failed copy
+#define MIRROR_PROBE_INTERVAL	64			// reads per read that ignores latency
+
+/* Waits for the writes of one operation on the replicas.
+ */
+struct mirror_wait {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int pending;			// # writes not yet done
+};
+
+/* A write on one replica, for its worker thread.
+ */
+struct mirror_job {
+	struct mirror_job *next;
+	block_no offset;
+	block_t **blocks;
+	unsigned int n;
+	int result;
+	struct mirror_wait *wait;
+};
+
+struct mirror_replica {
+	block_store_t *bs;
+	pthread_mutex_t lock;			// serializes the I/O on the replica
+	int online;
+
+	uint64_t *dirty;				// bitmap of dirty regions
+	unsigned int ndirty;			// # bits set in 'dirty'
+
+	unsigned int inflight;			// # reads in progress
+	uint64_t lat_ns;				// moving average of read latency
+
+	unsigned long nread;			// # blocks read
+	unsigned long nwrite;			// # blocks written
+	unsigned long nmissed;			// # block writes missed
+	unsigned long nfailed;			// # failed reads
+	unsigned long nresynced;		// # regions resynced
+
+	pthread_mutex_t qlock;			// protects the fields below
+	pthread_cond_t qcond;
+	struct mirror_job *jobs, **tail;
+	int stop;
+	pthread_t worker;
+};
+
+struct mirrordisk_state {
+	struct mirror_replica *replicas;
+	unsigned int n;					// # replicas
+	block_no nblocks;
+	unsigned int nregions;			// # bits per dirty bitmap
+	unsigned long nchosen;			// # reads that chose a replica
+	pthread_mutex_t dlock;			// protects the dirty bitmaps and 'online'
+	pthread_rwlock_t resync;		// held by writes (shared) and a resync
+
+	pthread_cond_t wake;			// wakes up the resync thread
+	unsigned int next_to;			// where the resync thread looks next
+	unsigned int next_region;
+	int stop;
+	pthread_t resyncer;
+};
+
+static uint64_t mirrordisk_now(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int mirror_words(unsigned int nregions){
+	return (nregions + 63) / 64;
+}
+
+/* Dirty bitmaps.  Called with dlock held.
+ */
+static int mirror_is_dirty(struct mirror_replica *mr, unsigned int region){
+	return (mr->dirty[region / 64] >> (region % 64)) & 1;
+}
+
+static void mirror_set_dirty(struct mirror_replica *mr, unsigned int region){
+	if (!mirror_is_dirty(mr, region)) {
+		mr->dirty[region / 64] |= (uint64_t) 1 << (region % 64);
+		mr->ndirty++;
+	}
+}
+
+static void mirror_clear_dirty(struct mirror_replica *mr, unsigned int region){
+	if (mirror_is_dirty(mr, region)) {
+		mr->dirty[region / 64] &= ~((uint64_t) 1 << (region % 64));
+		mr->ndirty--;
+	}
+}
+
+/* Mark the regions of the given blocks dirty on a replica.
+ */
+static void mirror_mark(struct mirrordisk_state *ms, struct mirror_replica *mr,
+										block_no offset, unsigned int n){
+	unsigned int r;
+
+	pthread_mutex_lock(&ms->dlock);
+	for (r = offset / MIRROR_REGION_BLOCKS; r <= (offset + n - 1) / MIRROR_REGION_BLOCKS; r++) {
+		mirror_set_dirty(mr, r);
+	}
+	if (mr->online) {
+		pthread_cond_signal(&ms->wake);
+	}
+	pthread_mutex_unlock(&ms->dlock);
+}
+
+/* After a failed read, mark the regions of the given blocks dirty on a
+ * replica, except for those of which it has the only clean copy: these
+ * stay readable there (the next read may well succeed) rather than be
+ * lost for good.
+ */
+static void mirror_mark_failed(struct mirrordisk_state *ms, struct mirror_replica *mr,
+										block_no offset, unsigned int n){
+	unsigned int i, r;
+
+	pthread_mutex_lock(&ms->dlock);
+	for (r = offset / MIRROR_REGION_BLOCKS; r <= (offset + n - 1) / MIRROR_REGION_BLOCKS; r++) {
+		for (i = 0; i < ms->n; i++) {
+			struct mirror_replica *other = &ms->replicas[i];
+			if (other != mr && !mirror_is_dirty(other, r)) {
+				break;
+			}
+		}
+		if (i < ms->n) {
+			mirror_set_dirty(mr, r);
+		}
+	}
+	if (mr->online) {
+		pthread_cond_signal(&ms->wake);
+	}
+	pthread_mutex_unlock(&ms->dlock);
+}
+
+static int mirrordisk_nblocks(block_store_t *this_bs){
+	struct mirrordisk_state *ms = this_bs->state;
+
+	return ms->nblocks;
+}
+
+/*************************************************************************
+ * Reads
+ ************************************************************************/
+
+/* Choose the online replica with the lowest expected latency among those
+ * on which the given blocks are clean and that have not been tried yet,
+ * or for a probe the first of these after the previous probe.  Returns -1
+ * if there is none.
+ */
+static int mirror_choose(struct mirrordisk_state *ms, block_no offset, unsigned int n,
+												uint64_t tried){
+	unsigned int first = offset / MIRROR_REGION_BLOCKS;
+	unsigned int last = (offset + n - 1) / MIRROR_REGION_BLOCKS;
+	uint64_t best_cost = 0;
+	int best = -1;
+	unsigned int i, j, r;
+
+	unsigned long count = __atomic_fetch_add(&ms->nchosen, 1, __ATOMIC_RELAXED);
+	int probe = count % MIRROR_PROBE_INTERVAL == 0;
+	unsigned int start = probe ? (count / MIRROR_PROBE_INTERVAL) % ms->n : 0;
+	pthread_mutex_lock(&ms->dlock);
+	for (j = 0; j < ms->n; j++) {
+		i = (start + j) % ms->n;
+		struct mirror_replica *mr = &ms->replicas[i];
+		if (!mr->online || ((tried >> i) & 1)) {
+			continue;
+		}
+		for (r = first; r <= last && (mr->ndirty == 0 || !mirror_is_dirty(mr, r)); r++) {
+		}
+		if (r <= last) {
+			continue;
+		}
+		if (probe) {
+			best = i;
+			break;
+		}
+		uint64_t cost = (__atomic_load_n(&mr->inflight, __ATOMIC_RELAXED) + 1) *
+							__atomic_load_n(&mr->lat_ns, __ATOMIC_RELAXED);
+		if (best < 0 || cost < best_cost) {
+			best = i;
+			best_cost = cost;
+		}
+	}
+	pthread_mutex_unlock(&ms->dlock);
+	return best;
+}
+
+static int mirrordisk_readv(block_store_t *this_bs, block_no offset, block_t **blocks, unsigned int n){
+	struct mirrordisk_state *ms = this_bs->state;
+	uint64_t tried = 0;
+	int i;
+
+	if (n == 0) {
+		return 0;
+	}
+	if (offset >= ms->nblocks || n > ms->nblocks - offset) {
+		fprintf(stderr, "mirrordisk: bad offset %u (%u blocks)\n", offset, n);
+		return -1;
+	}
+	while ((i = mirror_choose(ms, offset, n, tried)) >= 0) {
+		struct mirror_replica *mr = &ms->replicas[i];
+		__atomic_add_fetch(&mr->inflight, 1, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&mr->lock);
+		uint64_t start = mirrordisk_now();
+		int result = block_store_readv(mr->bs, offset, blocks, n);
+		uint64_t lat = (mirrordisk_now() - start) / n;
+		mr->lat_ns += ((int64_t) lat - (int64_t) mr->lat_ns) >> MIRROR_LAT_SHIFT;
+		mr->nread += n;
+		pthread_mutex_unlock(&mr->lock);
+		__atomic_sub_fetch(&mr->inflight, 1, __ATOMIC_RELAXED);
+		if (result == 0) {
+			return 0;
+		}
+		__atomic_add_fetch(&mr->nfailed, 1, __ATOMIC_RELAXED);
+		mirror_mark_failed(ms, mr, offset, n);
+		tried |= (uint64_t) 1 << i;
+	}
+	fprintf(stderr, "mirrordisk: no replica can read block %u\n", offset);
+	return -1;
+}
+
+static int mirrordisk_read(block_store_t *this_bs, block_no offset, block_t *block){
+	return mirrordisk_readv(this_bs, offset, &block, 1);
+}
+
+/*************************************************************************
+ * Writes
+ ************************************************************************/
+
+static int mirror_replica_write(struct mirror_replica *mr, block_no offset,
+										block_t **blocks, unsigned int n){
+	pthread_mutex_lock(&mr->lock);
+	mr->nwrite += n;
+	int result = block_store_writev(mr->bs, offset, blocks, n);
+	pthread_mutex_unlock(&mr->lock);
+	return result;
+}
+
+static void *mirror_worker(void *arg){
+	struct mirror_replica *mr = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&mr->qlock);
+		while (mr->jobs == 0 && !mr->stop) {
+			pthread_cond_wait(&mr->qcond, &mr->qlock);
+		}
+		struct mirror_job *mj = mr->jobs;
+		if (mj == 0) {
+			pthread_mutex_unlock(&mr->qlock);
+			return 0;
+		}
+		if ((mr->jobs = mj->next) == 0) {
+			mr->tail = &mr->jobs;
+		}
+		pthread_mutex_unlock(&mr->qlock);
+
+		mj->result = mirror_replica_write(mr, mj->offset, mj->blocks, mj->n);
+		struct mirror_wait *mw = mj->wait;
+		pthread_mutex_lock(&mw->lock);
+		if (--mw->pending == 0) {
+			pthread_cond_signal(&mw->cond);
+		}
+		pthread_mutex_unlock(&mw->lock);
+	}
+}
+
+static void mirror_submit(struct mirror_replica *mr, struct mirror_job *mj){
+	pthread_mutex_lock(&mr->qlock);
+	mj->next = 0;
+	*mr->tail = mj;
+	mr->tail = &mj->next;
+	pthread_cond_signal(&mr->qcond);
+	pthread_mutex_unlock(&mr->qlock);
+}
+
+static int mirrordisk_writev(block_store_t *this_bs, block_no offset, block_t **blocks, unsigned int n){
+	struct mirrordisk_state *ms = this_bs->state;
+	unsigned int i;
+
+	if (n == 0) {
+		return 0;
+	}
+	if (offset >= ms->nblocks || n > ms->nblocks - offset) {
+		fprintf(stderr, "mirrordisk: bad offset %u (%u blocks)\n", offset, n);
+		return -1;
+	}
+	pthread_rwlock_rdlock(&ms->resync);
+
+	/* Hand the writes on all but the first online replica to the
+	 * workers.  Replicas that are offline miss the write.
+	 */
+	struct mirror_job *jobs = calloc(ms->n, sizeof(*jobs));
+	struct mirror_wait mw;
+	pthread_mutex_init(&mw.lock, 0);
+	pthread_cond_init(&mw.cond, 0);
+	mw.pending = 0;
+	int first = -1;
+	pthread_mutex_lock(&ms->dlock);
+	for (i = 0; i < ms->n; i++) {
+		jobs[i].result = -1;
+		if (ms->replicas[i].online && first < 0) {
+			first = i;
+		}
+		else if (ms->replicas[i].online) {
+			jobs[i].offset = offset;
+			jobs[i].blocks = blocks;
+			jobs[i].n = n;
+			jobs[i].wait = &mw;
+			mw.pending++;
+		}
+	}
+	pthread_mutex_unlock(&ms->dlock);
+	for (i = 0; i < ms->n; i++) {
+		if (jobs[i].n != 0) {
+			mirror_submit(&ms->replicas[i], &jobs[i]);
+		}
+	}
+	if (first >= 0) {
+		jobs[first].result = mirror_replica_write(&ms->replicas[first], offset, blocks, n);
+	}
+	pthread_mutex_lock(&mw.lock);
+	while (mw.pending > 0) {
+		pthread_cond_wait(&mw.cond, &mw.lock);
+	}
+	pthread_mutex_unlock(&mw.lock);
+	pthread_cond_destroy(&mw.cond);
+	pthread_mutex_destroy(&mw.lock);
+
+	int result = -1;
+	for (i = 0; i < ms->n; i++) {
+		struct mirror_replica *mr = &ms->replicas[i];
+		if (jobs[i].result == 0) {
+			result = 0;
+		}
+		else {
+			__atomic_add_fetch(&mr->nmissed, n, __ATOMIC_RELAXED);
+			mirror_mark(ms, mr, offset, n);
+		}
+	}
+	free(jobs);
+	pthread_rwlock_unlock(&ms->resync);
+	return result;
+}
+
+static int mirrordisk_write(block_store_t *this_bs, block_no offset, block_t *block){
+	return mirrordisk_writev(this_bs, offset, &block, 1);
+}
+
+/*************************************************************************
+ * Resync
+ ************************************************************************/
+
+/* Copy one dirty region of replica 'to' from a replica on which it is
+ * clean.  Returns 0 if the region is clean now, or -1 if it could not be
+ * copied.
+ */
+static int mirror_resync_region(struct mirrordisk_state *ms, unsigned int to, unsigned int region){
+	struct mirror_replica *dst = &ms->replicas[to];
+	block_no offset = region * MIRROR_REGION_BLOCKS;
+	unsigned int i, n = MIRROR_REGION_BLOCKS;
+	int result = -1;
+
+	if (n > ms->nblocks - offset) {
+		n = ms->nblocks - offset;
+	}
+	block_t *buf = malloc((size_t) n * BLOCK_SIZE);
+	block_t *blocks[MIRROR_REGION_BLOCKS];
+	for (i = 0; i < n; i++) {
+		blocks[i] = &buf[i];
+	}
+
+	pthread_rwlock_wrlock(&ms->resync);
+	for (i = 0; i < ms->n && result < 0; i++) {
+		struct mirror_replica *src = &ms->replicas[i];
+		pthread_mutex_lock(&ms->dlock);
+		int ok = i != to && src->online && !mirror_is_dirty(src, region);
+		pthread_mutex_unlock(&ms->dlock);
+		if (!ok) {
+			continue;
+		}
+		pthread_mutex_lock(&src->lock);
+		int r = block_store_readv(src->bs, offset, blocks, n);
+		pthread_mutex_unlock(&src->lock);
+		if (r < 0) {
+			continue;
+		}
+		pthread_mutex_lock(&dst->lock);
+		r = block_store_writev(dst->bs, offset, blocks, n);
+		pthread_mutex_unlock(&dst->lock);
+		if (r < 0) {
+			break;
+		}
+		pthread_mutex_lock(&ms->dlock);
+		mirror_clear_dirty(dst, region);
+		pthread_mutex_unlock(&ms->dlock);
+		dst->nresynced++;
+		result = 0;
+	}
+	pthread_rwlock_unlock(&ms->resync);
+	free(buf);
+	return result;
+}
+
+/* See if some other online replica has a clean copy of a region of
+ * replica 'to'.  Called with dlock held.
+ */
+static int mirror_has_source(struct mirrordisk_state *ms, unsigned int to, unsigned int region){
+	unsigned int i;
+
+	for (i = 0; i < ms->n; i++) {
+		if (i != to && ms->replicas[i].online && !mirror_is_dirty(&ms->replicas[i], region)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Find a dirty region of an online replica that can be copied from
+ * another one, going around all regions of all replicas starting after
+ * the one found last.  Called with dlock held.  Returns 0 if there is none.
+ */
+static int mirror_find_dirty(struct mirrordisk_state *ms, unsigned int *to, unsigned int *region){
+	unsigned int i, j, r;
+
+	/* The replica where the previous search ended is visited twice:
+	 * from where it ended, and once around, up to there.
+	 */
+	for (j = 0; j <= ms->n; j++) {
+		i = (ms->next_to + j) % ms->n;
+		struct mirror_replica *mr = &ms->replicas[i];
+		if (!mr->online || mr->ndirty == 0) {
+			continue;
+		}
+		unsigned int from = j == 0 ? ms->next_region : 0;
+		unsigned int upto = j == ms->n ? ms->next_region : ms->nregions;
+		for (r = from; r < upto; r++) {
+			uint64_t word = mr->dirty[r / 64] >> (r % 64);
+			if (word == 0) {
+				r |= 63;				// skip the rest of the word
+				continue;
+			}
+			r += __builtin_ctzll(word);
+			if (r < upto && mirror_has_source(ms, i, r)) {
+				*to = ms->next_to = i;
+				*region = r;
+				ms->next_region = r + 1;
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static void *mirror_resyncer(void *arg){
+	struct mirrordisk_state *ms = arg;
+	unsigned int to, region;
+
+	pthread_mutex_lock(&ms->dlock);
+	while (!ms->stop) {
+		if (!mirror_find_dirty(ms, &to, &region)) {
+			pthread_cond_wait(&ms->wake, &ms->dlock);
+			continue;
+		}
+		pthread_mutex_unlock(&ms->dlock);
+		int result = mirror_resync_region(ms, to, region);
+		pthread_mutex_lock(&ms->dlock);
+
+		/* If the copy failed, wait a while (or until woken up).
+		 */
+		if (result < 0 && !ms->stop) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += MIRROR_RESYNC_PAUSE_MS * 1000000L;
+			ts.tv_sec += ts.tv_nsec / 1000000000L;
+			ts.tv_nsec %= 1000000000L;
+			pthread_cond_timedwait(&ms->wake, &ms->dlock, &ts);
+		}
+	}
+	pthread_mutex_unlock(&ms->dlock);
+	return 0;
+}
+
+int mirrordisk_set_online(block_store_t *this_bs, unsigned int replica, int online){
+	struct mirrordisk_state *ms = this_bs->state;
+	unsigned int i, nonline = 0;
+
+	if (replica >= ms->n) {
+		fprintf(stderr, "mirrordisk_set_online: no replica %u\n", replica);
+		return -1;
+	}
+
+	/* Wait for writes in progress, so that they either reach the replica
+	 * or mark it dirty.
+	 */
+	pthread_rwlock_wrlock(&ms->resync);
+	pthread_mutex_lock(&ms->dlock);
+	for (i = 0; i < ms->n; i++) {
+		nonline += i != replica && ms->replicas[i].online;
+	}
+	if (!online && nonline == 0) {
+		pthread_mutex_unlock(&ms->dlock);
+		pthread_rwlock_unlock(&ms->resync);
+		fprintf(stderr, "mirrordisk_set_online: replica %u is the last one online\n", replica);
+		return -1;
+	}
+	ms->replicas[replica].online = online;
+	if (online) {
+		pthread_cond_signal(&ms->wake);
+	}
+	pthread_mutex_unlock(&ms->dlock);
+	pthread_rwlock_unlock(&ms->resync);
+	return 0;
+}
+
+/*************************************************************************
+ * The rest
+ ************************************************************************/
+
+static int mirrordisk_setsize(block_store_t *this_bs, block_no nblocks){
+	struct mirrordisk_state *ms = this_bs->state;
+	unsigned int i;
+
+	pthread_rwlock_wrlock(&ms->resync);
+
+	/* Resize the dirty bitmaps.  Regions that are cut off are clean.
+	 */
+	pthread_mutex_lock(&ms->dlock);
+	unsigned int nregions = (nblocks + MIRROR_REGION_BLOCKS - 1) / MIRROR_REGION_BLOCKS;
+	for (i = 0; i < ms->n; i++) {
+		struct mirror_replica *mr = &ms->replicas[i];
+		unsigned int r;
+		for (r = nregions; r < ms->nregions; r++) {
+			mirror_clear_dirty(mr, r);
+		}
+		mr->dirty = realloc(mr->dirty, (mirror_words(nregions) + 1) * sizeof(uint64_t));
+		if (mirror_words(nregions) > mirror_words(ms->nregions)) {
+			memset(&mr->dirty[mirror_words(ms->nregions)], 0,
+				(mirror_words(nregions) - mirror_words(ms->nregions)) * sizeof(uint64_t));
+		}
+	}
+	ms->nregions = nregions;
+	int before = ms->nblocks;
+	ms->nblocks = nblocks;
+	pthread_mutex_unlock(&ms->dlock);
+
+	/* A replica that could not be resized needs all of it resynced.
+	 */
+	for (i = 0; i < ms->n; i++) {
+		struct mirror_replica *mr = &ms->replicas[i];
+		pthread_mutex_lock(&mr->lock);
+		int result = (*mr->bs->setsize)(mr->bs, nblocks);
+		pthread_mutex_unlock(&mr->lock);
+		if (result < 0 && nblocks > 0) {
+			mirror_mark(ms, mr, 0, nblocks);
+		}
+	}
+	pthread_rwlock_unlock(&ms->resync);
+	return before;
+}
+
+static void mirrordisk_stats(block_store_t *this_bs, block_stat_t emit, void *arg){
+	struct mirrordisk_state *ms = this_bs->state;
+	char name[64];
+	unsigned int i;
+
+	for (i = 0; i < ms->n; i++) {
+		struct mirror_replica *mr = &ms->replicas[i];
+		snprintf(name, sizeof(name), "replica%u_nread", i);
+		(*emit)(arg, name, BLOCK_STAT_COUNTER, mr->nread);
+		snprintf(name, sizeof(name), "replica%u_nwrite", i);
+		(*emit)(arg, name, BLOCK_STAT_COUNTER, mr->nwrite);
+		snprintf(name, sizeof(name), "replica%u_missed", i);
+		(*emit)(arg, name, BLOCK_STAT_COUNTER, mr->nmissed);
+		snprintf(name, sizeof(name), "replica%u_resynced", i);
+		(*emit)(arg, name, BLOCK_STAT_COUNTER, mr->nresynced);
+		snprintf(name, sizeof(name), "replica%u_dirty", i);
+		(*emit)(arg, name, BLOCK_STAT_GAUGE, mr->ndirty);
+		snprintf(name, sizeof(name), "replica%u_lat_ns", i);
+		(*emit)(arg, name, BLOCK_STAT_GAUGE, mr->lat_ns);
+	}
+	(*emit)(arg, "nblocks", BLOCK_STAT_GAUGE, ms->nblocks);
+}
+
+void mirrordisk_dump_stats(block_store_t *this_bs){
+	struct mirrordisk_state *ms = this_bs->state;
+	unsigned long total = 0;
+	unsigned int i;
+
+	for (i = 0; i < ms->n; i++) {
+		total += ms->replicas[i].nread;
+	}
+	for (i = 0; i < ms->n; i++) {
+		struct mirror_replica *mr = &ms->replicas[i];
+		printf("!$MIRROR: replica %u: %lu reads (%.1f%%), %lu writes, %lu missed, "
+					"%lu regions resynced, %u dirty%s\n", i, mr->nread,
+					total == 0 ? 0 : 100.0 * mr->nread / total, mr->nwrite,
+					mr->nmissed, mr->nresynced, mr->ndirty,
+					mr->online ? "" : " (offline)");
+	}
+}
+
+static void mirrordisk_destroy(block_store_t *this_bs){
+	struct mirrordisk_state *ms = this_bs->state;
+	unsigned int i;
+
+	pthread_mutex_lock(&ms->dlock);
+	ms->stop = 1;
+	pthread_cond_signal(&ms->wake);
+	pthread_mutex_unlock(&ms->dlock);
+	pthread_join(ms->resyncer, 0);
+
+	for (i = 0; i < ms->n; i++) {
+		struct mirror_replica *mr = &ms->replicas[i];
+		pthread_mutex_lock(&mr->qlock);
+		mr->stop = 1;
+		pthread_cond_signal(&mr->qcond);
+		pthread_mutex_unlock(&mr->qlock);
+		pthread_join(mr->worker, 0);
+		pthread_cond_destroy(&mr->qcond);
+		pthread_mutex_destroy(&mr->qlock);
+		pthread_mutex_destroy(&mr->lock);
+		free(mr->dirty);
+	}
+	pthread_cond_destroy(&ms->wake);
+	pthread_rwlock_destroy(&ms->resync);
+	pthread_mutex_destroy(&ms->dlock);
+	free(ms->replicas);
+	free(ms);
+	free(this_bs);
+}
+
+block_store_t *mirrordisk_init(block_store_t **stores, unsigned int n){
+	if (n == 0 || n > 64) {
+		fprintf(stderr, "mirrordisk_init: need 1 to 64 replicas\n");
+		return 0;
+	}
+
+	/* Create the block store state structure.  The size is limited by the
+	 * smallest replica.
+	 */
+	struct mirrordisk_state *ms = calloc(1, sizeof(*ms));
+	ms->n = n;
+	ms->replicas = calloc(n, sizeof(*ms->replicas));
+	ms->nblocks = (block_no) -1;
+	unsigned int i;
+	for (i = 0; i < n; i++) {
+		block_no size = (*stores[i]->nblocks)(stores[i]);
+		if (size < ms->nblocks) {
+			ms->nblocks = size;
+		}
+	}
+	ms->nregions = (ms->nblocks + MIRROR_REGION_BLOCKS - 1) / MIRROR_REGION_BLOCKS;
+	pthread_mutex_init(&ms->dlock, 0);
+	pthread_rwlock_init(&ms->resync, 0);
+	pthread_cond_init(&ms->wake, 0);
+	for (i = 0; i < n; i++) {
+		struct mirror_replica *mr = &ms->replicas[i];
+		mr->bs = stores[i];
+		mr->online = 1;
+		mr->lat_ns = MIRROR_LAT_INIT;
+		mr->dirty = calloc(mirror_words(ms->nregions) + 1, sizeof(uint64_t));
+		pthread_mutex_init(&mr->lock, 0);
+		pthread_mutex_init(&mr->qlock, 0);
+		pthread_cond_init(&mr->qcond, 0);
+		mr->tail = &mr->jobs;
+		pthread_create(&mr->worker, 0, mirror_worker, mr);
+	}
+	pthread_create(&ms->resyncer, 0, mirror_resyncer, ms);
+
+	block_store_t *this_bs = calloc(1, sizeof(*this_bs));
+	this_bs->state = ms;
+	this_bs->nblocks = mirrordisk_nblocks;
+	this_bs->setsize = mirrordisk_setsize;
+	this_bs->read = mirrordisk_read;
+	this_bs->write = mirrordisk_write;
+	this_bs->destroy = mirrordisk_destroy;
+	this_bs->readv = mirrordisk_readv;
+	this_bs->writev = mirrordisk_writev;
+	this_bs->name = "mirrordisk";
+	this_bs->below = stores[0];
+	this_bs->stats = mirrordisk_stats;
+	return this_bs;
+}
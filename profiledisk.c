@@ -0,0 +1,308 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* This block store module forwards its method calls to an underlying
+ * block store, but profiles where the reads and writes go:
+ *
+ *		block_store_t *profiledisk_init(block_store_t *below);
+ *			'below' is the underlying block store.
+ *
+ *		int profiledisk_write_csv(block_store_t *this_bs, char *file);
+ *			Writes "offset,reads,writes,last" for every block that was
+ *			accessed to the given file.  Returns 0, or -1 upon error.
+ *
+ * It keeps a read and a write count per block (in chunks of PROF_CHUNK
+ * blocks that are only allocated once one of their blocks is accessed,
+ * so huge block stores cost little), the lengths of sequential runs
+ * (accesses to consecutive offsets), and the re-reference interval of
+ * each access (the number of accesses since the previous access to the
+ * same block).  Upon destroy it prints a report: the read/write mix, the
+ * hottest blocks, and log2 histograms of run lengths and re-reference
+ * intervals.  Placed right under a cachedisk, it shows which blocks the
+ * cache should keep (under a treedisk, block 0 is the superblock and the
+ * next few blocks hold the inodes).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "block_store.h"
+
+#define PROF_CHUNK		4096			// # blocks per chunk of counters
+#define PROF_TOP		10				// # hottest blocks reported
+#define PROF_LOG		33				// # log2 buckets
+
+struct profile_entry {
+	uint32_t reads, writes;
+	uint64_t last;						// access number of last access, or 0
+};
+
+struct profiledisk_state {
+	block_store_t *below;				// block store below
+
+	struct profile_entry **chunks;		// indexed by offset / PROF_CHUNK
+	unsigned int nchunks;
+
+	uint64_t naccess;					// # reads and writes so far
+	uint64_t nread, nwrite;
+	uint64_t nblocks_used;				// # distinct blocks accessed
+
+	/* Sequential runs.  'run' is the length of the current one.
+	 */
+	block_no next_offset;				// offset that continues the run
+	uint64_t run;
+	uint64_t nseq;						// # accesses that continued a run
+	uint64_t run_hist[PROF_LOG];		// run lengths
+	uint64_t reref_hist[PROF_LOG];		// re-reference intervals
+
+	pthread_mutex_t lock;
+};
+
+static unsigned int prof_log2(uint64_t x){
+	return x == 0 ? 0 : 64 - __builtin_clzll(x);
+}
+
+/* Find the counters for the given offset, allocating them if needed.
+ */
+static struct profile_entry *profiledisk_entry(struct profiledisk_state *ps, block_no offset){
+	unsigned int c = offset / PROF_CHUNK;
+
+	if (c >= ps->nchunks) {
+		unsigned int n = ps->nchunks == 0 ? 16 : ps->nchunks;
+		while (n <= c) {
+			n *= 2;
+		}
+		ps->chunks = realloc(ps->chunks, n * sizeof(*ps->chunks));
+		memset(&ps->chunks[ps->nchunks], 0, (n - ps->nchunks) * sizeof(*ps->chunks));
+		ps->nchunks = n;
+	}
+	if (ps->chunks[c] == 0) {
+		ps->chunks[c] = calloc(PROF_CHUNK, sizeof(struct profile_entry));
+	}
+	return &ps->chunks[c][offset % PROF_CHUNK];
+}
+
+static void profiledisk_end_run(struct profiledisk_state *ps){
+	if (ps->run > 0) {
+		ps->run_hist[prof_log2(ps->run)]++;
+	}
+}
+
+static void profiledisk_record(struct profiledisk_state *ps, block_no offset, int is_write){
+	pthread_mutex_lock(&ps->lock);
+	struct profile_entry *pe = profiledisk_entry(ps, offset);
+
+	ps->naccess++;
+	if (is_write) {
+		ps->nwrite++;
+		pe->writes++;
+	}
+	else {
+		ps->nread++;
+		pe->reads++;
+	}
+
+	if (pe->last == 0) {
+		ps->nblocks_used++;
+	}
+	else {
+		ps->reref_hist[prof_log2(ps->naccess - pe->last)]++;
+	}
+	pe->last = ps->naccess;
+
+	if (ps->run > 0 && offset == ps->next_offset) {
+		ps->nseq++;
+		ps->run++;
+	}
+	else {
+		profiledisk_end_run(ps);
+		ps->run = 1;
+	}
+	ps->next_offset = offset + 1;
+	pthread_mutex_unlock(&ps->lock);
+}
+
+static int profiledisk_nblocks(block_store_t *this_bs){
+	struct profiledisk_state *ps = this_bs->state;
+
+	return (*ps->below->nblocks)(ps->below);
+}
+
+static int profiledisk_setsize(block_store_t *this_bs, block_no nblocks){
+	struct profiledisk_state *ps = this_bs->state;
+
+	return (*ps->below->setsize)(ps->below, nblocks);
+}
+
+static int profiledisk_read(block_store_t *this_bs, block_no offset, block_t *block){
+	struct profiledisk_state *ps = this_bs->state;
+
+	profiledisk_record(ps, offset, 0);
+	return (*ps->below->read)(ps->below, offset, block);
+}
+
+static int profiledisk_write(block_store_t *this_bs, block_no offset, block_t *block){
+	struct profiledisk_state *ps = this_bs->state;
+
+	profiledisk_record(ps, offset, 1);
+	return (*ps->below->write)(ps->below, offset, block);
+}
+
+/* Asynchronous operations are profiled in the order they are issued.
+ */
+static int profiledisk_read_async(block_store_t *this_bs, block_no offset, block_t *block,
+											block_done_t done, void *arg){
+	struct profiledisk_state *ps = this_bs->state;
+
+	profiledisk_record(ps, offset, 0);
+	return block_store_read_async(ps->below, offset, block, done, arg);
+}
+
+static int profiledisk_write_async(block_store_t *this_bs, block_no offset, block_t *block,
+											block_done_t done, void *arg){
+	struct profiledisk_state *ps = this_bs->state;
+
+	profiledisk_record(ps, offset, 1);
+	return block_store_write_async(ps->below, offset, block, done, arg);
+}
+
+static int profiledisk_poll(block_store_t *this_bs, int wait){
+	struct profiledisk_state *ps = this_bs->state;
+
+	return block_store_poll(ps->below, wait);
+}
+
+int profiledisk_write_csv(block_store_t *this_bs, char *file){
+	struct profiledisk_state *ps = this_bs->state;
+	FILE *fp;
+	unsigned int c, i;
+
+	if ((fp = fopen(file, "w")) == 0) {
+		perror(file);
+		return -1;
+	}
+	fprintf(fp, "offset,reads,writes,last\n");
+	pthread_mutex_lock(&ps->lock);
+	for (c = 0; c < ps->nchunks; c++) {
+		if (ps->chunks[c] == 0) {
+			continue;
+		}
+		for (i = 0; i < PROF_CHUNK; i++) {
+			struct profile_entry *pe = &ps->chunks[c][i];
+			if (pe->last != 0) {
+				fprintf(fp, "%u,%u,%u,%llu\n", c * PROF_CHUNK + i,
+						pe->reads, pe->writes, (unsigned long long) pe->last);
+			}
+		}
+	}
+	pthread_mutex_unlock(&ps->lock);
+	fclose(fp);
+	return 0;
+}
+
+static void profiledisk_print_hist(char *what, uint64_t *hist){
+	unsigned int i;
+
+	for (i = 0; i < PROF_LOG; i++) {
+		if (hist[i] != 0) {
+			printf("!$PROF: %s < 2^%-2u %llu\n", what, i, (unsigned long long) hist[i]);
+		}
+	}
+}
+
+static void profiledisk_report(struct profiledisk_state *ps){
+	block_no top[PROF_TOP];
+	uint64_t top_count[PROF_TOP];
+	unsigned int ntop = 0, c, i, j;
+
+	/* Find the hottest blocks by insertion into a small sorted array.
+	 */
+	for (c = 0; c < ps->nchunks; c++) {
+		if (ps->chunks[c] == 0) {
+			continue;
+		}
+		for (i = 0; i < PROF_CHUNK; i++) {
+			struct profile_entry *pe = &ps->chunks[c][i];
+			uint64_t count = (uint64_t) pe->reads + pe->writes;
+			if (count == 0 || (ntop == PROF_TOP && count <= top_count[ntop - 1])) {
+				continue;
+			}
+			for (j = ntop < PROF_TOP ? ntop++ : PROF_TOP - 1; j > 0 && top_count[j - 1] < count; j--) {
+				top[j] = top[j - 1];
+				top_count[j] = top_count[j - 1];
+			}
+			top[j] = c * PROF_CHUNK + i;
+			top_count[j] = count;
+		}
+	}
+
+	printf("!$PROF: #reads:     %llu\n", (unsigned long long) ps->nread);
+	printf("!$PROF: #writes:    %llu\n", (unsigned long long) ps->nwrite);
+	printf("!$PROF: read frac:  %.3f\n", ps->naccess == 0 ? 0 : (double) ps->nread / ps->naccess);
+	printf("!$PROF: #blocks:    %llu\n", (unsigned long long) ps->nblocks_used);
+	printf("!$PROF: seq frac:   %.3f\n", ps->naccess == 0 ? 0 : (double) ps->nseq / ps->naccess);
+	for (i = 0; i < ntop; i++) {
+		struct profile_entry *pe = profiledisk_entry(ps, top[i]);
+		printf("!$PROF: hot block %u: %u reads %u writes (%.1f%%)\n", top[i],
+				pe->reads, pe->writes, 100.0 * top_count[i] / ps->naccess);
+	}
+	profiledisk_print_hist("run length", ps->run_hist);
+	profiledisk_print_hist("reref dist", ps->reref_hist);
+}
+
+static void profiledisk_stats(block_store_t *this_bs, block_stat_t emit, void *arg){
+	struct profiledisk_state *ps = this_bs->state;
+
+	pthread_mutex_lock(&ps->lock);
+	(*emit)(arg, "nread", BLOCK_STAT_COUNTER, ps->nread);
+	(*emit)(arg, "nwrite", BLOCK_STAT_COUNTER, ps->nwrite);
+	(*emit)(arg, "nseq", BLOCK_STAT_COUNTER, ps->nseq);
+	(*emit)(arg, "blocks_used", BLOCK_STAT_GAUGE, ps->nblocks_used);
+	pthread_mutex_unlock(&ps->lock);
+}
+
+static void profiledisk_destroy(block_store_t *this_bs){
+	struct profiledisk_state *ps = this_bs->state;
+	unsigned int c;
+
+	profiledisk_end_run(ps);
+	ps->run = 0;
+	profiledisk_report(ps);
+
+	for (c = 0; c < ps->nchunks; c++) {
+		free(ps->chunks[c]);
+	}
+	free(ps->chunks);
+	pthread_mutex_destroy(&ps->lock);
+	free(ps);
+	free(this_bs);
+}
+
+block_store_t *profiledisk_init(block_store_t *below){
+	/* Create the block store state structure.
+	 */
+	struct profiledisk_state *ps = calloc(1, sizeof(*ps));
+	ps->below = below;
+	pthread_mutex_init(&ps->lock, 0);
+
+	/* Return a block interface to this inode.
+	 */
+	block_store_t *this_bs = calloc(1, sizeof(*this_bs));
+	this_bs->state = ps;
+	this_bs->nblocks = profiledisk_nblocks;
+	this_bs->setsize = profiledisk_setsize;
+	this_bs->read = profiledisk_read;
+	this_bs->write = profiledisk_write;
+	this_bs->destroy = profiledisk_destroy;
+	this_bs->read_async = profiledisk_read_async;
+	this_bs->write_async = profiledisk_write_async;
+	this_bs->poll = profiledisk_poll;
+	this_bs->name = "profiledisk";
+	this_bs->below = below;
+	this_bs->stats = profiledisk_stats;
+	return this_bs;
+}
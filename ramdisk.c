@@ -11,17 +11,28 @@
  *		block_store_t *ramdisk_init(block_t *blocks, block_no nblocks)
  *			Create a new block store, stored in the array of blocks
  *			pointed to by 'blocks', which has nblocks blocks in it.
+ *
+ *		block_store_t *ramdisk_init_sparse(block_no nblocks)
+ *			Create a new block store of nblocks blocks in memory that the
+ *			ramdisk allocates itself.  The memory is reserved lazily, so
+ *			blocks that have never been written take up no space, and
+ *			blocks cut off by setsize are given back.  This makes it
+ *			possible to model very large disks.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "block_store.h"
 
 struct ramdisk_state {
 	block_t *blocks;
 	block_no nblocks;
 	int fd;
+	size_t mapped;			// size of own mapping (sparse only), else 0
+	unsigned long nread, nwrite;		// stats
 };
 
 static int ramdisk_nblocks(block_store_t *this_bs){
@@ -34,6 +45,24 @@ static int ramdisk_setsize(block_store_t *this_bs, block_no nblocks){
 	struct ramdisk_state *rs = this_bs->state;
 
 	int before = rs->nblocks;
+	if (rs->mapped != 0) {
+		if ((size_t) nblocks * BLOCK_SIZE > rs->mapped) {
+			fprintf(stderr, "ramdisk_setsize: %u blocks too large\n", nblocks);
+			return -1;
+		}
+
+		/* Give back whole pages past the new end.  They read back as
+		 * zeroes should the ramdisk grow again.
+		 */
+		if (nblocks < rs->nblocks) {
+			size_t pagesize = sysconf(_SC_PAGESIZE);
+			size_t start = ((size_t) nblocks * BLOCK_SIZE + pagesize - 1) & ~(pagesize - 1);
+			size_t end = (size_t) rs->nblocks * BLOCK_SIZE;
+			if (end > start) {
+				madvise((char *) rs->blocks + start, end - start, MADV_DONTNEED);
+			}
+		}
+	}
 	rs->nblocks = nblocks;
 	return before;
 }
@@ -46,6 +75,7 @@ static int ramdisk_read(block_store_t *this_bs, block_no offset, block_t *block)
 		return -1;
 	}
 	memcpy(block, &rs->blocks[offset], BLOCK_SIZE);
+	__atomic_add_fetch(&rs->nread, 1, __ATOMIC_RELAXED);
 	return 0;
 }
 
@@ -57,11 +87,25 @@ static int ramdisk_write(block_store_t *this_bs, block_no offset, block_t *block
 		return -1;
 	}
 	memcpy(&rs->blocks[offset], block, BLOCK_SIZE);
+	__atomic_add_fetch(&rs->nwrite, 1, __ATOMIC_RELAXED);
 	return 0;
 }
 
+static void ramdisk_stats(block_store_t *this_bs, block_stat_t emit, void *arg){
+	struct ramdisk_state *rs = this_bs->state;
+
+	(*emit)(arg, "nread", BLOCK_STAT_COUNTER, rs->nread);
+	(*emit)(arg, "nwrite", BLOCK_STAT_COUNTER, rs->nwrite);
+	(*emit)(arg, "nblocks", BLOCK_STAT_GAUGE, rs->nblocks);
+}
+
 static void ramdisk_destroy(block_store_t *this_bs){
-	free(this_bs->state);
+	struct ramdisk_state *rs = this_bs->state;
+
+	if (rs->mapped != 0) {
+		munmap(rs->blocks, rs->mapped);
+	}
+	free(rs);
 	free(this_bs);
 }
 
@@ -78,5 +122,28 @@ block_store_t *ramdisk_init(block_t *blocks, block_no nblocks){
 	this_bs->read = ramdisk_read;
 	this_bs->write = ramdisk_write;
 	this_bs->destroy = ramdisk_destroy;
+	this_bs->name = "ramdisk";
+	this_bs->stats = ramdisk_stats;
+	return this_bs;
+}
+
+block_store_t *ramdisk_init_sparse(block_no nblocks){
+	/* Reserve address space only.  Pages get allocated on first write
+	 * (reads of untouched pages map the shared zero page).
+	 */
+	size_t size = (size_t) (nblocks == 0 ? 1 : nblocks) * BLOCK_SIZE;
+	void *blocks = mmap(0, size, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (blocks == MAP_FAILED) {
+		perror("ramdisk_init_sparse");
+		return 0;
+	}
+#ifdef MADV_HUGEPAGE
+	madvise(blocks, size, MADV_HUGEPAGE);		// only a hint
+#endif
+
+	block_store_t *this_bs = ramdisk_init(blocks, nblocks);
+	struct ramdisk_state *rs = this_bs->state;
+	rs->mapped = size;
 	return this_bs;
 }
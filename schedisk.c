@@ -0,0 +1,522 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* An I/O scheduler.  This block store module queues requests and sends
+ * them to the underlying block store in batches, sorted by offset and
+ * with runs of consecutive blocks merged into single vectored operations:
+ *
+ *		block_store_t *schedisk_init(block_store_t *below, unsigned int depth)
+ *			'below' is the underlying block store, and 'depth' the
+ *			maximum number of queued requests.
+ *
+ *		void schedisk_dump_stats(block_store_t *this_bs)
+ *			Prints the number of requests, batches, and merged runs.
+ *
+ * Asynchronous reads and writes are queued, and so are synchronous
+ * writes: these are deferred, with the schedisk keeping a copy of the
+ * block.  A synchronous read is served from the latest queued write of the
+ * same block if there is one, and otherwise from the layer below right
+ * away.
+ *
+ * A batch is dispatched when the queue is full, when poll is called with
+ * 'wait' set, or when the oldest queued request has been waiting for more
+ * than SCHED_DEADLINE_NS, so that no request is put off for long.  The
+ * deadline is checked upon each request and poll, and by a thread of the
+ * schedisk that sleeps until it expires, so that deferred writes also get
+ * below when no more requests come.  The completions of asynchronous
+ * requests in a batch dispatched by that thread are kept until the next
+ * poll, so that they are still only invoked from the methods.  A batch is carried out as one sweep of an
+ * elevator: in order of offset, starting at the offset where the previous
+ * batch ended and wrapping around.  Requests for the same block keep the
+ * order in which they were made.  Consecutive reads or writes of adjacent
+ * blocks are merged into one readv or writev of up to SCHED_MAX_RUN blocks
+ * (see block_store.h), which a disk does with a single system call.  The
+ * merge ratio is the number of requests per operation on the layer below.
+ *
+ * Deferred writes are only on the layer below after the next batch, so to
+ * get everything there right away (for example, before checking the layer
+ * below directly), poll the schedisk with 'wait' set.  A deferred write that
+ * fails can only be reported on standard error.
+ *
+ * A single lock protects the queue and all I/O on the layer below (the
+ * batches as well as the synchronous reads that are not forwarded), so a
+ * schedisk may be used by several threads at once even if the layer below
+ * may not, and its flushing thread never races with the caller on that
+ * layer.  Completions are invoked without holding the lock, so they may
+ * queue new requests.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "block_store.h"
+
+#define SCHED_MAX_RUN		128					// max # blocks per merged operation
+#define SCHED_DEADLINE_NS	(1000 * 1000)		// max wait in queue (1 ms)
+
+/* A queued request.
+ */
+struct sched_request {
+	int is_read;
+	block_no offset;
+	block_t *block;
+	int deferred;				// synchronous write: 'block' is our copy
+	block_done_t done;
+	void *arg;
+	unsigned long seq;			// order of arrival
+	uint64_t queued;			// time of arrival
+	int result;
+};
+
+struct schedisk_state {
+	block_store_t *below;		// block store below
+	unsigned int depth;			// size of the queue
+	pthread_mutex_t lock;
+
+	struct sched_request *queue;	// in order of arrival
+	unsigned int nqueued;
+	unsigned long seq;			// sequence number of the next request
+	block_no head;				// where the previous batch ended
+
+	struct sched_request *finished;	// done by the flusher, for the next poll
+	unsigned int nfinished;
+
+	pthread_t flusher;			// dispatches at the deadline
+	pthread_cond_t wakeup;		// signals the flusher
+	int stopping;
+
+	unsigned long nread, nwrite;	// # requests
+	unsigned long ndeferred;		// # synchronous writes queued
+	unsigned long nforwarded;		// # synchronous reads served from the queue
+	unsigned long nbatches;			// # batches dispatched
+	unsigned long nbatched;			// # requests in these batches
+	unsigned long nruns;			// # operations on the layer below
+	unsigned long ndeadline;		// # batches dispatched for the deadline
+	unsigned long nerrors;			// # deferred writes that failed
+};
+
+static uint64_t schedisk_now(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int schedisk_nblocks(block_store_t *this_bs){
+	struct schedisk_state *ss = this_bs->state;
+
+	return (*ss->below->nblocks)(ss->below);
+}
+
+/* Sort by offset, keeping the order of arrival for equal offsets.
+ */
+static int sched_request_cmp(const void *a, const void *b){
+	const struct sched_request *x = a, *y = b;
+
+	if (x->offset != y->offset) {
+		return x->offset < y->offset ? -1 : 1;
+	}
+	return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+/* Carry out the run of n requests, all reads or all writes of consecutive
+ * blocks, as one operation below.
+ */
+static void schedisk_run(struct schedisk_state *ss, struct sched_request *run, unsigned int n){
+	block_t *blocks[SCHED_MAX_RUN];
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		blocks[i] = run[i].block;
+	}
+	int result = run[0].is_read ?
+				block_store_readv(ss->below, run[0].offset, blocks, n) :
+				block_store_writev(ss->below, run[0].offset, blocks, n);
+	for (i = 0; i < n; i++) {
+		run[i].result = result;
+	}
+	ss->nruns++;
+}
+
+/* Take all queued requests and carry them out as one batch.  Called with
+ * the lock held.  Returns the batch, to be completed by schedisk_complete
+ * after the lock is released.
+ */
+static struct sched_request *schedisk_issue(struct schedisk_state *ss, unsigned int *pn){
+	unsigned int n = ss->nqueued;
+	struct sched_request *batch = ss->queue;
+
+	ss->queue = malloc(ss->depth * sizeof(*ss->queue));
+	ss->nqueued = 0;
+	ss->nbatches++;
+	ss->nbatched += n;
+	qsort(batch, n, sizeof(*batch), sched_request_cmp);
+
+	/* Rotate the batch so that the sweep continues where the previous
+	 * one ended.
+	 */
+	unsigned int start = 0;
+	while (start < n && batch[start].offset < ss->head) {
+		start++;
+	}
+	if (start > 0 && start < n) {
+		struct sched_request *tmp = malloc(start * sizeof(*tmp));
+		memcpy(tmp, batch, start * sizeof(*tmp));
+		memmove(batch, &batch[start], (n - start) * sizeof(*batch));
+		memcpy(&batch[n - start], tmp, start * sizeof(*tmp));
+		free(tmp);
+	}
+
+	unsigned int i = 0;
+	while (i < n) {
+		unsigned int len = 1;
+		while (i + len < n && len < SCHED_MAX_RUN &&
+					batch[i + len].is_read == batch[i].is_read &&
+					batch[i + len].offset == batch[i].offset + len) {
+			len++;
+		}
+		schedisk_run(ss, &batch[i], len);
+		i += len;
+	}
+	ss->head = batch[n - 1].offset + 1;
+	*pn = n;
+	return batch;
+}
+
+static void schedisk_complete(struct schedisk_state *ss, struct sched_request *batch, unsigned int n){
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		struct sched_request *sr = &batch[i];
+		if (sr->deferred) {
+			if (sr->result < 0) {
+				fprintf(stderr, "schedisk: deferred write of block %u failed\n", sr->offset);
+				__atomic_add_fetch(&ss->nerrors, 1, __ATOMIC_RELAXED);
+			}
+			free(sr->block);
+		}
+		else {
+			(*sr->done)(sr->arg, sr->result);
+		}
+	}
+	free(batch);
+}
+
+/* Complete the batch of the flusher thread, except for the completions
+ * of asynchronous requests, which are left for the next poll.  Called with
+ * the lock held.
+ */
+static void schedisk_complete_later(struct schedisk_state *ss, struct sched_request *batch,
+										unsigned int n){
+	unsigned int i, nasync = 0;
+
+	for (i = 0; i < n; i++) {
+		if (!batch[i].deferred) {
+			nasync++;
+		}
+	}
+	if (nasync > 0) {
+		ss->finished = realloc(ss->finished, (ss->nfinished + nasync) * sizeof(*ss->finished));
+		for (i = 0; i < n; i++) {
+			if (!batch[i].deferred) {
+				ss->finished[ss->nfinished++] = batch[i];
+			}
+		}
+	}
+	for (i = 0, nasync = 0; i < n; i++) {
+		if (batch[i].deferred) {
+			batch[nasync++] = batch[i];
+		}
+	}
+	schedisk_complete(ss, batch, nasync);
+}
+
+/* Take the completions left by the flusher.  Called with the lock held;
+ * invoke them with schedisk_complete after releasing it.
+ */
+static struct sched_request *schedisk_take_finished(struct schedisk_state *ss, unsigned int *pn){
+	struct sched_request *finished = ss->finished;
+
+	*pn = ss->nfinished;
+	ss->finished = 0;
+	ss->nfinished = 0;
+	return finished;
+}
+
+/* Whether a batch is due: the queue is full or its oldest request has
+ * reached the deadline.  Called with the lock held.
+ */
+static int schedisk_due(struct schedisk_state *ss){
+	if (ss->nqueued == 0) {
+		return 0;
+	}
+	if (ss->nqueued == ss->depth) {
+		return 1;
+	}
+	if (schedisk_now() - ss->queue[0].queued > SCHED_DEADLINE_NS) {
+		ss->ndeadline++;
+		return 1;
+	}
+	return 0;
+}
+
+/* Dispatch a batch if one is due (or if 'force' is set).  Called with the
+ * lock held; releases it.
+ */
+static void schedisk_dispatch(struct schedisk_state *ss, int force){
+	struct sched_request *batch = 0;
+	unsigned int n = 0;
+
+	if (force ? ss->nqueued > 0 : schedisk_due(ss)) {
+		batch = schedisk_issue(ss, &n);
+	}
+	pthread_mutex_unlock(&ss->lock);
+	if (batch != 0) {
+		schedisk_complete(ss, batch, n);
+	}
+}
+
+static int schedisk_enqueue(block_store_t *this_bs, int is_read, block_no offset,
+				block_t *block, int deferred, block_done_t done, void *arg){
+	struct schedisk_state *ss = this_bs->state;
+
+	pthread_mutex_lock(&ss->lock);
+	struct sched_request *sr = &ss->queue[ss->nqueued++];
+	sr->is_read = is_read;
+	sr->offset = offset;
+	sr->block = block;
+	sr->deferred = deferred;
+	sr->done = done;
+	sr->arg = arg;
+	sr->seq = ss->seq++;
+	sr->queued = schedisk_now();
+	if (ss->nqueued == 1) {
+		pthread_cond_signal(&ss->wakeup);
+	}
+	if (is_read) {
+		ss->nread++;
+	}
+	else {
+		ss->nwrite++;
+	}
+	if (deferred) {
+		ss->ndeferred++;
+	}
+	schedisk_dispatch(ss, 0);
+	return 0;
+}
+
+static int schedisk_read_async(block_store_t *this_bs, block_no offset, block_t *block,
+											block_done_t done, void *arg){
+	return schedisk_enqueue(this_bs, 1, offset, block, 0, done, arg);
+}
+
+static int schedisk_write_async(block_store_t *this_bs, block_no offset, block_t *block,
+											block_done_t done, void *arg){
+	return schedisk_enqueue(this_bs, 0, offset, block, 0, done, arg);
+}
+
+static int schedisk_write(block_store_t *this_bs, block_no offset, block_t *block){
+	block_t *copy = malloc(sizeof(*copy));
+
+	memcpy(copy, block, sizeof(*copy));
+	return schedisk_enqueue(this_bs, 0, offset, copy, 1, 0, 0);
+}
+
+static int schedisk_read(block_store_t *this_bs, block_no offset, block_t *block){
+	struct schedisk_state *ss = this_bs->state;
+
+	pthread_mutex_lock(&ss->lock);
+	ss->nread++;
+	unsigned int i;
+	for (i = ss->nqueued; i > 0; i--) {
+		struct sched_request *sr = &ss->queue[i - 1];
+		if (!sr->is_read && sr->offset == offset) {
+			memcpy(block, sr->block, sizeof(*block));
+			ss->nforwarded++;
+			pthread_mutex_unlock(&ss->lock);
+			return 0;
+		}
+	}
+
+	/* Read below under the lock as well, so the read does not run into
+	 * a batch being carried out by another thread.
+	 */
+	int result = (*ss->below->read)(ss->below, offset, block);
+	pthread_mutex_unlock(&ss->lock);
+	return result;
+}
+
+static int schedisk_poll(block_store_t *this_bs, int wait){
+	struct schedisk_state *ss = this_bs->state;
+	struct sched_request *finished;
+	unsigned int n;
+
+	pthread_mutex_lock(&ss->lock);
+	finished = schedisk_take_finished(ss, &n);
+	schedisk_dispatch(ss, wait);
+	if (finished != 0) {
+		schedisk_complete(ss, finished, n);
+	}
+	return 0;
+}
+
+/* Dispatch batches until the queue stays empty, and invoke the completions
+ * left by the flusher.
+ */
+static void schedisk_drain(struct schedisk_state *ss){
+	struct sched_request *finished;
+	unsigned int n;
+
+	for (;;) {
+		pthread_mutex_lock(&ss->lock);
+		finished = schedisk_take_finished(ss, &n);
+		if (ss->nqueued == 0) {
+			pthread_mutex_unlock(&ss->lock);
+			if (finished != 0) {
+				schedisk_complete(ss, finished, n);
+			}
+			return;
+		}
+		schedisk_dispatch(ss, 1);
+		if (finished != 0) {
+			schedisk_complete(ss, finished, n);
+		}
+	}
+}
+
+/* The flusher thread: sleeps until the oldest queued request reaches the
+ * deadline, and then dispatches the queue.
+ */
+static void *schedisk_flusher(void *arg){
+	struct schedisk_state *ss = arg;
+
+	pthread_mutex_lock(&ss->lock);
+	while (!ss->stopping) {
+		if (ss->nqueued == 0) {
+			pthread_cond_wait(&ss->wakeup, &ss->lock);
+			continue;
+		}
+		uint64_t deadline = ss->queue[0].queued + SCHED_DEADLINE_NS;
+		if (schedisk_now() <= deadline) {
+			struct timespec ts;
+			ts.tv_sec = (deadline + 1) / 1000000000;
+			ts.tv_nsec = (deadline + 1) % 1000000000;
+			pthread_cond_timedwait(&ss->wakeup, &ss->lock, &ts);
+			continue;
+		}
+		if (schedisk_due(ss)) {
+			unsigned int n;
+			struct sched_request *batch = schedisk_issue(ss, &n);
+			schedisk_complete_later(ss, batch, n);
+		}
+	}
+	pthread_mutex_unlock(&ss->lock);
+	return 0;
+}
+
+static int schedisk_setsize(block_store_t *this_bs, block_no nblocks){
+	struct schedisk_state *ss = this_bs->state;
+
+	schedisk_drain(ss);
+	pthread_mutex_lock(&ss->lock);
+	int result = (*ss->below->setsize)(ss->below, nblocks);
+	pthread_mutex_unlock(&ss->lock);
+	return result;
+}
+
+static void schedisk_destroy(block_store_t *this_bs){
+	struct schedisk_state *ss = this_bs->state;
+
+	pthread_mutex_lock(&ss->lock);
+	ss->stopping = 1;
+	pthread_cond_signal(&ss->wakeup);
+	pthread_mutex_unlock(&ss->lock);
+	pthread_join(ss->flusher, 0);
+
+	schedisk_drain(ss);
+	pthread_cond_destroy(&ss->wakeup);
+	pthread_mutex_destroy(&ss->lock);
+	free(ss->queue);
+	free(ss);
+	free(this_bs);
+}
+
+static void schedisk_stats(block_store_t *this_bs, block_stat_t emit, void *arg){
+	struct schedisk_state *ss = this_bs->state;
+
+	(*emit)(arg, "nread", BLOCK_STAT_COUNTER, ss->nread);
+	(*emit)(arg, "nwrite", BLOCK_STAT_COUNTER, ss->nwrite);
+	(*emit)(arg, "deferred", BLOCK_STAT_COUNTER, ss->ndeferred);
+	(*emit)(arg, "forwarded", BLOCK_STAT_COUNTER, ss->nforwarded);
+	(*emit)(arg, "nbatches", BLOCK_STAT_COUNTER, ss->nbatches);
+	(*emit)(arg, "nruns", BLOCK_STAT_COUNTER, ss->nruns);
+	(*emit)(arg, "deadline_batches", BLOCK_STAT_COUNTER, ss->ndeadline);
+	(*emit)(arg, "errors", BLOCK_STAT_COUNTER, ss->nerrors);
+	(*emit)(arg, "merge_ratio", BLOCK_STAT_GAUGE,
+				ss->nruns == 0 ? 0 : (double) ss->nbatched / ss->nruns);
+	(*emit)(arg, "batch_mean", BLOCK_STAT_GAUGE,
+				ss->nbatches == 0 ? 0 : (double) ss->nbatched / ss->nbatches);
+	(*emit)(arg, "queued", BLOCK_STAT_GAUGE, ss->nqueued);
+	(*emit)(arg, "depth", BLOCK_STAT_GAUGE, ss->depth);
+}
+
+void schedisk_dump_stats(block_store_t *this_bs){
+	struct schedisk_state *ss = this_bs->state;
+
+	printf("!$SCHED: #reads:      %lu (%lu from the queue)\n", ss->nread, ss->nforwarded);
+	printf("!$SCHED: #writes:     %lu (%lu deferred)\n", ss->nwrite, ss->ndeferred);
+	printf("!$SCHED: #batches:    %lu (%lu for the deadline)\n", ss->nbatches, ss->ndeadline);
+	printf("!$SCHED: batch size:  %.2f\n",
+				ss->nbatches == 0 ? 0 : (double) ss->nbatched / ss->nbatches);
+	printf("!$SCHED: #runs:       %lu\n", ss->nruns);
+	printf("!$SCHED: merge ratio: %.2f\n",
+				ss->nruns == 0 ? 0 : (double) ss->nbatched / ss->nruns);
+	if (ss->nerrors != 0) {
+		printf("!$SCHED: #errors:     %lu\n", ss->nerrors);
+	}
+}
+
+block_store_t *schedisk_init(block_store_t *below, unsigned int depth){
+	if (depth == 0) {
+		fprintf(stderr, "schedisk_init: depth must be positive\n");
+		return 0;
+	}
+
+	/* Create the block store state structure.
+	 */
+	struct schedisk_state *ss = calloc(1, sizeof(*ss));
+	ss->below = below;
+	ss->depth = depth;
+	ss->queue = malloc(depth * sizeof(*ss->queue));
+	pthread_mutex_init(&ss->lock, 0);
+
+	/* The deadline is on the monotonic clock (see schedisk_now).
+	 */
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ss->wakeup, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_create(&ss->flusher, 0, schedisk_flusher, ss);
+
+	block_store_t *this_bs = calloc(1, sizeof(*this_bs));
+	this_bs->state = ss;
+	this_bs->nblocks = schedisk_nblocks;
+	this_bs->setsize = schedisk_setsize;
+	this_bs->read = schedisk_read;
+	this_bs->write = schedisk_write;
+	this_bs->destroy = schedisk_destroy;
+	this_bs->read_async = schedisk_read_async;
+	this_bs->write_async = schedisk_write_async;
+	this_bs->poll = schedisk_poll;
+	this_bs->name = "schedisk";
+	this_bs->below = below;
+	this_bs->stats = schedisk_stats;
+	return this_bs;
+}
@@ -0,0 +1,289 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* Builds a stack of block stores from a specification string, so that
+ * the arrangement of layers can be chosen at run time:
+ *
+ *		struct stack *stack_init(char *spec, unsigned int n_inodes)
+ *			'spec' lists the layers from the bottom up, separated by
+ *			'|', each with its parameters separated by ':'.  For example,
+ *
+ *				ram:16384|stat|cache:lfu:64|check|tree
+ *
+ *			Returns 0 (after printing the reason) if the specification
+ *			is bad or a layer could not be created.
+ *
+ *		block_store_t *stack_top(struct stack *st)
+ *		block_store_t *stack_bottom(struct stack *st)
+ *			The top and bottom layers of the stack.
+ *
+ *		block_store_t *stack_find(struct stack *st, char *name)
+ *			The topmost layer of the given type (such as "statdisk"),
+ *			or 0 if there is none.
+ *
+ *		void stack_destroy(struct stack *st)
+ *			Destroy all layers, top first, and free their memory.
+ *
+ * The first layer must be one of
+ *
+ *		ram:nblocks					a sparse ramdisk
+ *		disk:file:nblocks			a disk
+ *		uring:file:nblocks[:depth]	a uringdisk (default depth 32)
+ *
+ * and the layers on top of it any of
+ *
+ *		stat						a statdisk
+ *		prof						a profiledisk
+ *		sched[:depth]				a schedisk (default depth 32)
+ *		cache[:policy][:nblocks]	a cachedisk (default lru, 16 blocks)
+ *		cache:policy:nblocks:file	a cachedisk that starts out warm from
+ *									the index saved in 'file', and saves
+ *									its index there upon destroy
+ *		ccache:policy:nblocks:n		a cachedisk for concurrent use, with
+ *									n shards
+ *		check[:descr]				a checkdisk
+ *		digest[:descr]				a checkdisk that keeps digests only
+ *		debug[:descr]				a debugdisk
+ *		tier:file:nblocks[:ram]		a tiercache with a second tier of
+ *									nblocks in a disk in 'file' and 'ram'
+ *									blocks of memory (default 16)
+ *		tree						not a layer: creates a treedisk file
+ *									system with n_inodes inodes on the
+ *									layers below it
+ *
+ * If there is no "tree" and n_inodes is not 0, the file system is
+ * created on the bottom layer, so that its creation is not seen by the
+ * layers above.  A tiercache above a file system that was just created
+ * is reset, as its recovered second tier belongs to the previous one.
+ * The treedisks themselves are left to the user of the stack (such as a
+ * tracedisk).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block_store.h"
+
+#define STACK_MAX		32				// max # layers
+#define STACK_FIELDS	4				// max # fields per layer
+
+struct stack {
+	block_store_t *layers[STACK_MAX];	// bottom first
+	block_t *memory[STACK_MAX];			// cache memory of each layer, or 0
+	block_store_t *aux[STACK_MAX];		// other store of each layer, or 0
+	unsigned int n;
+	char *spec;							// copy, holds the descr strings
+};
+
+/* Parse a number of blocks.  Returns 0 if it is not a number.
+ */
+static block_no stack_number(char *s){
+	char *end;
+	unsigned long n = strtoul(s, &end, 0);
+
+	return *s == 0 || *end != 0 ? 0 : (block_no) n;
+}
+
+static int stack_is_number(char *s){
+	return stack_number(s) != 0;
+}
+
+/* Create the layer described by the given fields on top of 'below'.
+ */
+static block_store_t *stack_layer(struct stack *st, block_store_t *below,
+										char **f, unsigned int nf){
+	if (below == 0) {
+		if (strcmp(f[0], "ram") == 0 && nf == 2 && stack_is_number(f[1])) {
+			return ramdisk_init_sparse(stack_number(f[1]));
+		}
+		if (strcmp(f[0], "disk") == 0 && nf == 3 && stack_is_number(f[2])) {
+			return disk_init(f[1], stack_number(f[2]));
+		}
+		if (strcmp(f[0], "uring") == 0 && (nf == 3 || nf == 4) && stack_is_number(f[2])
+								&& (nf == 3 || stack_is_number(f[3]))) {
+			return uringdisk_init(f[1], stack_number(f[2]), nf == 4 ? stack_number(f[3]) : 32);
+		}
+		fprintf(stderr, "stack_init: bad bottom layer %s\n", f[0]);
+		return 0;
+	}
+
+	if (strcmp(f[0], "stat") == 0 && nf == 1) {
+		return statdisk_init(below);
+	}
+	if (strcmp(f[0], "prof") == 0 && nf == 1) {
+		return profiledisk_init(below);
+	}
+	if (strcmp(f[0], "sched") == 0 && (nf == 1 || (nf == 2 && stack_is_number(f[1])))) {
+		return schedisk_init(below, nf == 2 ? stack_number(f[1]) : 32);
+	}
+	if (strcmp(f[0], "cache") == 0) {
+		char *policy = "lru";
+		block_no nblocks = 16;
+		if (nf >= 3) {
+			policy = f[1];
+			nblocks = stack_number(f[2]);
+		}
+		else if (nf == 2 && stack_is_number(f[1])) {
+			nblocks = stack_number(f[1]);
+		}
+		else if (nf == 2) {
+			policy = f[1];
+		}
+		if (nblocks == 0) {
+			fprintf(stderr, "stack_init: bad cache size\n");
+			return 0;
+		}
+		block_t *cache = malloc((size_t) nblocks * BLOCK_SIZE);
+		block_store_t *bs = nf == 4 ? cachedisk_init_warm(below, cache, nblocks, policy, f[3])
+									: cachedisk_init_policy(below, cache, nblocks, policy);
+		if (bs == 0) {
+			free(cache);
+		}
+		else {
+			st->memory[st->n] = cache;
+		}
+		return bs;
+	}
+	if (strcmp(f[0], "ccache") == 0 && nf == 4 && stack_is_number(f[2])
+									&& stack_is_number(f[3])) {
+		block_no nblocks = stack_number(f[2]);
+		block_t *cache = malloc((size_t) nblocks * BLOCK_SIZE);
+		block_store_t *bs = cachedisk_init_concurrent(below, cache, nblocks, f[1],
+											stack_number(f[3]));
+		if (bs == 0) {
+			free(cache);
+		}
+		else {
+			st->memory[st->n] = cache;
+		}
+		return bs;
+	}
+	if (strcmp(f[0], "tier") == 0 && (nf == 3 || nf == 4) && stack_is_number(f[2])
+								&& (nf == 3 || stack_is_number(f[3]))) {
+		block_no nblocks = nf == 4 ? stack_number(f[3]) : 16;
+		block_store_t *fast = disk_init(f[1], stack_number(f[2]));
+		block_t *cache = malloc((size_t) nblocks * BLOCK_SIZE);
+		block_store_t *bs = tiercache_init(below, fast, cache, nblocks);
+		if (bs == 0) {
+			(*fast->destroy)(fast);
+			free(cache);
+		}
+		else {
+			st->memory[st->n] = cache;
+			st->aux[st->n] = fast;
+		}
+		return bs;
+	}
+	if (strcmp(f[0], "check") == 0 && nf <= 2) {
+		return checkdisk_init(below, nf == 2 ? f[1] : "check");
+	}
+	if (strcmp(f[0], "digest") == 0 && nf <= 2) {
+		return checkdisk_init_digest(below, nf == 2 ? f[1] : "digest");
+	}
+	if (strcmp(f[0], "debug") == 0 && nf <= 2) {
+		return debugdisk_init(below, nf == 2 ? f[1] : "debug");
+	}
+	fprintf(stderr, "stack_init: bad layer %s\n", f[0]);
+	return 0;
+}
+
+struct stack *stack_init(char *spec, unsigned int n_inodes){
+	struct stack *st = calloc(1, sizeof(*st));
+	char *rest, *elt;
+	int formatted = 0;
+
+	/* Without an explicit "tree", the bottom layer is formatted before
+	 * there are any layers above it (a warm cache may read it already).
+	 */
+	int format_bottom = n_inodes != 0 && strcmp(spec, "tree") != 0 &&
+							strncmp(spec, "tree|", 5) != 0 && strstr(spec, "|tree") == 0;
+
+	st->spec = strdup(spec);
+	rest = st->spec;
+	while ((elt = strsep(&rest, "|")) != 0) {
+		char *f[STACK_FIELDS];
+		unsigned int nf = 0;
+
+		while (nf < STACK_FIELDS && (f[nf] = strsep(&elt, ":")) != 0) {
+			nf++;
+		}
+		if (nf == 0 || *f[0] == 0 || elt != 0) {
+			fprintf(stderr, "stack_init: bad layer in %s\n", spec);
+			goto fail;
+		}
+
+		if (strcmp(f[0], "tree") == 0) {
+			if (st->n == 0 || formatted || nf != 1) {
+				fprintf(stderr, "stack_init: misplaced tree in %s\n", spec);
+				goto fail;
+			}
+			if (treedisk_create(stack_top(st), n_inodes) < 0) {
+				goto fail;
+			}
+			formatted = 1;
+			continue;
+		}
+
+		if (st->n == STACK_MAX) {
+			fprintf(stderr, "stack_init: too many layers in %s\n", spec);
+			goto fail;
+		}
+		block_store_t *bs = stack_layer(st, stack_top(st), f, nf);
+		if (bs == 0) {
+			goto fail;
+		}
+		st->layers[st->n++] = bs;
+		if (formatted && strcmp(f[0], "tier") == 0) {
+			tiercache_reset(bs);
+		}
+		if (st->n == 1 && format_bottom) {
+			if (treedisk_create(bs, n_inodes) < 0) {
+				goto fail;
+			}
+			formatted = 1;
+		}
+	}
+	if (st->n == 0) {
+		fprintf(stderr, "stack_init: empty stack\n");
+		goto fail;
+	}
+	return st;
+
+fail:
+	stack_destroy(st);
+	return 0;
+}
+
+block_store_t *stack_top(struct stack *st){
+	return st->n == 0 ? 0 : st->layers[st->n - 1];
+}
+
+block_store_t *stack_bottom(struct stack *st){
+	return st->n == 0 ? 0 : st->layers[0];
+}
+
+block_store_t *stack_find(struct stack *st, char *name){
+	unsigned int i;
+
+	for (i = st->n; i > 0; i--) {
+		if (strcmp(st->layers[i - 1]->name, name) == 0) {
+			return st->layers[i - 1];
+		}
+	}
+	return 0;
+}
+
+void stack_destroy(struct stack *st){
+	while (st->n > 0) {
+		st->n--;
+		(*st->layers[st->n]->destroy)(st->layers[st->n]);
+		if (st->aux[st->n] != 0) {
+			(*st->aux[st->n]->destroy)(st->aux[st->n]);
+		}
+		free(st->memory[st->n]);
+	}
+	free(st->spec);
+	free(st);
+}
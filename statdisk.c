@@ -10,47 +10,211 @@
  *
  *		block_store_t *statdisk_init(block_store_t *below){
  *			'below' is the underlying block store.
+ *
+ * Besides counting operations, it measures how long each operation takes
+ * in the layers below (using the monotonic clock) and keeps a histogram
+ * of these latencies per type of operation.  The buckets are logarithmic
+ * with LAT_SUB sub-buckets per power of two, so percentiles are accurate
+ * to within 1/LAT_SUB.  By stacking statdisks at several levels, one can
+ * see which layer adds the latency.
+ *
+ * The counters are updated atomically, so a statdisk may be used by
+ * several threads at once.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
 #include "block_store.h"
 
+#define LAT_SUB_BITS	3
+#define LAT_SUB			(1 << LAT_SUB_BITS)		// sub-buckets per power of 2
+#define LAT_LINEAR		(2 * LAT_SUB)			// values below are exact
+#define LAT_NBUCKETS	(LAT_LINEAR + (64 - LAT_SUB_BITS - 1) * LAT_SUB)
+
+/* Latency histogram of one type of operation, in nanoseconds.
+ */
+struct statdisk_hist {
+	uint64_t count[LAT_NBUCKETS];
+	uint64_t total;					// sum of all latencies
+	uint64_t max;
+};
+
+enum { OP_NBLOCKS, OP_SETSIZE, OP_READ, OP_WRITE, OP_COUNT };
+
+static const char *op_names[OP_COUNT] = { "nblocks", "setsize", "read", "write" };
+
 struct statdisk_state {
 	block_store_t *below;			// block store below
-	unsigned int nnblocks;	// #nblocks operations
-	unsigned int nsetsize;	// #nblocks operations
-	unsigned int nread;		// #read operations
-	unsigned int nwrite;	// #write operations
+	uint64_t nnblocks;		// #nblocks operations
+	uint64_t nsetsize;		// #setsize operations
+	uint64_t nread;			// #read operations
+	uint64_t nwrite;		// #write operations
+	struct statdisk_hist hist[OP_COUNT];
+	uint64_t created;		// time of statdisk_init
 };
 
+static uint64_t statdisk_now(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int statdisk_bucket(uint64_t ns){
+	if (ns < LAT_LINEAR) {
+		return ns;
+	}
+	unsigned int msb = 63 - __builtin_clzll(ns);
+	unsigned int sub = (ns >> (msb - LAT_SUB_BITS)) & (LAT_SUB - 1);
+	return LAT_LINEAR + (msb - LAT_SUB_BITS - 1) * LAT_SUB + sub;
+}
+
+/* Largest value that falls in the given bucket.
+ */
+static uint64_t statdisk_bucket_max(unsigned int b){
+	if (b < LAT_LINEAR) {
+		return b;
+	}
+	unsigned int msb = (b - LAT_LINEAR) / LAT_SUB + LAT_SUB_BITS + 1;
+	uint64_t sub = (b - LAT_LINEAR) % LAT_SUB;
+	uint64_t lo = ((uint64_t) LAT_SUB + sub) << (msb - LAT_SUB_BITS);
+	return lo + ((uint64_t) 1 << (msb - LAT_SUB_BITS)) - 1;
+}
+
+static void statdisk_record(struct statdisk_state *sds, int op, uint64_t start){
+	struct statdisk_hist *h = &sds->hist[op];
+	uint64_t ns = statdisk_now() - start;
+
+	__atomic_add_fetch(&h->count[statdisk_bucket(ns)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->total, ns, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, 0,
+								__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		;
+	}
+}
+
+/* The value below which the given fraction of operations fall.
+ */
+static uint64_t statdisk_percentile(struct statdisk_hist *h, uint64_t n, double fraction){
+	uint64_t rank = (uint64_t) (fraction * n + 0.5), seen = 0;
+	unsigned int b;
+
+	if (rank == 0) {
+		rank = 1;
+	}
+	for (b = 0; b < LAT_NBUCKETS; b++) {
+		if ((seen += h->count[b]) >= rank) {
+			uint64_t v = statdisk_bucket_max(b);
+			return v < h->max ? v : h->max;
+		}
+	}
+	return h->max;
+}
+
 static int statdisk_nblocks(block_store_t *this_bs){
 	struct statdisk_state *sds = this_bs->state;
 
-	sds->nnblocks++;
-	return (*sds->below->nblocks)(sds->below);
+	__atomic_add_fetch(&sds->nnblocks, 1, __ATOMIC_RELAXED);
+	uint64_t start = statdisk_now();
+	int result = (*sds->below->nblocks)(sds->below);
+	statdisk_record(sds, OP_NBLOCKS, start);
+	return result;
 }
 
 static int statdisk_setsize(block_store_t *this_bs, block_no nblocks){
 	struct statdisk_state *sds = this_bs->state;
 
-	sds->nsetsize++;
-	return (*sds->below->setsize)(sds->below, nblocks);
+	__atomic_add_fetch(&sds->nsetsize, 1, __ATOMIC_RELAXED);
+	uint64_t start = statdisk_now();
+	int result = (*sds->below->setsize)(sds->below, nblocks);
+	statdisk_record(sds, OP_SETSIZE, start);
+	return result;
 }
 
 static int statdisk_read(block_store_t *this_bs, block_no offset, block_t *block){
 	struct statdisk_state *sds = this_bs->state;
 
-	sds->nread++;
-	return (*sds->below->read)(sds->below, offset, block);
+	__atomic_add_fetch(&sds->nread, 1, __ATOMIC_RELAXED);
+	uint64_t start = statdisk_now();
+	int result = (*sds->below->read)(sds->below, offset, block);
+	statdisk_record(sds, OP_READ, start);
+	return result;
 }
 
 static int statdisk_write(block_store_t *this_bs, block_no offset, block_t *block){
 	struct statdisk_state *sds = this_bs->state;
 
-	sds->nwrite++;
-	return (*sds->below->write)(sds->below, offset, block);
+	__atomic_add_fetch(&sds->nwrite, 1, __ATOMIC_RELAXED);
+	uint64_t start = statdisk_now();
+	int result = (*sds->below->write)(sds->below, offset, block);
+	statdisk_record(sds, OP_WRITE, start);
+	return result;
+}
+
+/* An asynchronous operation being timed.
+ */
+struct statdisk_op {
+	struct statdisk_state *sds;
+	int op;
+	uint64_t start;
+	block_done_t done;
+	void *arg;
+};
+
+static void statdisk_done(void *arg, int result){
+	struct statdisk_op *so = arg;
+
+	statdisk_record(so->sds, so->op, so->start);
+	(*so->done)(so->arg, result);
+	free(so);
+}
+
+static struct statdisk_op *statdisk_op_start(struct statdisk_state *sds, int op,
+											block_done_t done, void *arg){
+	struct statdisk_op *so = malloc(sizeof(*so));
+
+	so->sds = sds;
+	so->op = op;
+	so->done = done;
+	so->arg = arg;
+	so->start = statdisk_now();
+	return so;
+}
+
+static int statdisk_read_async(block_store_t *this_bs, block_no offset, block_t *block,
+											block_done_t done, void *arg){
+	struct statdisk_state *sds = this_bs->state;
+
+	__atomic_add_fetch(&sds->nread, 1, __ATOMIC_RELAXED);
+	struct statdisk_op *so = statdisk_op_start(sds, OP_READ, done, arg);
+	if (block_store_read_async(sds->below, offset, block, statdisk_done, so) < 0) {
+		free(so);
+		return -1;
+	}
+	return 0;
+}
+
+static int statdisk_write_async(block_store_t *this_bs, block_no offset, block_t *block,
+											block_done_t done, void *arg){
+	struct statdisk_state *sds = this_bs->state;
+
+	__atomic_add_fetch(&sds->nwrite, 1, __ATOMIC_RELAXED);
+	struct statdisk_op *so = statdisk_op_start(sds, OP_WRITE, done, arg);
+	if (block_store_write_async(sds->below, offset, block, statdisk_done, so) < 0) {
+		free(so);
+		return -1;
+	}
+	return 0;
+}
+
+static int statdisk_poll(block_store_t *this_bs, int wait){
+	struct statdisk_state *sds = this_bs->state;
+
+	return block_store_poll(sds->below, wait);
 }
 
 static void statdisk_destroy(block_store_t *this_bs){
@@ -58,13 +222,78 @@ static void statdisk_destroy(block_store_t *this_bs){
 	free(this_bs);
 }
 
+static uint64_t statdisk_hist_count(struct statdisk_hist *h){
+	uint64_t n = 0;
+	unsigned int b;
+
+	for (b = 0; b < LAT_NBUCKETS; b++) {
+		n += h->count[b];
+	}
+	return n;
+}
+
+static double statdisk_ops_per_sec(struct statdisk_state *sds){
+	double seconds = (statdisk_now() - sds->created) / 1e9;
+	uint64_t total = sds->nnblocks + sds->nsetsize + sds->nread + sds->nwrite;
+
+	return seconds > 0 ? total / seconds : 0;
+}
+
+static void statdisk_stats(block_store_t *this_bs, block_stat_t emit, void *arg){
+	struct statdisk_state *sds = this_bs->state;
+	char name[64];
+	int op;
+
+	(*emit)(arg, "nnblocks", BLOCK_STAT_COUNTER, sds->nnblocks);
+	(*emit)(arg, "nsetsize", BLOCK_STAT_COUNTER, sds->nsetsize);
+	(*emit)(arg, "nread", BLOCK_STAT_COUNTER, sds->nread);
+	(*emit)(arg, "nwrite", BLOCK_STAT_COUNTER, sds->nwrite);
+	for (op = 0; op < OP_COUNT; op++) {
+		struct statdisk_hist *h = &sds->hist[op];
+		uint64_t n = statdisk_hist_count(h);
+		if (n == 0) {
+			continue;
+		}
+		snprintf(name, sizeof(name), "%s_mean_ns", op_names[op]);
+		(*emit)(arg, name, BLOCK_STAT_GAUGE, (double) (h->total / n));
+		snprintf(name, sizeof(name), "%s_p50_ns", op_names[op]);
+		(*emit)(arg, name, BLOCK_STAT_GAUGE, statdisk_percentile(h, n, 0.50));
+		snprintf(name, sizeof(name), "%s_p99_ns", op_names[op]);
+		(*emit)(arg, name, BLOCK_STAT_GAUGE, statdisk_percentile(h, n, 0.99));
+		snprintf(name, sizeof(name), "%s_max_ns", op_names[op]);
+		(*emit)(arg, name, BLOCK_STAT_GAUGE, h->max);
+	}
+	(*emit)(arg, "ops_per_sec", BLOCK_STAT_GAUGE, statdisk_ops_per_sec(sds));
+}
+
 void statdisk_dump_stats(block_store_t *this_bs){
 	struct statdisk_state *sds = this_bs->state;
 
-	printf("!$STAT: #nnblocks:  %u\n", sds->nnblocks);
-	printf("!$STAT: #nsetsize:  %u\n", sds->nsetsize);
-	printf("!$STAT: #nread:     %u\n", sds->nread);
-	printf("!$STAT: #nwrite:    %u\n", sds->nwrite);
+	printf("!$STAT: #nnblocks:  %llu\n", (unsigned long long) sds->nnblocks);
+	printf("!$STAT: #nsetsize:  %llu\n", (unsigned long long) sds->nsetsize);
+	printf("!$STAT: #nread:     %llu\n", (unsigned long long) sds->nread);
+	printf("!$STAT: #nwrite:    %llu\n", (unsigned long long) sds->nwrite);
+
+	/* Latencies in nanoseconds.
+	 */
+	int op;
+	for (op = 0; op < OP_COUNT; op++) {
+		struct statdisk_hist *h = &sds->hist[op];
+		uint64_t n = statdisk_hist_count(h);
+		if (n == 0) {
+			continue;
+		}
+		printf("!$LAT: %-8s mean %llu p50 %llu p90 %llu p99 %llu p999 %llu max %llu ns\n",
+			op_names[op],
+			(unsigned long long) (h->total / n),
+			(unsigned long long) statdisk_percentile(h, n, 0.50),
+			(unsigned long long) statdisk_percentile(h, n, 0.90),
+			(unsigned long long) statdisk_percentile(h, n, 0.99),
+			(unsigned long long) statdisk_percentile(h, n, 0.999),
+			(unsigned long long) h->max);
+	}
+
+	printf("!$STAT: ops/sec:    %.0f\n", statdisk_ops_per_sec(sds));
 }
 
 block_store_t *statdisk_init(block_store_t *below){
@@ -72,6 +301,7 @@ block_store_t *statdisk_init(block_store_t *below){
 	 */
 	struct statdisk_state *sds = calloc(1, sizeof(*sds));
 	sds->below = below;
+	sds->created = statdisk_now();
 
 	/* Return a block interface to this inode.
 	 */
@@ -82,5 +312,11 @@ block_store_t *statdisk_init(block_store_t *below){
 	this_bs->read = statdisk_read;
 	this_bs->write = statdisk_write;
 	this_bs->destroy = statdisk_destroy;
+	this_bs->read_async = statdisk_read_async;
+	this_bs->write_async = statdisk_write_async;
+	this_bs->poll = statdisk_poll;
+	this_bs->name = "statdisk";
+	this_bs->below = below;
+	this_bs->stats = statdisk_stats;
 	return this_bs;
 }
@@ -0,0 +1,460 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* This block store module stripes blocks across several underlying block
+ * stores, so that they can be accessed in parallel:
+ *
+ *		block_store_t *stripedisk_init(block_store_t **stores, unsigned int n,
+ *											block_no stripe_blocks)
+ *			'stores' is an array of the n underlying block stores (the
+ *			members), and 'stripe_blocks' the number of consecutive
+ *			blocks that go to the same member.
+ *
+ * Stripes are assigned to the members round-robin: block b is in stripe
+ * s = b / stripe_blocks, which is on member s % n at offset
+ * (s / n) * stripe_blocks + b % stripe_blocks.  The stripedisk has n
+ * times as many blocks as its smallest member (rounded down to whole
+ * stripes), and setsize sets the size of every member to its share.  If
+ * that fails for any member, the members that were resized get their old
+ * size back and setsize returns -1.  Otherwise the new size is the one
+ * asked for, but no more than what the members now hold.
+ *
+ * A run of blocks read or written with readv or writev (see
+ * block_store.h) is split into one run per member, and these runs are
+ * carried out in parallel: each member has a worker thread, and the
+ * calling thread does the run of the first member itself.  Reads and
+ * writes of single blocks simply go to their member.  Each member has a
+ * lock, so the stripedisk may be used by several threads at once, which
+ * then only wait for each other if they use the same member.
+ *
+ * Asynchronous reads and writes are passed on to the members, and a poll
+ * polls all of them.  As the members are not locked for these, they
+ * should not be mixed with use by other threads.
+ *
+ * The stats include the number of blocks read and written per member.
+ * The members are not destroyed along with the stripedisk.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "block_store.h"
+
+/* Waits for the runs of one readv or writev on the members.
+ */
+struct stripe_wait {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int pending;			// # runs not yet done
+	int result;
+};
+
+/* A run of blocks on one member, for its worker thread.
+ */
+struct stripe_job {
+	struct stripe_job *next;
+	int is_read;
+	block_no offset;				// offset on the member
+	block_t **blocks;
+	unsigned int n;
+	struct stripe_wait *wait;
+};
+
+struct stripe_member {
+	block_store_t *bs;
+	pthread_mutex_t lock;			// serializes the I/O on the member
+	unsigned long nread, nwrite;	// # blocks
+
+	pthread_mutex_t qlock;			// protects the fields below
+	pthread_cond_t qcond;
+	struct stripe_job *jobs, **tail;
+	int stop;
+	pthread_t worker;
+};
+
+struct stripedisk_state {
+	struct stripe_member *members;
+	unsigned int n;					// # members
+	block_no stripe_blocks;
+	block_no nblocks;				// size of the stripedisk
+	unsigned long nfanout;			// # runs spread over several members
+};
+
+/* Find the member and the offset on it of the given block.
+ */
+static struct stripe_member *stripedisk_map(struct stripedisk_state *sds, block_no offset,
+													block_no *moffset){
+	block_no stripe = offset / sds->stripe_blocks;
+
+	*moffset = (stripe / sds->n) * sds->stripe_blocks + offset % sds->stripe_blocks;
+	return &sds->members[stripe % sds->n];
+}
+
+static int stripedisk_check(struct stripedisk_state *sds, block_no offset, unsigned int n){
+	if (offset >= sds->nblocks || n > sds->nblocks - offset) {
+		fprintf(stderr, "stripedisk: bad offset %u (%u blocks)\n", offset, n);
+		return 0;
+	}
+	return 1;
+}
+
+/* The size that the members can hold: n times the smallest member,
+ * rounded down to whole stripes.
+ */
+static block_no stripedisk_capacity(struct stripedisk_state *sds){
+	block_no smallest = (block_no) -1;
+	unsigned int i;
+
+	for (i = 0; i < sds->n; i++) {
+		block_store_t *bs = sds->members[i].bs;
+		block_no size = (*bs->nblocks)(bs);
+		if (size < smallest) {
+			smallest = size;
+		}
+	}
+	unsigned long long total = (unsigned long long) (smallest / sds->stripe_blocks) *
+										sds->stripe_blocks * sds->n;
+	return total > (block_no) -1 ? (block_no) -1 : (block_no) total;
+}
+
+static int stripedisk_nblocks(block_store_t *this_bs){
+	struct stripedisk_state *sds = this_bs->state;
+
+	return sds->nblocks;
+}
+
+static int stripedisk_setsize(block_store_t *this_bs, block_no nblocks){
+	struct stripedisk_state *sds = this_bs->state;
+	block_no per_member = (block_no) (((unsigned long long) nblocks +
+				(unsigned long long) sds->stripe_blocks * sds->n - 1) /
+				((unsigned long long) sds->stripe_blocks * sds->n)) * sds->stripe_blocks;
+	block_no *old = malloc(sds->n * sizeof(*old));
+	unsigned int i;
+	int result = 0;
+
+	for (i = 0; i < sds->n && result == 0; i++) {
+		struct stripe_member *sm = &sds->members[i];
+		pthread_mutex_lock(&sm->lock);
+		old[i] = (*sm->bs->nblocks)(sm->bs);
+		if ((*sm->bs->setsize)(sm->bs, per_member) < 0) {
+			fprintf(stderr, "stripedisk: can't resize member %u\n", i);
+			result = -1;
+		}
+		pthread_mutex_unlock(&sm->lock);
+	}
+	if (result < 0) {
+		while (--i > 0) {
+			struct stripe_member *sm = &sds->members[i - 1];
+			pthread_mutex_lock(&sm->lock);
+			(*sm->bs->setsize)(sm->bs, old[i - 1]);
+			pthread_mutex_unlock(&sm->lock);
+		}
+		free(old);
+		return -1;
+	}
+	free(old);
+
+	int before = sds->nblocks;
+	block_no capacity = stripedisk_capacity(sds);
+	sds->nblocks = nblocks < capacity ? nblocks : capacity;
+	return before;
+}
+
+static int stripedisk_read(block_store_t *this_bs, block_no offset, block_t *block){
+	struct stripedisk_state *sds = this_bs->state;
+	block_no moffset;
+
+	if (!stripedisk_check(sds, offset, 1)) {
+		return -1;
+	}
+	struct stripe_member *sm = stripedisk_map(sds, offset, &moffset);
+	pthread_mutex_lock(&sm->lock);
+	sm->nread++;
+	int result = (*sm->bs->read)(sm->bs, moffset, block);
+	pthread_mutex_unlock(&sm->lock);
+	return result;
+}
+
+static int stripedisk_write(block_store_t *this_bs, block_no offset, block_t *block){
+	struct stripedisk_state *sds = this_bs->state;
+	block_no moffset;
+
+	if (!stripedisk_check(sds, offset, 1)) {
+		return -1;
+	}
+	struct stripe_member *sm = stripedisk_map(sds, offset, &moffset);
+	pthread_mutex_lock(&sm->lock);
+	sm->nwrite++;
+	int result = (*sm->bs->write)(sm->bs, moffset, block);
+	pthread_mutex_unlock(&sm->lock);
+	return result;
+}
+
+/* Carry out a run of blocks on a member.
+ */
+static int stripe_member_run(struct stripe_member *sm, int is_read, block_no offset,
+											block_t **blocks, unsigned int n){
+	pthread_mutex_lock(&sm->lock);
+	int result;
+	if (is_read) {
+		sm->nread += n;
+		result = block_store_readv(sm->bs, offset, blocks, n);
+	}
+	else {
+		sm->nwrite += n;
+		result = block_store_writev(sm->bs, offset, blocks, n);
+	}
+	pthread_mutex_unlock(&sm->lock);
+	return result;
+}
+
+static void stripe_wait_done(struct stripe_wait *sw, int result){
+	pthread_mutex_lock(&sw->lock);
+	if (result < 0) {
+		sw->result = -1;
+	}
+	if (--sw->pending == 0) {
+		pthread_cond_signal(&sw->cond);
+	}
+	pthread_mutex_unlock(&sw->lock);
+}
+
+static void *stripe_worker(void *arg){
+	struct stripe_member *sm = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&sm->qlock);
+		while (sm->jobs == 0 && !sm->stop) {
+			pthread_cond_wait(&sm->qcond, &sm->qlock);
+		}
+		struct stripe_job *sj = sm->jobs;
+		if (sj == 0) {
+			pthread_mutex_unlock(&sm->qlock);
+			return 0;
+		}
+		if ((sm->jobs = sj->next) == 0) {
+			sm->tail = &sm->jobs;
+		}
+		pthread_mutex_unlock(&sm->qlock);
+
+		int result = stripe_member_run(sm, sj->is_read, sj->offset, sj->blocks, sj->n);
+		stripe_wait_done(sj->wait, result);
+	}
+}
+
+static void stripe_submit(struct stripe_member *sm, struct stripe_job *sj){
+	pthread_mutex_lock(&sm->qlock);
+	sj->next = 0;
+	*sm->tail = sj;
+	sm->tail = &sj->next;
+	pthread_cond_signal(&sm->qcond);
+	pthread_mutex_unlock(&sm->qlock);
+}
+
+/* Split a run into one run per member and carry these out in parallel.
+ * As consecutive stripes on the same member are adjacent there, each
+ * member gets a single run.
+ */
+static int stripedisk_vectored(block_store_t *this_bs, int is_read, block_no offset,
+											block_t **blocks, unsigned int n){
+	struct stripedisk_state *sds = this_bs->state;
+
+	if (n == 0) {
+		return 0;
+	}
+	if (!stripedisk_check(sds, offset, n)) {
+		return -1;
+	}
+
+	/* Runs within one stripe need not be split.
+	 */
+	block_no moffset;
+	if (offset / sds->stripe_blocks == (offset + n - 1) / sds->stripe_blocks) {
+		struct stripe_member *sm = stripedisk_map(sds, offset, &moffset);
+		return stripe_member_run(sm, is_read, moffset, blocks, n);
+	}
+
+	/* Gather the blocks of each member, starting with the member of the
+	 * first block.
+	 */
+	struct stripe_job *jobs = calloc(sds->n, sizeof(*jobs));
+	block_t **vec = malloc((size_t) n * sizeof(*vec));
+	unsigned int first = (offset / sds->stripe_blocks) % sds->n;
+	unsigned int i, nused = 0, filled = 0;
+	for (i = 0; i < sds->n; i++) {
+		unsigned int m = (first + i) % sds->n;
+		struct stripe_job *sj = &jobs[m];
+		sj->is_read = is_read;
+		sj->blocks = &vec[filled];
+		block_no b = offset;
+		if (i > 0) {
+			b = (offset / sds->stripe_blocks + i) * sds->stripe_blocks;
+		}
+		if (b >= offset + n) {
+			break;
+		}
+		stripedisk_map(sds, b, &sj->offset);
+		for (; b < offset + n; b += (sds->n - 1) * sds->stripe_blocks) {
+			block_no end = (b / sds->stripe_blocks + 1) * sds->stripe_blocks;
+			for (; b < end && b < offset + n; b++) {
+				vec[filled++] = blocks[b - offset];
+				sj->n++;
+			}
+		}
+		nused++;
+	}
+	__atomic_add_fetch(&sds->nfanout, 1, __ATOMIC_RELAXED);
+
+	/* Hand all but the first run to the workers.
+	 */
+	struct stripe_wait sw;
+	pthread_mutex_init(&sw.lock, 0);
+	pthread_cond_init(&sw.cond, 0);
+	sw.pending = nused - 1;
+	sw.result = 0;
+	for (i = 1; i < nused; i++) {
+		unsigned int m = (first + i) % sds->n;
+		jobs[m].wait = &sw;
+		stripe_submit(&sds->members[m], &jobs[m]);
+	}
+	int result = stripe_member_run(&sds->members[first], is_read, jobs[first].offset,
+									jobs[first].blocks, jobs[first].n);
+
+	pthread_mutex_lock(&sw.lock);
+	while (sw.pending > 0) {
+		pthread_cond_wait(&sw.cond, &sw.lock);
+	}
+	pthread_mutex_unlock(&sw.lock);
+	pthread_cond_destroy(&sw.cond);
+	pthread_mutex_destroy(&sw.lock);
+	free(vec);
+	free(jobs);
+	return result < 0 || sw.result < 0 ? -1 : 0;
+}
+
+static int stripedisk_readv(block_store_t *this_bs, block_no offset, block_t **blocks, unsigned int n){
+	return stripedisk_vectored(this_bs, 1, offset, blocks, n);
+}
+
+static int stripedisk_writev(block_store_t *this_bs, block_no offset, block_t **blocks, unsigned int n){
+	return stripedisk_vectored(this_bs, 0, offset, blocks, n);
+}
+
+static int stripedisk_read_async(block_store_t *this_bs, block_no offset, block_t *block,
+											block_done_t done, void *arg){
+	struct stripedisk_state *sds = this_bs->state;
+	block_no moffset;
+
+	if (!stripedisk_check(sds, offset, 1)) {
+		return -1;
+	}
+	struct stripe_member *sm = stripedisk_map(sds, offset, &moffset);
+	sm->nread++;
+	return block_store_read_async(sm->bs, moffset, block, done, arg);
+}
+
+static int stripedisk_write_async(block_store_t *this_bs, block_no offset, block_t *block,
+											block_done_t done, void *arg){
+	struct stripedisk_state *sds = this_bs->state;
+	block_no moffset;
+
+	if (!stripedisk_check(sds, offset, 1)) {
+		return -1;
+	}
+	struct stripe_member *sm = stripedisk_map(sds, offset, &moffset);
+	sm->nwrite++;
+	return block_store_write_async(sm->bs, moffset, block, done, arg);
+}
+
+static int stripedisk_poll(block_store_t *this_bs, int wait){
+	struct stripedisk_state *sds = this_bs->state;
+	unsigned int i;
+
+	for (i = 0; i < sds->n; i++) {
+		block_store_poll(sds->members[i].bs, wait);
+	}
+	return 0;
+}
+
+static void stripedisk_stats(block_store_t *this_bs, block_stat_t emit, void *arg){
+	struct stripedisk_state *sds = this_bs->state;
+	char name[64];
+	unsigned int i;
+
+	(*emit)(arg, "fanout", BLOCK_STAT_COUNTER, sds->nfanout);
+	for (i = 0; i < sds->n; i++) {
+		snprintf(name, sizeof(name), "member%u_nread", i);
+		(*emit)(arg, name, BLOCK_STAT_COUNTER, sds->members[i].nread);
+		snprintf(name, sizeof(name), "member%u_nwrite", i);
+		(*emit)(arg, name, BLOCK_STAT_COUNTER, sds->members[i].nwrite);
+	}
+	(*emit)(arg, "nblocks", BLOCK_STAT_GAUGE, sds->nblocks);
+	(*emit)(arg, "members", BLOCK_STAT_GAUGE, sds->n);
+	(*emit)(arg, "stripe_blocks", BLOCK_STAT_GAUGE, sds->stripe_blocks);
+}
+
+static void stripedisk_destroy(block_store_t *this_bs){
+	struct stripedisk_state *sds = this_bs->state;
+	unsigned int i;
+
+	for (i = 0; i < sds->n; i++) {
+		struct stripe_member *sm = &sds->members[i];
+		pthread_mutex_lock(&sm->qlock);
+		sm->stop = 1;
+		pthread_cond_signal(&sm->qcond);
+		pthread_mutex_unlock(&sm->qlock);
+		pthread_join(sm->worker, 0);
+		pthread_cond_destroy(&sm->qcond);
+		pthread_mutex_destroy(&sm->qlock);
+		pthread_mutex_destroy(&sm->lock);
+	}
+	free(sds->members);
+	free(sds);
+	free(this_bs);
+}
+
+block_store_t *stripedisk_init(block_store_t **stores, unsigned int n, block_no stripe_blocks){
+	if (n == 0 || stripe_blocks == 0) {
+		fprintf(stderr, "stripedisk_init: need at least one member and stripe block\n");
+		return 0;
+	}
+
+	/* Create the block store state structure.  The size is limited by the
+	 * smallest member.
+	 */
+	struct stripedisk_state *sds = calloc(1, sizeof(*sds));
+	sds->n = n;
+	sds->stripe_blocks = stripe_blocks;
+	sds->members = calloc(n, sizeof(*sds->members));
+	unsigned int i;
+	for (i = 0; i < n; i++) {
+		struct stripe_member *sm = &sds->members[i];
+		sm->bs = stores[i];
+		pthread_mutex_init(&sm->lock, 0);
+		pthread_mutex_init(&sm->qlock, 0);
+		pthread_cond_init(&sm->qcond, 0);
+		sm->tail = &sm->jobs;
+		pthread_create(&sm->worker, 0, stripe_worker, sm);
+	}
+	sds->nblocks = stripedisk_capacity(sds);
+
+	block_store_t *this_bs = calloc(1, sizeof(*this_bs));
+	this_bs->state = sds;
+	this_bs->nblocks = stripedisk_nblocks;
+	this_bs->setsize = stripedisk_setsize;
+	this_bs->read = stripedisk_read;
+	this_bs->write = stripedisk_write;
+	this_bs->destroy = stripedisk_destroy;
+	this_bs->read_async = stripedisk_read_async;
+	this_bs->write_async = stripedisk_write_async;
+	this_bs->poll = stripedisk_poll;
+	this_bs->readv = stripedisk_readv;
+	this_bs->writev = stripedisk_writev;
+	this_bs->name = "stripedisk";
+	this_bs->below = stores[0];
+	this_bs->stats = stripedisk_stats;
+	return this_bs;
+}
@@ -0,0 +1,604 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* This block store module mirrors the underlying block store but caches
+ * its blocks in two tiers: a write-through RAM cache like cachedisk, and a
+ * larger second tier on another block store (such as a disk_init file on
+ * a fast device in front of a slow one).
+ *
+ *		block_store_t *tiercache_init(block_store_t *below, block_store_t *fast,
+ *									block_t *blocks, block_no nblocks)
+ *			'below' is the underlying block store and 'fast' the block
+ *			store for the second tier.  'blocks' points to a chunk of
+ *			memory with 'nblocks' blocks for the first tier.  The
+ *			tiercache does not destroy 'fast'.  Returns 0 if 'fast' is too
+ *			small to hold a second tier.
+ *
+ *		void tiercache_reset(block_store_t *this_bs)
+ *			Empties both tiers.  For when 'below' was changed other than
+ *			through the tiercache, such as when a file system was created
+ *			on it after the second tier was recovered.
+ *
+ *		void tiercache_dump_stats(block_store_t *this_bs)
+ *			Prints the hits of each tier and the misses.
+ *
+ * The tiers are exclusive: a block is in at most one of them.  Both use
+ * LRU replacement.  A block evicted from RAM is demoted to the second
+ * tier (dropping the least recently used block there if it is full), and
+ * a block found in the second tier is promoted back to RAM.  A write goes
+ * to the layer below and to RAM, and drops any copy in the second tier.
+ *
+ * The second tier survives restarts.  Block 0 of 'fast' holds a header,
+ * the next blocks a table of the cached offsets and their frames (most
+ * recently used first), and the rest the frames themselves.  The table
+ * is only written upon destroy, after the RAM tier has been demoted to
+ * the second tier.  Before the first change to the second tier, the
+ * header is marked unclean, so that after a crash the second tier starts
+ * out empty rather than with a stale table.  As the second tier only
+ * holds copies, 'below' must be persistent as well (and not be changed
+ * other than through the tiercache) for the recovered table to be valid.
+ * The header also holds a checksum of block 0 of 'below' (the superblock
+ * of a file system on it), so that the table is dropped if 'below' was
+ * reformatted in the mean time.  That does not catch a new file system
+ * whose superblock happens to be the same, so whoever reformats 'below'
+ * should call tiercache_reset as well.
+ *
+ * A single lock protects everything, including the I/O on the tiers, so
+ * a tiercache may be used by several threads at once, but not in parallel.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "block_store.h"
+
+#define NIL				((block_no) -1)		// no slot
+#define TIER_MAGIC		0x74696572			// "tier"
+#define TIER_PER_BLOCK	(BLOCK_SIZE / sizeof(struct tier_entry))
+
+/* Block 0 of the second tier.
+ */
+struct tier_header {
+	uint32_t magic;
+	uint32_t clean;					// table matches the frames
+	uint32_t nframes;
+	uint32_t nentries;				// # entries in the table
+	uint32_t below_nblocks;			// sanity check on recovery
+	uint32_t pad;
+	uint64_t below_sum;				// checksum of block 0 of below
+};
+
+/* An entry of the table.
+ */
+struct tier_entry {
+	block_no offset;
+	block_no frame;
+};
+
+/* A cache slot.  'chain' links the slots in a hash bucket, and 'prev' and
+ * 'next' link them on the LRU list (most recent first), or 'next' links
+ * them on the free list.
+ */
+struct tier_slot {
+	block_no offset;
+	block_no chain;
+	block_no prev, next;
+};
+
+/* One tier: nslots slots, indexed by offset through a hash table.
+ */
+struct tier {
+	struct tier_slot *slots;
+	block_no nslots;
+	block_no *buckets;
+	block_no nbuckets;				// power of 2
+	block_no head, tail;			// LRU list
+	block_no free;					// free list
+	block_no nused;
+};
+
+struct tiercache_state {
+	block_store_t *below;			// block store below
+	block_store_t *fast;			// second tier
+	block_t *blocks;				// first tier memory
+	struct tier ram, disk;
+	block_no table_blocks;			// # table blocks in 'fast'
+	block_no below_nblocks;
+	int dirty;						// header marked unclean
+
+	/* Stats.
+	 */
+	unsigned long ram_hit, disk_hit, read_miss;
+	unsigned long write_hit, write_miss;
+	unsigned long demotions, promotions, recovered;
+
+	pthread_mutex_t lock;
+};
+
+static void tier_create(struct tier *t, block_no nslots){
+	block_no s;
+
+	t->slots = calloc(nslots, sizeof(*t->slots));
+	t->nslots = nslots;
+	t->nbuckets = 1;
+	while (t->nbuckets < 2 * nslots) {
+		t->nbuckets *= 2;
+	}
+	t->buckets = malloc(t->nbuckets * sizeof(*t->buckets));
+	memset(t->buckets, 0xff, t->nbuckets * sizeof(*t->buckets));	// all NIL
+	t->head = t->tail = NIL;
+	for (s = 0; s < nslots; s++) {
+		t->slots[s].next = s + 1 < nslots ? s + 1 : NIL;
+	}
+	t->free = 0;
+	t->nused = 0;
+}
+
+static void tier_release(struct tier *t){
+	free(t->slots);
+	free(t->buckets);
+}
+
+static block_no tier_hash(struct tier *t, block_no offset){
+	return (offset * 2654435761U) & (t->nbuckets - 1);
+}
+
+/* Find the slot holding 'offset', or NIL.
+ */
+static block_no tier_lookup(struct tier *t, block_no offset){
+	block_no s;
+
+	for (s = t->buckets[tier_hash(t, offset)]; s != NIL; s = t->slots[s].chain) {
+		if (t->slots[s].offset == offset) {
+			break;
+		}
+	}
+	return s;
+}
+
+static void tier_unlink(struct tier *t, block_no s){
+	struct tier_slot *sl = &t->slots[s];
+
+	if (sl->prev == NIL) {
+		t->head = sl->next;
+	}
+	else {
+		t->slots[sl->prev].next = sl->next;
+	}
+	if (sl->next == NIL) {
+		t->tail = sl->prev;
+	}
+	else {
+		t->slots[sl->next].prev = sl->prev;
+	}
+}
+
+static void tier_push(struct tier *t, block_no s){
+	struct tier_slot *sl = &t->slots[s];
+
+	sl->prev = NIL;
+	sl->next = t->head;
+	if (t->head == NIL) {
+		t->tail = s;
+	}
+	else {
+		t->slots[t->head].prev = s;
+	}
+	t->head = s;
+}
+
+/* Mark slot s as most recently used.
+ */
+static void tier_touch(struct tier *t, block_no s){
+	tier_unlink(t, s);
+	tier_push(t, s);
+}
+
+/* Take a free slot, or NIL if there is none.
+ */
+static block_no tier_alloc(struct tier *t){
+	block_no s = t->free;
+
+	if (s != NIL) {
+		t->free = t->slots[s].next;
+	}
+	return s;
+}
+
+/* Put 'offset' in the free slot s and make it most recently used.
+ */
+static void tier_insert(struct tier *t, block_no s, block_no offset){
+	block_no h = tier_hash(t, offset);
+
+	t->slots[s].offset = offset;
+	t->slots[s].chain = t->buckets[h];
+	t->buckets[h] = s;
+	tier_push(t, s);
+	t->nused++;
+}
+
+/* Drop the block in slot s and free the slot.
+ */
+static void tier_remove(struct tier *t, block_no s){
+	block_no *ps = &t->buckets[tier_hash(t, t->slots[s].offset)];
+
+	while (*ps != s) {
+		ps = &t->slots[*ps].chain;
+	}
+	*ps = t->slots[s].chain;
+	tier_unlink(t, s);
+	t->slots[s].next = t->free;
+	t->free = s;
+	t->nused--;
+}
+
+static block_no tier_frame(struct tiercache_state *ts, block_no f){
+	return 1 + ts->table_blocks + f;
+}
+
+/* FNV-1a over block 0 of the layer below, or 0 if it has no blocks.
+ */
+static int tier_below_sum(struct tiercache_state *ts, uint64_t *sum){
+	block_t block;
+	unsigned int i;
+
+	*sum = 0;
+	if (ts->below_nblocks == 0) {
+		return 0;
+	}
+	if ((*ts->below->read)(ts->below, 0, &block) < 0) {
+		return -1;
+	}
+	*sum = 0xcbf29ce484222325ULL;
+	for (i = 0; i < BLOCK_SIZE; i++) {
+		*sum = (*sum ^ ((unsigned char *) &block)[i]) * 0x100000001b3ULL;
+	}
+	return 0;
+}
+
+static int tier_write_header(struct tiercache_state *ts, int clean, block_no nentries){
+	block_t block;
+	struct tier_header *th = (struct tier_header *) &block;
+
+	memset(&block, 0, BLOCK_SIZE);
+	if (clean && tier_below_sum(ts, &th->below_sum) < 0) {
+		return -1;
+	}
+	th->magic = TIER_MAGIC;
+	th->clean = clean;
+	th->nframes = ts->disk.nslots;
+	th->nentries = nentries;
+	th->below_nblocks = ts->below_nblocks;
+	return (*ts->fast->write)(ts->fast, 0, &block);
+}
+
+/* Called before the second tier is changed.
+ */
+static void tier_dirty(struct tiercache_state *ts){
+	if (!ts->dirty) {
+		ts->dirty = 1;
+		tier_write_header(ts, 0, 0);
+	}
+}
+
+/* Move the block in RAM slot s to the second tier and free the slot.
+ */
+static void tier_demote(struct tiercache_state *ts, block_no s){
+	block_no offset = ts->ram.slots[s].offset;
+	block_no f;
+
+	tier_dirty(ts);
+	if ((f = tier_alloc(&ts->disk)) == NIL) {
+		tier_remove(&ts->disk, ts->disk.tail);
+		f = tier_alloc(&ts->disk);
+	}
+	if ((*ts->fast->write)(ts->fast, tier_frame(ts, f), &ts->blocks[s]) == 0) {
+		tier_insert(&ts->disk, f, offset);
+		ts->demotions++;
+	}
+	else {
+		ts->disk.slots[f].next = ts->disk.free;
+		ts->disk.free = f;
+	}
+	tier_remove(&ts->ram, s);
+}
+
+/* Store *block as the content of 'offset' in RAM, demoting the least
+ * recently used block if RAM is full.
+ */
+static void tier_put(struct tiercache_state *ts, block_no offset, block_t *block){
+	block_no s = tier_lookup(&ts->ram, offset);
+
+	if (s != NIL) {
+		tier_touch(&ts->ram, s);
+	}
+	else {
+		if ((s = tier_alloc(&ts->ram)) == NIL) {
+			tier_demote(ts, ts->ram.tail);
+			s = tier_alloc(&ts->ram);
+		}
+		tier_insert(&ts->ram, s, offset);
+	}
+	memcpy(&ts->blocks[s], block, BLOCK_SIZE);
+}
+
+static int tiercache_read(block_store_t *this_bs, block_no offset, block_t *block){
+	struct tiercache_state *ts = this_bs->state;
+	block_no s;
+	int result = 0;
+
+	pthread_mutex_lock(&ts->lock);
+	if ((s = tier_lookup(&ts->ram, offset)) != NIL) {
+		ts->ram_hit++;
+		memcpy(block, &ts->blocks[s], BLOCK_SIZE);
+		tier_touch(&ts->ram, s);
+	}
+	else if ((s = tier_lookup(&ts->disk, offset)) != NIL &&
+				(*ts->fast->read)(ts->fast, tier_frame(ts, s), block) == 0) {
+		ts->disk_hit++;
+		ts->promotions++;
+		tier_dirty(ts);
+		tier_remove(&ts->disk, s);
+		tier_put(ts, offset, block);
+	}
+	else if ((result = (*ts->below->read)(ts->below, offset, block)) == 0) {
+		ts->read_miss++;
+		tier_put(ts, offset, block);
+	}
+	pthread_mutex_unlock(&ts->lock);
+	return result;
+}
+
+static int tiercache_write(block_store_t *this_bs, block_no offset, block_t *block){
+	struct tiercache_state *ts = this_bs->state;
+	block_no s;
+
+	pthread_mutex_lock(&ts->lock);
+	if ((*ts->below->write)(ts->below, offset, block) < 0) {
+		pthread_mutex_unlock(&ts->lock);
+		return -1;
+	}
+	if ((s = tier_lookup(&ts->disk, offset)) != NIL) {
+		tier_dirty(ts);
+		tier_remove(&ts->disk, s);
+		ts->write_hit++;
+	}
+	else if (tier_lookup(&ts->ram, offset) != NIL) {
+		ts->write_hit++;
+	}
+	else {
+		ts->write_miss++;
+	}
+	tier_put(ts, offset, block);
+	pthread_mutex_unlock(&ts->lock);
+	return 0;
+}
+
+static int tiercache_nblocks(block_store_t *this_bs){
+	struct tiercache_state *ts = this_bs->state;
+
+	return (*ts->below->nblocks)(ts->below);
+}
+
+/* Drop the cached blocks that are cut off.
+ */
+static int tiercache_setsize(block_store_t *this_bs, block_no nblocks){
+	struct tiercache_state *ts = this_bs->state;
+	block_no s;
+
+	pthread_mutex_lock(&ts->lock);
+	int result = (*ts->below->setsize)(ts->below, nblocks);
+	for (s = 0; s < ts->ram.nslots; s++) {
+		if (tier_lookup(&ts->ram, ts->ram.slots[s].offset) == s && ts->ram.slots[s].offset >= nblocks) {
+			tier_remove(&ts->ram, s);
+		}
+	}
+	for (s = 0; s < ts->disk.nslots; s++) {
+		if (tier_lookup(&ts->disk, ts->disk.slots[s].offset) == s && ts->disk.slots[s].offset >= nblocks) {
+			tier_dirty(ts);
+			tier_remove(&ts->disk, s);
+		}
+	}
+	if (result >= 0) {
+		ts->below_nblocks = nblocks;
+	}
+	pthread_mutex_unlock(&ts->lock);
+	return result;
+}
+
+/* Write the table of the second tier, most recently used first, and mark
+ * it clean.
+ */
+static int tier_save(struct tiercache_state *ts){
+	block_t block;
+	struct tier_entry *te = (struct tier_entry *) &block;
+	block_no s, n = 0;
+
+	memset(&block, 0, BLOCK_SIZE);
+	for (s = ts->disk.head; s != NIL; s = ts->disk.slots[s].next) {
+		te[n % TIER_PER_BLOCK].offset = ts->disk.slots[s].offset;
+		te[n % TIER_PER_BLOCK].frame = s;
+		if (++n % TIER_PER_BLOCK == 0 || ts->disk.slots[s].next == NIL) {
+			if ((*ts->fast->write)(ts->fast, 1 + (n - 1) / TIER_PER_BLOCK, &block) < 0) {
+				return -1;
+			}
+			memset(&block, 0, BLOCK_SIZE);
+		}
+	}
+	return tier_write_header(ts, 1, n);
+}
+
+/* Recover the table of the second tier if it was saved cleanly by a
+ * tiercache of the same geometry, on top of the same content of block 0.
+ */
+static void tier_load(struct tiercache_state *ts){
+	block_t header, block;
+	struct tier_header *th = (struct tier_header *) &header;
+	struct tier_entry *te = (struct tier_entry *) &block;
+	block_no i, n;
+	uint64_t sum;
+
+	if ((*ts->fast->read)(ts->fast, 0, &header) < 0 || th->magic != TIER_MAGIC ||
+				!th->clean || th->nframes != ts->disk.nslots ||
+				th->below_nblocks != ts->below_nblocks || th->nentries > th->nframes ||
+				tier_below_sum(ts, &sum) < 0 || th->below_sum != sum) {
+		return;
+	}
+
+	/* Insert the entries least recently used first, and then rebuild the
+	 * free list from the frames that are left.
+	 */
+	char *used = calloc(ts->disk.nslots, 1);
+	ts->disk.free = NIL;
+	n = th->nentries;
+	for (i = n; i > 0; i--) {
+		if ((i == n || i % TIER_PER_BLOCK == 0) &&
+				(*ts->fast->read)(ts->fast, 1 + (i - 1) / TIER_PER_BLOCK, &block) < 0) {
+			break;
+		}
+		struct tier_entry *e = &te[(i - 1) % TIER_PER_BLOCK];
+		if (e->frame < ts->disk.nslots && !used[e->frame] && e->offset < ts->below_nblocks &&
+					tier_lookup(&ts->disk, e->offset) == NIL) {
+			used[e->frame] = 1;
+			tier_insert(&ts->disk, e->frame, e->offset);
+			ts->recovered++;
+		}
+	}
+	for (i = ts->disk.nslots; i > 0; i--) {
+		if (!used[i - 1]) {
+			ts->disk.slots[i - 1].next = ts->disk.free;
+			ts->disk.free = i - 1;
+		}
+	}
+	free(used);
+}
+
+static void tiercache_destroy(block_store_t *this_bs){
+	struct tiercache_state *ts = this_bs->state;
+
+	/* Demote the RAM tier so it survives as well, least recently used
+	 * first so that the order is kept.
+	 */
+	while (ts->ram.tail != NIL) {
+		tier_demote(ts, ts->ram.tail);
+	}
+	if (ts->dirty && tier_save(ts) < 0) {
+		fprintf(stderr, "!!TIERCACHE: can't save the second tier\n");
+	}
+
+	tier_release(&ts->ram);
+	tier_release(&ts->disk);
+	pthread_mutex_destroy(&ts->lock);
+	free(ts);
+	free(this_bs);
+}
+
+void tiercache_reset(block_store_t *this_bs){
+	struct tiercache_state *ts = this_bs->state;
+
+	pthread_mutex_lock(&ts->lock);
+	while (ts->ram.tail != NIL) {
+		tier_remove(&ts->ram, ts->ram.tail);
+	}
+	if (ts->disk.tail != NIL) {
+		tier_dirty(ts);
+		while (ts->disk.tail != NIL) {
+			tier_remove(&ts->disk, ts->disk.tail);
+		}
+	}
+	ts->recovered = 0;
+	pthread_mutex_unlock(&ts->lock);
+}
+
+void tiercache_dump_stats(block_store_t *this_bs){
+	struct tiercache_state *ts = this_bs->state;
+	unsigned long nread = ts->ram_hit + ts->disk_hit + ts->read_miss;
+
+	printf("!$TIER: #ram hits:     %lu (%.1f%%)\n", ts->ram_hit,
+				nread == 0 ? 0 : 100.0 * ts->ram_hit / nread);
+	printf("!$TIER: #disk hits:    %lu (%.1f%% of RAM misses)\n", ts->disk_hit,
+				nread == ts->ram_hit ? 0 : 100.0 * ts->disk_hit / (nread - ts->ram_hit));
+	printf("!$TIER: #read misses:  %lu\n", ts->read_miss);
+	printf("!$TIER: #write hits:   %lu\n", ts->write_hit);
+	printf("!$TIER: #write misses: %lu\n", ts->write_miss);
+	printf("!$TIER: #demotions:    %lu\n", ts->demotions);
+	printf("!$TIER: #promotions:   %lu\n", ts->promotions);
+	printf("!$TIER: #recovered:    %lu\n", ts->recovered);
+}
+
+static void tiercache_stats(block_store_t *this_bs, block_stat_t emit, void *arg){
+	struct tiercache_state *ts = this_bs->state;
+
+	pthread_mutex_lock(&ts->lock);
+	unsigned long ram_hit = ts->ram_hit, disk_hit = ts->disk_hit, read_miss = ts->read_miss;
+	(*emit)(arg, "ram_hit", BLOCK_STAT_COUNTER, ram_hit);
+	(*emit)(arg, "disk_hit", BLOCK_STAT_COUNTER, disk_hit);
+	(*emit)(arg, "read_miss", BLOCK_STAT_COUNTER, read_miss);
+	(*emit)(arg, "write_hit", BLOCK_STAT_COUNTER, ts->write_hit);
+	(*emit)(arg, "write_miss", BLOCK_STAT_COUNTER, ts->write_miss);
+	(*emit)(arg, "demotions", BLOCK_STAT_COUNTER, ts->demotions);
+	(*emit)(arg, "promotions", BLOCK_STAT_COUNTER, ts->promotions);
+	(*emit)(arg, "recovered", BLOCK_STAT_GAUGE, ts->recovered);
+	(*emit)(arg, "ram_capacity", BLOCK_STAT_GAUGE, ts->ram.nslots);
+	(*emit)(arg, "ram_cached", BLOCK_STAT_GAUGE, ts->ram.nused);
+	(*emit)(arg, "disk_capacity", BLOCK_STAT_GAUGE, ts->disk.nslots);
+	(*emit)(arg, "disk_cached", BLOCK_STAT_GAUGE, ts->disk.nused);
+	pthread_mutex_unlock(&ts->lock);
+
+	unsigned long nread = ram_hit + disk_hit + read_miss;
+	(*emit)(arg, "ram_hit_ratio", BLOCK_STAT_GAUGE,
+				nread == 0 ? 0 : (double) ram_hit / nread);
+	(*emit)(arg, "disk_hit_ratio", BLOCK_STAT_GAUGE,
+				disk_hit + read_miss == 0 ? 0 : (double) disk_hit / (disk_hit + read_miss));
+}
+
+block_store_t *tiercache_init(block_store_t *below, block_store_t *fast,
+								block_t *blocks, block_no nblocks){
+	int size = (*fast->nblocks)(fast);
+	block_no nframes, table_blocks;
+
+	/* Find the largest number of frames that fits along with the header
+	 * and the table.
+	 */
+	if (size < 3 || nblocks == 0) {
+		fprintf(stderr, "tiercache_init: tiers too small\n");
+		return 0;
+	}
+	nframes = (block_no) (((uint64_t) size - 1) * TIER_PER_BLOCK / (TIER_PER_BLOCK + 1));
+	table_blocks = (nframes + TIER_PER_BLOCK - 1) / TIER_PER_BLOCK;
+	while (1 + table_blocks + nframes > (block_no) size) {
+		nframes--;
+		table_blocks = (nframes + TIER_PER_BLOCK - 1) / TIER_PER_BLOCK;
+	}
+
+	/* Create the block store state structure.
+	 */
+	struct tiercache_state *ts = calloc(1, sizeof(*ts));
+	ts->below = below;
+	ts->fast = fast;
+	ts->blocks = blocks;
+	ts->table_blocks = table_blocks;
+	ts->below_nblocks = (*below->nblocks)(below);
+	tier_create(&ts->ram, nblocks);
+	tier_create(&ts->disk, nframes);
+	pthread_mutex_init(&ts->lock, NULL);
+	tier_load(ts);
+
+	/* Return a block interface to this inode.
+	 */
+	block_store_t *this_bs = calloc(1, sizeof(*this_bs));
+	this_bs->state = ts;
+	this_bs->nblocks = tiercache_nblocks;
+	this_bs->setsize = tiercache_setsize;
+	this_bs->read = tiercache_read;
+	this_bs->write = tiercache_write;
+	this_bs->destroy = tiercache_destroy;
+	this_bs->name = "tiercache";
+	this_bs->below = below;
+	this_bs->stats = tiercache_stats;
+	return this_bs;
+}
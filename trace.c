@@ -11,65 +11,188 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <signal.h>
 #include <string.h>
 #include "block_store.h"
 
-#define DISK_SIZE		(16 * 1024)		// size of "physical" disk
+#define DISK_SIZE		(16 * 1024)		// default size of "physical" disk
 #define MAX_INODES		128
 
-static block_t blocks[DISK_SIZE];		// blocks for ram_disk
-
 static void sigalrm(int s){
 	fprintf(stderr, "test ran for too long\n");
 	exit(1);
 }
 
+static void usage(char *prog){
+	fprintf(stderr, "usage: %s [-g] [-d disk-size] [-q depth] [-j nthreads] [-p profile.csv] [-P policy] [--stats-json file] [--stack spec] [--quota inode:min:max] [--meta-reserve nblocks] [--dedup] [--cache-stats] [trace-file [cache-size]]\n", prog);
+	exit(1);
+}
+
 int main(int argc, char **argv){
+	unsigned int depth = 0;		// async operations in flight (0 = sync)
+	unsigned int nthreads = 0;	// replay threads (0 = replay in main thread)
+	block_no disk_size = DISK_SIZE;
+	int digest = 0;				// checkdisks keep digests only
+	char *stats_json = 0;		// where to dump the metrics of the stack
+	char *profile = 0;			// where to write the block profile
+	char *policy = "lru";		// cache replacement policy
+	char *spec = 0;				// layers of the stack (see stack.c)
+	char *prog = argv[0];
+	char *quotas[MAX_INODES];	// per-inode cache quotas
+	unsigned int nquotas = 0;
+	int cache_stats = 0;		// print the cachedisk stats
+	int meta_reserve = -1;		// cache blocks protected for meta-data
+	int dedup = 0;				// skip writes that change nothing
+	int c;
+
+	static struct option long_options[] = {
+		{ "stats-json", required_argument, 0, 'J' },
+		{ "stack", required_argument, 0, 'S' },
+		{ "quota", required_argument, 0, 'Q' },
+		{ "cache-stats", no_argument, 0, 'C' },
+		{ "meta-reserve", required_argument, 0, 'M' },
+		{ "dedup", no_argument, 0, 'D' },
+		{ 0, 0, 0, 0 }
+	};
+	while ((c = getopt_long(argc, argv, "gd:q:j:p:P:", long_options, 0)) != -1) {
+		switch (c) {
+		case 'J':
+			stats_json = optarg;
+			break;
+		case 'S':
+			spec = optarg;
+			break;
+		case 'Q':
+			if (nquotas == MAX_INODES) {
+				usage(prog);
+			}
+			quotas[nquotas++] = optarg;
+			cache_stats = 1;
+			break;
+		case 'C':
+			cache_stats = 1;
+			break;
+		case 'M':
+			meta_reserve = atoi(optarg);
+			cache_stats = 1;
+			break;
+		case 'D':
+			dedup = 1;
+			cache_stats = 1;
+			break;
+		case 'g':
+			digest = 1;
+			break;
+		case 'd':
+			disk_size = strtoul(optarg, 0, 0);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'p':
+			profile = optarg;
+			break;
+		case 'P':
+			policy = optarg;
+			break;
+		default:
+			usage(prog);
+		}
+	}
+	if (depth > 0 && nthreads > 0) {
+		fprintf(stderr, "%s: -q and -j cannot be combined\n", prog);
+		usage(prog);
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
 	char *trace = argc == 1 ? "trace.txt" : argv[1];
 	int cache_size = argc > 2 ? atoi(argv[2]) : 16;
 
 	printf("blocksize:  %u\n", BLOCK_SIZE);
 	printf("refs/block: %u\n", (unsigned int) (BLOCK_SIZE / sizeof(block_no)));
 
-	/* First create the lowest level "store".
+	/* Without --stack, the stack is a ramdisk that only takes up memory
+	 * for the blocks that are actually used, a statdisk to keep track of
+	 * statistics, optionally a profiledisk to see what the cache lets
+	 * through, a cache, and a checkdisk to make sure the cache works.
 	 */
-	block_store_t *disk;
-	disk = ramdisk_init(blocks, DISK_SIZE);
+	char default_spec[256];
+	if (spec == 0) {
+		snprintf(default_spec, sizeof(default_spec), "ram:%u|stat|%scache:%s:%d|%s:cache",
+					disk_size, profile == 0 ? "" : "prof|", policy, cache_size,
+					digest ? "digest" : "check");
+		spec = default_spec;
+	}
 
 	/* Start a timer to try to detect infinite loops or just insanely slow code.
 	 */
 	signal(SIGALRM, sigalrm);
 	alarm(5);
 
-	/* Virtualize the store, creating a collection of 64 virtual stores.
+	/* Build the stack and virtualize the store, creating a collection of
+	 * MAX_INODES virtual stores.
 	 */
-	if (treedisk_create(disk, MAX_INODES) < 0) {
-		panic("trace: can't create treedisk file system");
+	struct stack *st = stack_init(spec, MAX_INODES);
+	if (st == 0) {
+		usage(prog);
 	}
+	block_store_t *top = stack_top(st);
 
-	/* Add a disk to keep track of statistics.
-	 */
-	block_store_t *sdisk = statdisk_init(disk);
-
-	/* Add a layer of caching.
+	/* Configure the topmost cache.
 	 */
-	block_t *cache = malloc(cache_size * BLOCK_SIZE);
-	block_store_t *cdisk = cachedisk_init(sdisk, cache, cache_size);
+	block_store_t *cdisk = stack_find(st, "cachedisk");
+	unsigned int i;
+	for (i = 0; i < nquotas; i++) {
+		unsigned int inode, min, max;
+		if (cdisk == 0 || sscanf(quotas[i], "%u:%u:%u", &inode, &min, &max) != 3 ||
+						cachedisk_set_quota(cdisk, inode, min, max) < 0) {
+			usage(prog);
+		}
+	}
+	if (meta_reserve >= 0 && (cdisk == 0 || cachedisk_set_meta_reserve(cdisk, meta_reserve) < 0)) {
+		usage(prog);
+	}
+	if (dedup) {
+		if (cdisk == 0) {
+			usage(prog);
+		}
+		cachedisk_set_dedup(cdisk, 1);
+	}
 
-	/* Add a layer of checking to make sure the cache layer works.
+	/* Run a trace.
 	 */
-	block_store_t *xdisk = checkdisk_init(cdisk, "cache");
+	block_store_t *tdisk;
+	if (digest) {
+		tdisk = tracedisk_init_digest(top, trace, MAX_INODES, depth, nthreads);
+	}
+	else if (nthreads > 0) {
+		tdisk = tracedisk_init_parallel(top, trace, MAX_INODES, nthreads);
+	}
+	else {
+		tdisk = tracedisk_init_async(top, trace, MAX_INODES, depth);
+	}
+	if (nthreads > 0 || depth > 0) {
+		tracedisk_dump_stats(tdisk);
+	}
 
-	/* Run a trace.
+	/* Dump the metrics of the whole stack while it's still there.
 	 */
-	block_store_t *tdisk = tracedisk_init(xdisk, trace, MAX_INODES);
+	if (stats_json != 0) {
+		block_store_stats_json(tdisk, stats_json);
+	}
 
 	/* Clean up.
 	 */
 	(*tdisk->destroy)(tdisk);
-	(*xdisk->destroy)(xdisk);
-	(*cdisk->destroy)(cdisk);
+	block_store_t *pdisk = stack_find(st, "profiledisk");
+	if (profile != 0 && pdisk != 0) {
+		profiledisk_write_csv(pdisk, profile);
+	}
 
 	/* No longer running treedisk or cachedisk code.
 	 */
@@ -77,17 +200,31 @@ int main(int argc, char **argv){
 
 	/* Print stats.
 	 */
-	statdisk_dump_stats(sdisk);
+	block_store_t *sdisk = stack_find(st, "statdisk");
+	if (sdisk != 0) {
+		statdisk_dump_stats(sdisk);
+	}
+	if (cache_stats && cdisk != 0) {
+		cachedisk_dump_stats(cdisk);
+	}
+	block_store_t *tcache = stack_find(st, "tiercache");
+	if (tcache != 0) {
+		tiercache_dump_stats(tcache);
+	}
 
-	(*sdisk->destroy)(sdisk);
+	/* Get the deferred writes of the scheduler to the disk before checking it.
+	 */
+	block_store_t *sched = stack_find(st, "schedisk");
+	if (sched != 0) {
+		block_store_poll(sched, 1);
+		schedisk_dump_stats(sched);
+	}
 
 	/* Check that disk just one more time for good measure.
 	 */
-	treedisk_check(disk);
-
-	(*disk->destroy)(disk);
+	treedisk_check(stack_bottom(st));
 
-	free(cache);
+	stack_destroy(st);
 
 	return 0;
 }
@@ -18,39 +18,372 @@
  *			N:inode:nblocks		// nblocks(inode) == nblocks?
  *
  * with 0 <= inode < n_inodes and 0 <= block < MAX_BLOCKS, as defined here.
+ * The file may also be a binary trace (see "tracefile.h"), which is
+ * recognized by its magic number and replayed from a memory mapping.
+ *
+ *		block_store_t *tracedisk_init_async(block_store_t *below, char *trace,
+ *								unsigned int n_inodes, unsigned int depth);
+ *
+ * does the same, but uses the asynchronous block store interface to keep
+ * up to 'depth' reads and writes in flight.  Operations on the same inode
+ * are still carried out one at a time and in order, and S and N commands
+ * wait for everything in flight.  The checkdisk of each inode checks
+ * reads as they complete.
+ *
+ *		block_store_t *tracedisk_init_parallel(block_store_t *below, char *trace,
+ *								unsigned int n_inodes, unsigned int nthreads);
+ *
+ * replays the trace on 'nthreads' worker threads instead.  Commands are
+ * assigned to workers by inode number, so commands on the same inode are
+ * still carried out in order.  The layers below must be thread-safe.
+ *
+ *		block_store_t *tracedisk_init_digest(block_store_t *below, char *trace,
+ *								unsigned int n_inodes, unsigned int depth,
+ *								unsigned int nthreads);
+ *
+ * replays like one of the above (asynchronously if 'depth' is not 0, or
+ * on threads if 'nthreads' is not 0), but the checkdisk of each inode
+ * only keeps digests of the blocks (see checkdisk_init_digest) rather
+ * than copies, to save memory on long traces.  At most one of 'depth' and
+ * 'nthreads' may be set; otherwise it returns 0.
+ *
+ *		void tracedisk_dump_stats(block_store_t *this_bs);
+ *
+ * prints the number of commands replayed and the replay rate, and in
+ * asynchronous mode the largest number of operations that were in flight
+ * at once (operations that complete right away do not count).  Its stats
+ * method (see block_store.h) also reports the totals of the treedisk
+ * metrics over all virtual disks it opened.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
 #include "block_store.h"
+#include "tracefile.h"
 
 #define MAX_BLOCKS			(1 << 27)
 
+#define MAX_TREE_STATS		16
+
 struct tracedisk_state {
 	block_store_t *below;				// block store below
+	unsigned int ncmds;					// # commands replayed
+	unsigned int ninodes;				// # virtual disks opened
+	unsigned int depth;					// max # async operations in flight
+	unsigned int max_inflight;			// most async operations in flight
+	int digest;							// checkdisks keep digests only
+	double seconds;						// time it took
+
+	/* Stats of the virtual disks, summed over all inodes.
+	 */
+	struct {
+		char name[32];
+		int kind;
+		double value;
+	} tree_stats[MAX_TREE_STATS];
+	unsigned int n_tree_stats;
 };
 
 struct virtdisk {
 	block_store_t *treedisk;
 	block_store_t *checkdisk;
+	int busy;							// async operation in flight
 };
 
-static void tracedisk_run(struct tracedisk_state *ts,
-									char *trace, unsigned int n_inodes){
+/* Source of trace commands: either a text file, or the records of a
+ * memory-mapped binary trace.
+ */
+struct trace_reader {
 	FILE *fp;
+	void *map;
+	size_t maplen;
+	const struct trace_record *rec, *end;
+};
+
+static int trace_open(struct trace_reader *tr, char *trace){
+	struct stat st;
+	int fd;
+
+	memset(tr, 0, sizeof(*tr));
+	if ((fd = open(trace, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+
+	/* See if it is a binary trace.
+	 */
+	char magic[TRACE_MAGIC_SIZE];
+	if (st.st_size >= TRACE_MAGIC_SIZE &&
+			read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+			memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_SIZE) == 0) {
+		if (st.st_size < sizeof(struct trace_header)) {
+			fprintf(stderr, "%s: truncated trace header\n", trace);
+			close(fd);
+			return -1;
+		}
+		tr->maplen = st.st_size;
+		tr->map = mmap(0, tr->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (tr->map == MAP_FAILED) {
+			perror(trace);
+			return -1;
+		}
+		madvise(tr->map, tr->maplen, MADV_SEQUENTIAL);
+		const struct trace_header *th = tr->map;
+		size_t nrecs = (tr->maplen - sizeof(*th)) / sizeof(struct trace_record);
+		if (nrecs != th->ncmds) {
+			fprintf(stderr, "%s: %zu records, but the header says %u\n", trace, nrecs, th->ncmds);
+			munmap(tr->map, tr->maplen);
+			return -1;
+		}
+		tr->rec = (const struct trace_record *) (th + 1);
+		tr->end = tr->rec + nrecs;
+		return 0;
+	}
+
+	close(fd);
+	if ((tr->fp = fopen(trace, "r")) == 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Get the next command.  Returns 0 at the end of the trace.
+ */
+static int trace_next(struct trace_reader *tr, char *cmd, unsigned int *inode, unsigned int *bno){
+	if (tr->fp != 0) {
+		return fscanf(tr->fp, "%c:%u:%u\n", cmd, inode, bno) == 3;
+	}
+	if (tr->rec == tr->end) {
+		return 0;
+	}
+	*cmd = tr->rec->cmd;
+	*inode = tr->rec->inode;
+	*bno = tr->rec->block;
+	tr->rec++;
+	return 1;
+}
+
+static void trace_close(struct trace_reader *tr){
+	if (tr->fp != 0) {
+		fclose(tr->fp);
+	}
+	else {
+		munmap(tr->map, tr->maplen);
+	}
+}
+
+/* An asynchronous read or write in flight.
+ */
+struct trace_op {
+	struct virtdisk *vd;
+	unsigned int *inflight;
+	char cmd;							// 0 if slot is free
+	unsigned int inode, bno;
+	block_t block;
+};
+
+/* Check the header that 'W' commands put in each block.
+ */
+static void tracedisk_check_content(unsigned int inode, unsigned int bno, block_t *block){
+	if ((((unsigned int *) block)[0] != inode && ((unsigned int *) block)[0] != 0) || (((unsigned int *) block)[1] != bno && ((unsigned int *) block)[1] != 0)) {
+		fprintf(stderr, "!!ERROR: tracedisk_run: unexpected content %u %u %u %u\n", inode, bno, ((unsigned int *) block)[0], ((unsigned int *) block)[1]);
+	}
+}
+
+static void tracedisk_done(void *arg, int result){
+	struct trace_op *op = arg;
+
+	if (result < 0) {
+		fprintf(stderr, "!!ERROR: tracedisk_run: %s(%u, %u) failed\n",
+				op->cmd == 'R' ? "read" : "write", op->inode, op->bno);
+	}
+	else if (op->cmd == 'R') {
+		tracedisk_check_content(op->inode, op->bno, &op->block);
+	}
+	op->vd->busy = 0;
+	op->cmd = 0;						// back to free
+	(*op->inflight)--;
+}
+
+/* Carry out a command synchronously on the given virtual disk.  'cnt' is
+ * the command number, for error messages.
+ */
+static void tracedisk_exec(block_store_t *virt, char cmd, unsigned int inode,
+									unsigned int bno, unsigned int cnt){
+	block_t block;
+	int result;
+
+	switch (cmd) {
+	case 'R':
+		result = (*virt->read)(virt, bno, &block);
+		if (result < 0) {
+			fprintf(stderr, "!!ERROR: tracedisk_run: read(%u, %u) failed\n", inode, bno);
+			break;
+		}
+		tracedisk_check_content(inode, bno, &block);
+		break;
+	case 'W':
+		memset(&block, 0, sizeof(block));
+		((unsigned int *) &block)[0] = inode;
+		((unsigned int *) &block)[1] = bno;
+		result = (*virt->write)(virt, bno, &block);
+		if (result < 0) {
+			fprintf(stderr, "!!ERROR: tracedisk_run: write(%u, %u) failed\n", inode, bno);
+			break;
+		}
+		break;
+	case 'S':
+		result = (*virt->setsize)(virt, bno);
+		if (result < 0) {
+			fprintf(stderr, "!!ERROR: tracedisk_run: setsize(%u, %u) failed\n", inode, bno);
+			break;
+		}
+		break;
+	case 'N':
+		result = (*virt->nblocks)(virt);
+		if (result != bno) {
+			fprintf(stderr, "!!CHKSIZE %u: nblocks %u: %u != %d\n", cnt, (unsigned int) inode, (unsigned int) bno, result);
+		}
+		break;
+	default:
+		fprintf(stderr, "tracedisk_run: unexpected command\n");
+	}
+}
+
+/* Open the virtual disk for the given inode if not done yet.
+ */
+static void tracedisk_open(struct tracedisk_state *ts, struct virtdisk *vd, unsigned int inode){
+	if (vd->treedisk == 0) {
+		vd->treedisk = treedisk_init(ts->below, inode);
+		vd->checkdisk = ts->digest ? checkdisk_init_digest(vd->treedisk, "tre") :
+									checkdisk_init(vd->treedisk, "tre");
+	}
+}
+
+/* In parallel mode, commands are sharded by inode number over a pool of
+ * worker threads.  Each worker gets its commands in trace order through a
+ * bounded queue, so the order per inode is kept.
+ */
+#define WORKER_QUEUE	1024			// # commands queued per worker
+#define WORKER_BATCH	64				// # commands dequeued at once
+
+struct trace_cmd {
+	char cmd;
+	unsigned int inode, bno, cnt;
+};
+
+struct trace_worker {
+	pthread_t tid;
+	struct tracedisk_state *ts;
+	struct virtdisk *inodes;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;				// queue changed
+	struct trace_cmd queue[WORKER_QUEUE];
+	unsigned int head, tail;			// tail - head = # queued
+	int done;							// no more commands will come
+};
+
+static void *tracedisk_worker(void *arg){
+	struct trace_worker *tw = arg;
+	struct trace_cmd batch[WORKER_BATCH];
+
+	for (;;) {
+		pthread_mutex_lock(&tw->lock);
+		while (tw->head == tw->tail && !tw->done) {
+			pthread_cond_wait(&tw->cond, &tw->lock);
+		}
+		unsigned int n = 0;
+		while (tw->head != tw->tail && n < WORKER_BATCH) {
+			batch[n++] = tw->queue[tw->head++ % WORKER_QUEUE];
+		}
+		pthread_cond_broadcast(&tw->cond);
+		pthread_mutex_unlock(&tw->lock);
+		if (n == 0) {
+			return 0;
+		}
+
+		unsigned int i;
+		for (i = 0; i < n; i++) {
+			struct trace_cmd *tc = &batch[i];
+			struct virtdisk *vd = &tw->inodes[tc->inode];
+			tracedisk_open(tw->ts, vd, tc->inode);
+			tracedisk_exec(vd->checkdisk, tc->cmd, tc->inode, tc->bno, tc->cnt);
+		}
+	}
+}
+
+static void tracedisk_dispatch(struct trace_worker *tw, struct trace_cmd *tc){
+	pthread_mutex_lock(&tw->lock);
+	while (tw->tail - tw->head == WORKER_QUEUE) {
+		pthread_cond_wait(&tw->cond, &tw->lock);
+	}
+	tw->queue[tw->tail++ % WORKER_QUEUE] = *tc;
+	pthread_cond_broadcast(&tw->cond);
+	pthread_mutex_unlock(&tw->lock);
+}
+
+/* Add a metric of a virtual disk to the totals.
+ */
+static void tracedisk_sum_stat(void *arg, char *name, int kind, double value){
+	struct tracedisk_state *ts = arg;
+	unsigned int i;
+
+	for (i = 0; i < ts->n_tree_stats; i++) {
+		if (strcmp(ts->tree_stats[i].name, name) == 0) {
+			ts->tree_stats[i].value += value;
+			return;
+		}
+	}
+	if (i < MAX_TREE_STATS) {
+		snprintf(ts->tree_stats[i].name, sizeof(ts->tree_stats[i].name), "%s", name);
+		ts->tree_stats[i].kind = kind;
+		ts->tree_stats[i].value = value;
+		ts->n_tree_stats++;
+	}
+}
+
+static void tracedisk_run(struct tracedisk_state *ts, char *trace, unsigned int n_inodes,
+								unsigned int depth, unsigned int nthreads){
+	struct trace_reader tr;
 	struct virtdisk *inodes = calloc(n_inodes, sizeof(*inodes));
 	block_store_t *virt;
 	unsigned int cnt = 1;
+	struct trace_op *ops = depth == 0 ? 0 : calloc(depth, sizeof(*ops));
+	unsigned int inflight = 0;
+	struct trace_worker *workers = nthreads == 0 ? 0 : calloc(nthreads, sizeof(*workers));
+	struct timespec start, finish;
+	unsigned int i;
 
-	if ((fp = fopen(trace, "r")) == 0) {
+	if (trace_open(&tr, trace) < 0) {
 		fprintf(stderr, "tracedisk_run: can't open %s\n", trace);
 		return;
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nthreads; i++) {
+		struct trace_worker *tw = &workers[i];
+		tw->ts = ts;
+		tw->inodes = inodes;
+		pthread_mutex_init(&tw->lock, 0);
+		pthread_cond_init(&tw->cond, 0);
+		if (pthread_create(&tw->tid, 0, tracedisk_worker, tw) != 0) {
+			panic("tracedisk_run: pthread_create");
+		}
+	}
+
 	char cmd;
 	unsigned int inode, bno;
-	while (fscanf(fp, "%c:%u:%u\n", &cmd, &inode, &bno) == 3) {
+	while (trace_next(&tr, &cmd, &inode, &bno)) {
 		if (inode >= n_inodes) {
 			fprintf(stderr, "inode number too large\n");
 			break;
@@ -59,54 +392,90 @@ static void tracedisk_run(struct tracedisk_state *ts,
 			fprintf(stderr, "block number too large\n");
 			break;
 		}
-		if (inodes[inode].treedisk == 0) {
-			inodes[inode].treedisk = treedisk_init(ts->below, inode);
-			inodes[inode].checkdisk = checkdisk_init(inodes[inode].treedisk, "tre");
+
+		/* In parallel mode, hand it to the worker for this inode.
+		 */
+		if (nthreads > 0) {
+			struct trace_cmd tc = { cmd, inode, bno, cnt };
+			tracedisk_dispatch(&workers[inode % nthreads], &tc);
+			cnt++;
+			continue;
 		}
+
+		tracedisk_open(ts, &inodes[inode], inode);
 		virt = inodes[inode].checkdisk;
-		static block_t block;
 		int result;
-		switch (cmd) {
-		case 'R':
-			result = (*virt->read)(virt, bno, &block);
-			if (result < 0) {
-				fprintf(stderr, "!!ERROR: tracedisk_run: read(%u, %u) failed\n", inode, bno);
-				break;
+
+		/* In asynchronous mode, wait for an earlier operation on this
+		 * inode and for a free slot.  Setsize and nblocks wait for all.
+		 */
+		if (depth > 0) {
+			while (inodes[inode].busy || inflight == depth ||
+						(inflight > 0 && cmd != 'R' && cmd != 'W')) {
+				block_store_poll(virt, 1);
 			}
-			if ((((unsigned int *) &block)[0] != inode && ((unsigned int *) &block)[0] != 0) || (((unsigned int *) &block)[1] != bno && ((unsigned int *) &block)[1] != 0)) {
-				fprintf(stderr, "!!ERROR: tracedisk_run: unexpected content %u %u %u %u\n", inode, bno, ((unsigned int *) &block)[0], ((unsigned int *) &block)[1]);
+		}
+		if (depth > 0 && (cmd == 'R' || cmd == 'W')) {
+			struct trace_op *op = ops;
+			while (op->cmd != 0) {
+				op++;
 			}
-			break;
-		case 'W':
-			((unsigned int *) &block)[0] = inode;
-			((unsigned int *) &block)[1] = bno;
-			result = (*virt->write)(virt, bno, &block);
-			if (result < 0) {
-				fprintf(stderr, "!!ERROR: tracedisk_run: write(%u, %u) failed\n", inode, bno);
-				break;
+			op->vd = &inodes[inode];
+			op->inflight = &inflight;
+			op->cmd = cmd;
+			op->inode = inode;
+			op->bno = bno;
+			op->vd->busy = 1;
+			inflight++;
+			if (cmd == 'R') {
+				result = block_store_read_async(virt, bno, &op->block, tracedisk_done, op);
+			}
+			else {
+				((unsigned int *) &op->block)[0] = inode;
+				((unsigned int *) &op->block)[1] = bno;
+				result = block_store_write_async(virt, bno, &op->block, tracedisk_done, op);
 			}
-			break;
-		case 'S':
-			result = (*virt->setsize)(virt, bno);
 			if (result < 0) {
-				fprintf(stderr, "!!ERROR: tracedisk_run: setsize(%u, %u) failed\n", inode, bno);
-				break;
+				tracedisk_done(op, result);
 			}
-			break;
-		case 'N':
-			result = (*virt->nblocks)(virt);
-			if (result != bno) {
-				fprintf(stderr, "!!CHKSIZE %u: nblocks %u: %u != %d\n", cnt, (unsigned int) inode, (unsigned int) bno, result);
+			if (inflight > ts->max_inflight) {
+				ts->max_inflight = inflight;
 			}
-			break;
-		default:
-			fprintf(stderr, "tracedisk_run: unexpected command\n");
+			cnt++;
+			continue;
 		}
+
+		tracedisk_exec(virt, cmd, inode, bno, cnt);
 		cnt++;
 	}
 
-	fclose(fp);
+	trace_close(&tr);
+	while (inflight > 0) {
+		block_store_poll(ts->below, 1);
+	}
+	for (i = 0; i < nthreads; i++) {
+		struct trace_worker *tw = &workers[i];
+		pthread_mutex_lock(&tw->lock);
+		tw->done = 1;
+		pthread_cond_broadcast(&tw->cond);
+		pthread_mutex_unlock(&tw->lock);
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].tid, 0);
+		pthread_mutex_destroy(&workers[i].lock);
+		pthread_cond_destroy(&workers[i].cond);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	ts->ncmds = cnt - 1;
+	ts->seconds = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+
+	free(workers);
+	free(ops);
 	for (inode = 0; inode < n_inodes; inode++) {
+		if ((virt = inodes[inode].treedisk) != 0 && virt->stats != 0) {
+			ts->ninodes++;
+			(*virt->stats)(virt, tracedisk_sum_stat, ts);
+		}
 		if ((virt = inodes[inode].checkdisk) != 0) {
 			(*virt->destroy)(virt);
 		}
@@ -124,18 +493,79 @@ static void tracedisk_destroy(block_store_t *this_bs){
 	free(this_bs);
 }
 
-block_store_t *tracedisk_init(block_store_t *below, char *trace, unsigned int n_inodes){
+/* Besides its own metrics, reports those of the virtual disks it opened
+ * (summed), with a "treedisk_" prefix.
+ */
+static void tracedisk_stats(block_store_t *this_bs, block_stat_t emit, void *arg){
+	struct tracedisk_state *ts = this_bs->state;
+	char name[64];
+	unsigned int i;
+
+	(*emit)(arg, "commands", BLOCK_STAT_COUNTER, ts->ncmds);
+	(*emit)(arg, "inodes", BLOCK_STAT_GAUGE, ts->ninodes);
+	if (ts->depth > 0) {
+		(*emit)(arg, "max_inflight", BLOCK_STAT_GAUGE, ts->max_inflight);
+	}
+	(*emit)(arg, "seconds", BLOCK_STAT_GAUGE, ts->seconds);
+	(*emit)(arg, "ops_per_sec", BLOCK_STAT_GAUGE, ts->seconds > 0 ? ts->ncmds / ts->seconds : 0);
+	for (i = 0; i < ts->n_tree_stats; i++) {
+		snprintf(name, sizeof(name), "treedisk_%s", ts->tree_stats[i].name);
+		(*emit)(arg, name, ts->tree_stats[i].kind, ts->tree_stats[i].value);
+	}
+}
+
+void tracedisk_dump_stats(block_store_t *this_bs){
+	struct tracedisk_state *ts = this_bs->state;
+
+	printf("!$TRACE: #commands: %u\n", ts->ncmds);
+	printf("!$TRACE: seconds:   %.3f\n", ts->seconds);
+	printf("!$TRACE: ops/sec:   %.0f\n", ts->seconds > 0 ? ts->ncmds / ts->seconds : 0);
+	if (ts->depth > 0) {
+		printf("!$TRACE: in flight: %u (depth %u)\n", ts->max_inflight, ts->depth);
+	}
+}
+
+static block_store_t *tracedisk_create(block_store_t *below, char *trace,
+			unsigned int n_inodes, unsigned int depth, unsigned int nthreads, int digest){
 	/* Create the block store state structure.
 	 */
 	struct tracedisk_state *ts = calloc(1, sizeof(*ts));
 	ts->below = below;
+	ts->depth = depth;
+	ts->digest = digest;
 
-	tracedisk_run(ts, trace, n_inodes);
+	tracedisk_run(ts, trace, n_inodes, depth, nthreads);
 
 	/* Return a block interface to this inode.
 	 */
 	block_store_t *this_bs = calloc(1, sizeof(*this_bs));
 	this_bs->state = ts;
 	this_bs->destroy = tracedisk_destroy;
+	this_bs->name = "tracedisk";
+	this_bs->below = below;
+	this_bs->stats = tracedisk_stats;
 	return this_bs;
 }
+
+block_store_t *tracedisk_init(block_store_t *below, char *trace, unsigned int n_inodes){
+	return tracedisk_create(below, trace, n_inodes, 0, 0, 0);
+}
+
+block_store_t *tracedisk_init_async(block_store_t *below, char *trace,
+								unsigned int n_inodes, unsigned int depth){
+	return tracedisk_create(below, trace, n_inodes, depth, 0, 0);
+}
+
+block_store_t *tracedisk_init_parallel(block_store_t *below, char *trace,
+								unsigned int n_inodes, unsigned int nthreads){
+	return tracedisk_create(below, trace, n_inodes, 0, nthreads, 0);
+}
+
+block_store_t *tracedisk_init_digest(block_store_t *below, char *trace,
+					unsigned int n_inodes, unsigned int depth, unsigned int nthreads){
+	if (depth > 0 && nthreads > 0) {
+		fprintf(stderr, "tracedisk_init_digest: depth and nthreads cannot both be set\n");
+		return 0;
+	}
+	return tracedisk_create(below, trace, n_inodes, depth, nthreads, 1);
+}
@@ -0,0 +1,40 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* This file describes the binary trace format.  A text trace (see
+ * tracedisk.c) can be converted with "chktrace -b out.bin trace.txt".
+ * tracedisk recognizes a binary trace by its magic number and replays it
+ * directly from a memory mapping, so that no parsing is needed.
+ *
+ * The file starts with a header, followed by 'ncmds' records of exactly
+ * 12 bytes each.  All fields are in host byte order.  As 'ncmds' has 32
+ * bits, a binary trace holds at most TRACE_MAX_CMDS records, and a file
+ * with more records than its header says is rejected.
+ */
+
+#include <stdint.h>
+
+#define TRACE_MAGIC			"BSTRACE1"
+#define TRACE_MAGIC_SIZE	8
+#define TRACE_MAX_CMDS		UINT32_MAX
+
+struct trace_header {
+	char magic[TRACE_MAGIC_SIZE];	// TRACE_MAGIC
+	uint32_t ncmds;					// # records following the header
+	uint32_t nread;					// # 'R' records
+	uint32_t nwrite;				// # 'W' records
+	uint32_t nsetsize;				// # 'S' records
+	uint32_t max_inode;				// largest inode number used
+	uint32_t max_block;				// largest block number used
+};
+
+/* One command: 'R', 'W', 'S', or 'N', as in the text format.
+ */
+struct trace_record {
+	uint8_t cmd;
+	uint8_t pad[3];
+	uint32_t inode;
+	uint32_t block;
+};
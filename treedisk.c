@@ -19,12 +19,18 @@
  *      block_store_t *treedisk_init(block_store_t *below, unsigned int inode_no)
  *          Opens a virtual block store at the given inode number.
  *
+ * All I/O that a virtual block store does below is tagged with its inode
+ * number as the owner (see block_store_set_owner), so that a cache below
+ * can tell the files apart, and all I/O other than that of data blocks is
+ * tagged as meta-data (see block_store_set_class).
+ *
  * The layout of the file system is described in the file "treedisk.h".
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "block_store.h"
 #include "treedisk.h"
 
@@ -38,16 +44,107 @@ struct treedisk_snapshot {
     struct treedisk_inode *inode;
 };
 
+/* A file system that has virtual block stores open, identified by the
+ * block store below.  See treedisk_fs_get().
+ */
+struct treedisk_fs {
+    block_store_t *below;
+    pthread_mutex_t lock;           // serializes meta-data updates
+    unsigned int refs;              // # virtual block stores open
+    struct treedisk_fs *next;
+};
+
 /* The state of a virtual block store, which is identified by an inode number.
  */
 struct treedisk_state {
     block_store_t *below;           // block store below
     unsigned int inode_no;  // inode number in file system
+    struct treedisk_fs *fs;         // file system it is part of
+
+    /* Stats.
+     */
+    unsigned long nread, nwrite, nsetsize;
+    unsigned long nalloc, nfree;    // blocks taken from and put on free list
 };
 
 static unsigned int log_rpb;        // log2(REFS_PER_BLOCK)
 static block_t null_block;          // a block filled with null bytes
 
+/* Virtual block stores may be used from different threads.  Changes to
+ * the shared meta-data of a file system (superblock, free list, and inode
+ * blocks, which hold the inodes of several virtual stores) are serialized
+ * by the lock of its treedisk_fs, so that separate file systems do not
+ * wait for each other.  Reading does not need it, as long as each virtual
+ * block store is only used by one thread at a time: of the shared blocks,
+ * a read only looks at n_inodeblocks in the superblock, which never
+ * changes, and at its own inode in an inode block, of which the writers
+ * of other inodes leave the bytes as they are.
+ */
+static pthread_mutex_t treedisk_fs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct treedisk_fs *treedisk_fs_list;     // protected by treedisk_fs_lock
+static pthread_once_t treedisk_once = PTHREAD_ONCE_INIT;
+
+/* Find the file system on 'below', or add it, and take a reference.
+ */
+static struct treedisk_fs *treedisk_fs_get(block_store_t *below){
+    struct treedisk_fs *fs;
+
+    pthread_mutex_lock(&treedisk_fs_lock);
+    for (fs = treedisk_fs_list; fs != 0; fs = fs->next) {
+        if (fs->below == below) {
+            break;
+        }
+    }
+    if (fs == 0) {
+        fs = calloc(1, sizeof(*fs));
+        fs->below = below;
+        pthread_mutex_init(&fs->lock, 0);
+        fs->next = treedisk_fs_list;
+        treedisk_fs_list = fs;
+    }
+    fs->refs++;
+    pthread_mutex_unlock(&treedisk_fs_lock);
+    return fs;
+}
+
+/* Drop a reference, and the file system with the last one.
+ */
+static void treedisk_fs_put(struct treedisk_fs *fs){
+    struct treedisk_fs **pfs;
+
+    pthread_mutex_lock(&treedisk_fs_lock);
+    if (--fs->refs == 0) {
+        pfs = &treedisk_fs_list;
+        while (*pfs != fs) {
+            pfs = &(*pfs)->next;
+        }
+        *pfs = fs->next;
+        pthread_mutex_destroy(&fs->lock);
+        free(fs);
+    }
+    pthread_mutex_unlock(&treedisk_fs_lock);
+}
+
+/* The hints for the layers below that were in effect before an operation.
+ */
+struct treedisk_hint {
+    unsigned int owner;
+    int cls;
+};
+
+/* Tag the I/O below as meta-data of the inode of 'ts' until the previous
+ * hints are restored.
+ */
+static void treedisk_hint_set(struct treedisk_state *ts, struct treedisk_hint *prev){
+    prev->owner = block_store_set_owner(ts->inode_no);
+    prev->cls = block_store_set_class(BLOCK_CLASS_META);
+}
+
+static void treedisk_hint_restore(struct treedisk_hint *prev){
+    block_store_set_owner(prev->owner);
+    block_store_set_class(prev->cls);
+}
+
 /* Stupid ANSI C compiler leaves shifting by #bits in unsigned int or more
  * undefined, but the result should clearly be 0...
  */
@@ -137,16 +234,18 @@ static block_no treedisk_alloc_block(block_store_t *below, struct treedisk_snaps
 static int treedisk_nblocks(block_store_t *this_bs){
     struct treedisk_state *ts = this_bs->state;
 
+    struct treedisk_hint hint;
+    treedisk_hint_set(ts, &hint);
     struct treedisk_snapshot snapshot;
-    if (treedisk_get_snapshot(&snapshot, ts->below, ts->inode_no) < 0) {
-        return -1;
-    }
-    return snapshot.inode->nblocks;
+    int result = treedisk_get_snapshot(&snapshot, ts->below, ts->inode_no);
+    treedisk_hint_restore(&hint);
+    return result < 0 ? -1 : snapshot.inode->nblocks;
 }
 
 static int add_free_list(struct treedisk_snapshot *snapshot, struct treedisk_state *ts, block_no b_no) {
     struct treedisk_freelistblock flblk;
     block_no free_no;
+    ts->nfree++;
     // no freelist
     if ((free_no = snapshot->superblock.superblock.free_list) == 0) {
         memset(&flblk, 0, BLOCK_SIZE);
@@ -217,9 +316,7 @@ static int walk_down_tree(struct treedisk_snapshot *snapshot, struct treedisk_st
 
 /* Set the size of the file 'this_bs' to 'nblocks'.
  */
-static int treedisk_setsize(block_store_t *this_bs, block_no nblocks){
-    struct treedisk_state *ts = this_bs->state;
-
+static int treedisk_do_setsize(struct treedisk_state *ts, block_no nblocks){
     struct treedisk_snapshot snapshot;
     treedisk_get_snapshot(&snapshot, ts->below, ts->inode_no);
     if (nblocks == snapshot.inode->nblocks) {
@@ -257,11 +354,22 @@ static int treedisk_setsize(block_store_t *this_bs, block_no nblocks){
     return 0;
 }
 
-/* Read a block at the given block number 'offset' and return in *block.
- */
-static int treedisk_read(block_store_t *this_bs, block_no offset, block_t *block){
+static int treedisk_setsize(block_store_t *this_bs, block_no nblocks){
     struct treedisk_state *ts = this_bs->state;
 
+    ts->nsetsize++;
+    struct treedisk_hint hint;
+    treedisk_hint_set(ts, &hint);
+    pthread_mutex_lock(&ts->fs->lock);
+    int result = treedisk_do_setsize(ts, nblocks);
+    pthread_mutex_unlock(&ts->fs->lock);
+    treedisk_hint_restore(&hint);
+    return result;
+}
+
+/* Read a block at the given block number 'offset' and return in *block.
+ */
+static int treedisk_do_read(struct treedisk_state *ts, block_no offset, block_t *block){
     /* Get info from underlying file system.
      */
     struct treedisk_snapshot snapshot;
@@ -296,31 +404,47 @@ static int treedisk_read(block_store_t *this_bs, block_no offset, block_t *block
             return 0;
         }
 
-        /* Return the next level.  If the last level, we're done.
+        /* If the last level, read the block and we're done.
          */
-        int result = (*ts->below->read)(ts->below, b, block);
-        if (result < 0) {
-            return result;
-        }
         if (nlevels == 0) {
-            return 0;
+            block_store_set_class(BLOCK_CLASS_DATA);
+            return (*ts->below->read)(ts->below, b, block);
         }
 
-        /* The block is an indirect block.  Figure out the index into this
-         * block and get the block number.
+        /* The block is an indirect block, of which only one reference is
+         * needed, so borrow it (if the layer below can lend it out) rather
+         * than copy it.  Figure out the index into this block and get the
+         * block number.
          */
+        const block_t *ib = block_store_borrow(ts->below, b, block);
+        if (ib == 0) {
+            return -1;
+        }
         nlevels--;
-        struct treedisk_indirblock *tib = (struct treedisk_indirblock *) block;
+        const struct treedisk_indirblock *tib = (const struct treedisk_indirblock *) ib;
         unsigned int index = log_shift_r(offset, nlevels * log_rpb) % REFS_PER_BLOCK;
         b = tib->refs[index];
+        block_store_release(ts->below, ib);
     }
     return 0;
 }
 
-/* Write *block at the given block number 'offset'.
- */
-static int treedisk_write(block_store_t *this_bs, block_no offset, block_t *block){
+static int treedisk_read(block_store_t *this_bs, block_no offset, block_t *block){
     struct treedisk_state *ts = this_bs->state;
+
+    ts->nread++;
+    struct treedisk_hint hint;
+    treedisk_hint_set(ts, &hint);
+    int result = treedisk_do_read(ts, offset, block);
+    treedisk_hint_restore(&hint);
+    return result;
+}
+
+/* Find the block number in the underlying store where the block at 'offset'
+ * lives, growing the tree and allocating blocks as necessary.  All the
+ * meta-data is updated; only the data block itself remains to be written.
+ */
+static int treedisk_do_locate(struct treedisk_state *ts, block_no offset, block_no *result){
     int dirty_inode = 0;
 
     /* Get info from underlying file system.
@@ -363,6 +487,7 @@ static int treedisk_write(block_store_t *this_bs, block_no offset, block_t *bloc
     else if (nlevels_after > nlevels) {
         while (nlevels_after > nlevels) {
             block_no indir = treedisk_alloc_block(ts->below, &snapshot);
+            ts->nalloc++;
 
             /* Insert the new indirect block into the inode.
              */
@@ -400,6 +525,7 @@ static int treedisk_write(block_store_t *this_bs, block_no offset, block_t *bloc
         struct treedisk_indirblock tib;
         if ((b = *parent_no) == 0) {
             b = *parent_no = treedisk_alloc_block(ts->below, &snapshot);
+            ts->nalloc++;
             if ((*ts->below->write)(ts->below, parent_off, parent_block) < 0) {
                 panic("treedisk_write: parent");
             }
@@ -425,27 +551,211 @@ static int treedisk_write(block_store_t *this_bs, block_no offset, block_t *bloc
         parent_block = (block_t *) &tib;
         parent_off = b;
     }
-    if ((*ts->below->write)(ts->below, b, block) < 0) {
+    *result = b;
+    return 0;
+}
+
+static int treedisk_locate(struct treedisk_state *ts, block_no offset, block_no *result){
+    pthread_mutex_lock(&ts->fs->lock);
+    int r = treedisk_do_locate(ts, offset, result);
+    pthread_mutex_unlock(&ts->fs->lock);
+    return r;
+}
+
+/* Write *block at the given block number 'offset'.
+ */
+static int treedisk_write(block_store_t *this_bs, block_no offset, block_t *block){
+    struct treedisk_state *ts = this_bs->state;
+
+    ts->nwrite++;
+    struct treedisk_hint hint;
+    treedisk_hint_set(ts, &hint);
+    block_no b;
+    int result = treedisk_locate(ts, offset, &b);
+    block_store_set_class(BLOCK_CLASS_DATA);
+    if (result == 0 && (*ts->below->write)(ts->below, b, block) < 0) {
         panic("treedisk_write: data block");
     }
-    return 0;
+    treedisk_hint_restore(&hint);
+    return result;
+}
+
+/* State of an asynchronous read as it walks down the tree.  Each step
+ * issues one read below and continues in treedisk_read_step() once it
+ * completes.
+ */
+struct treedisk_read_op {
+    struct treedisk_state *ts;
+    block_no offset;
+    block_t *block;                 // caller's block
+    block_done_t done;
+    void *arg;
+    enum { TR_SUPER, TR_INODE, TR_TREE } stage;
+    unsigned int nlevels;           // levels left below the current block
+    struct treedisk_snapshot snapshot;
+};
+
+static void treedisk_read_finish(struct treedisk_read_op *op, int result){
+    (*op->done)(op->arg, result);
+    free(op);
+}
+
+/* Issue the read of block 'b' of the tree, or finish if it's a hole.
+ */
+static void treedisk_read_block(struct treedisk_read_op *op, block_no b);
+static void treedisk_read_step(void *arg, int result);
+
+static void treedisk_do_read_step(struct treedisk_read_op *op, int result){
+    struct treedisk_state *ts = op->ts;
+
+    if (result < 0) {
+        treedisk_read_finish(op, result);
+        return;
+    }
+    switch (op->stage) {
+    case TR_SUPER:
+        if (ts->inode_no >= op->snapshot.superblock.superblock.n_inodeblocks * INODES_PER_BLOCK) {
+            fprintf(stderr, "!!TDERR: inode number too large %u %u\n", ts->inode_no, op->snapshot.superblock.superblock.n_inodeblocks);
+            treedisk_read_finish(op, -1);
+            return;
+        }
+        op->stage = TR_INODE;
+        op->snapshot.inode_blockno = 1 + ts->inode_no / INODES_PER_BLOCK;
+        if (block_store_read_async(ts->below, op->snapshot.inode_blockno,
+                    (block_t *) &op->snapshot.inodeblock, treedisk_read_step, op) < 0) {
+            treedisk_read_finish(op, -1);
+        }
+        return;
+    case TR_INODE:
+        op->snapshot.inode = &op->snapshot.inodeblock.inodeblock.inodes[ts->inode_no % INODES_PER_BLOCK];
+        if (op->offset >= op->snapshot.inode->nblocks) {
+            fprintf(stderr, "!!TDERR: offset too large\n");
+            treedisk_read_finish(op, -1);
+            return;
+        }
+        op->nlevels = 0;
+        while (log_shift_r(op->snapshot.inode->nblocks - 1, op->nlevels * log_rpb) != 0) {
+            op->nlevels++;
+        }
+        op->stage = TR_TREE;
+        treedisk_read_block(op, op->snapshot.inode->root);
+        return;
+    case TR_TREE:
+        if (op->nlevels == 0) {
+            treedisk_read_finish(op, 0);
+            return;
+        }
+        op->nlevels--;
+        struct treedisk_indirblock *tib = (struct treedisk_indirblock *) op->block;
+        unsigned int index = log_shift_r(op->offset, op->nlevels * log_rpb) % REFS_PER_BLOCK;
+        treedisk_read_block(op, tib->refs[index]);
+        return;
+    }
+}
+
+/* Completions may run in any thread, so the owner is set again.
+ */
+static void treedisk_read_step(void *arg, int result){
+    struct treedisk_read_op *op = arg;
+
+    struct treedisk_hint hint;
+    treedisk_hint_set(op->ts, &hint);
+    treedisk_do_read_step(op, result);
+    treedisk_hint_restore(&hint);
+}
+
+static void treedisk_read_block(struct treedisk_read_op *op, block_no b){
+    if (b == 0) {
+        memset(op->block, 0, BLOCK_SIZE);
+        treedisk_read_finish(op, 0);
+        return;
+    }
+    block_store_set_class(op->nlevels == 0 ? BLOCK_CLASS_DATA : BLOCK_CLASS_META);
+    if (block_store_read_async(op->ts->below, b, op->block, treedisk_read_step, op) < 0) {
+        treedisk_read_finish(op, -1);
+    }
+}
+
+static int treedisk_read_async(block_store_t *this_bs, block_no offset, block_t *block,
+                                            block_done_t done, void *arg){
+    struct treedisk_state *ts = this_bs->state;
+
+    ts->nread++;
+    struct treedisk_read_op *op = calloc(1, sizeof(*op));
+    op->ts = ts;
+    op->offset = offset;
+    op->block = block;
+    op->done = done;
+    op->arg = arg;
+    op->stage = TR_SUPER;
+    struct treedisk_hint hint;
+    treedisk_hint_set(ts, &hint);
+    int result = block_store_read_async(ts->below, 0, (block_t *) &op->snapshot.superblock,
+                                            treedisk_read_step, op);
+    treedisk_hint_restore(&hint);
+    if (result < 0) {
+        free(op);
+    }
+    return result;
+}
+
+/* Allocation changes the shared free list, so the meta-data part of a
+ * write is done synchronously.  Only the data block is written
+ * asynchronously.
+ */
+static int treedisk_write_async(block_store_t *this_bs, block_no offset, block_t *block,
+                                            block_done_t done, void *arg){
+    struct treedisk_state *ts = this_bs->state;
+
+    ts->nwrite++;
+    struct treedisk_hint hint;
+    treedisk_hint_set(ts, &hint);
+    block_no b;
+    int result = treedisk_locate(ts, offset, &b);
+    if (result == 0) {
+        block_store_set_class(BLOCK_CLASS_DATA);
+        result = block_store_write_async(ts->below, b, block, done, arg);
+    }
+    treedisk_hint_restore(&hint);
+    return result;
+}
+
+static int treedisk_poll(block_store_t *this_bs, int wait){
+    struct treedisk_state *ts = this_bs->state;
+
+    return block_store_poll(ts->below, wait);
+}
+
+static void treedisk_stats(block_store_t *this_bs, block_stat_t emit, void *arg){
+    struct treedisk_state *ts = this_bs->state;
+
+    (*emit)(arg, "nread", BLOCK_STAT_COUNTER, ts->nread);
+    (*emit)(arg, "nwrite", BLOCK_STAT_COUNTER, ts->nwrite);
+    (*emit)(arg, "nsetsize", BLOCK_STAT_COUNTER, ts->nsetsize);
+    (*emit)(arg, "nalloc", BLOCK_STAT_COUNTER, ts->nalloc);
+    (*emit)(arg, "nfree", BLOCK_STAT_COUNTER, ts->nfree);
 }
 
 static void treedisk_destroy(block_store_t *this_bs){
-    free(this_bs->state);
+    struct treedisk_state *ts = this_bs->state;
+
+    treedisk_fs_put(ts->fs);
+    free(ts);
     free(this_bs);
 }
 
+/* Figure out the log of the number of references per block.
+ */
+static void treedisk_init_log_rpb(void){
+    do {
+        log_rpb++;
+    } while (((REFS_PER_BLOCK - 1) >> log_rpb) != 0);
+}
+
 /* Create or open a new virtual block store at the given inode number.
  */
 block_store_t *treedisk_init(block_store_t *below, unsigned int inode_no){
-    /* Figure out the log of the number of references per block.
-     */
-    if (log_rpb == 0) {     // first time only
-        do {
-            log_rpb++;
-        } while (((REFS_PER_BLOCK - 1) >> log_rpb) != 0);
-    }
+    pthread_once(&treedisk_once, treedisk_init_log_rpb);     // first time only
 
     /* Get info from underlying file system.
      */
@@ -459,6 +769,7 @@ block_store_t *treedisk_init(block_store_t *below, unsigned int inode_no){
     struct treedisk_state *ts = calloc(1, sizeof(*ts));
     ts->below = below;
     ts->inode_no = inode_no;
+    ts->fs = treedisk_fs_get(below);
 
     /* Return a block interface to this inode.
      */
@@ -469,6 +780,12 @@ block_store_t *treedisk_init(block_store_t *below, unsigned int inode_no){
     this_bs->read = treedisk_read;
     this_bs->write = treedisk_write;
     this_bs->destroy = treedisk_destroy;
+    this_bs->read_async = treedisk_read_async;
+    this_bs->write_async = treedisk_write_async;
+    this_bs->poll = treedisk_poll;
+    this_bs->name = "treedisk";
+    this_bs->below = below;
+    this_bs->stats = treedisk_stats;
     return this_bs;
 }
 
@@ -516,6 +833,10 @@ int treedisk_create(block_store_t *below, unsigned int n_inodes){
         return -1;
     }
 
+    /* It's all meta-data.
+     */
+    int cls = block_store_set_class(BLOCK_CLASS_META);
+
     /* Initialize the superblock.
      */
     union treedisk_block superblock;
@@ -523,18 +844,15 @@ int treedisk_create(block_store_t *below, unsigned int n_inodes){
     superblock.superblock.n_inodeblocks = n_inodeblocks;
     superblock.superblock.free_list =
                 setup_freelist(below, n_inodeblocks + 1, nblocks);
-    if ((*below->write)(below, 0, (block_t *) &superblock) < 0) {
-        return -1;
-    }
+    int result = (*below->write)(below, 0, (block_t *) &superblock);
 
     /* The inodes all start out empty.
      */
     int i;
-    for (i = 1; i <= n_inodeblocks; i++) {
-        if ((*below->write)(below, i, &null_block) < 0) {
-            return -1;
-        }
+    for (i = 1; i <= n_inodeblocks && result == 0; i++) {
+        result = (*below->write)(below, i, &null_block);
     }
 
-    return 0;
+    block_store_set_class(cls);
+    return result < 0 ? -1 : 0;
 }
\ No newline at end of file
@@ -0,0 +1,652 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* This code implements a block store on top of the underlying POSIX
+ * file system, like disk.c, but issues its I/O through Linux io_uring so
+ * that many requests can be outstanding at the same time:
+ *
+ *		block_store_t *uringdisk_init(char *file_name, block_no nblocks,
+ *												unsigned int depth)
+ *			Create a new block store, stored in the file by the given
+ *			name and with the given number of blocks.  'depth' is the
+ *			maximum number of requests in flight (the queue depth).
+ *
+ *		int uringdisk_submit_read(block_store_t *this_bs, block_no offset,
+ *											block_t *block, void *tag)
+ *		int uringdisk_submit_write(block_store_t *this_bs, block_no offset,
+ *											block_t *block, void *tag)
+ *			Queue a request.  Requests are batched and handed to the
+ *			kernel on the next poll or wait (or when the queue fills up).
+ *			A write copies *block at submission time; a read fills in
+ *			*block upon completion, so it must stay valid until then.
+ *
+ *		int uringdisk_poll(block_store_t *this_bs,
+ *							struct uringdisk_completion *done, int max)
+ *		int uringdisk_wait(block_store_t *this_bs,
+ *							struct uringdisk_completion *done, int max)
+ *			Submit anything queued and return up to 'max' completions
+ *			in 'done'.  poll never blocks; wait blocks until there is at
+ *			least one completion (unless nothing is outstanding).
+ *			Both return the number of completions, or -1 upon error.
+ *
+ * The usual read and write methods are a synchronous adapter: they
+ * submit a single request and wait for it, so a uringdisk can be used
+ * anywhere a disk can.  The asynchronous block store methods (read_async,
+ * write_async, poll) are supported natively as well; their completions
+ * are delivered through the callback rather than through poll or wait.
+ *
+ * A uringdisk may be used by several threads at once.  A lock protects the
+ * rings, the slots, and the ready list; it is not held while a thread is
+ * in the kernel waiting for completions (only one thread at a time is), or
+ * while completion callbacks run.  A synchronous request is finished by
+ * whichever thread reaps its completion.
+ *
+ * Each request slot has a block-sized buffer that is registered with the
+ * kernel once, so the kernel does not have to map user pages per request.
+ * If io_uring is not available (old kernel, or blocked by a sandbox), the
+ * module falls back to pread/pwrite at submission time while keeping the
+ * same submission/completion interface.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE				// <linux/fs.h> has its own
+#include "block_store.h"
+
+#define URING_MAX_CALLBACKS	64			// callbacks collected per lock release
+
+/* A synchronous request waiting to be finished.
+ */
+struct uringdisk_sync {
+	int finished;
+	int result;
+};
+
+/* A completion callback to be invoked after the lock is released.
+ */
+struct uringdisk_callback {
+	block_done_t done;
+	void *arg;
+	int result;
+};
+
+/* One request slot.  Slot i uses registered buffer i.
+ */
+struct uringdisk_slot {
+	block_t *user;				// caller's block (reads only)
+	void *tag;					// returned upon completion
+	block_done_t done;			// if set, invoked instead of returning tag
+	void *arg;
+	struct uringdisk_sync *sync;	// if set, a synchronous request
+	int is_read;
+	int next_free;				// free slot list
+};
+
+struct uringdisk_state {
+	block_no nblocks;			// #blocks in the block store
+	int fd;						// POSIX file descriptor of underlying file
+	unsigned int depth;			// #slots
+
+	pthread_mutex_t lock;		// protects everything below
+	pthread_cond_t cond;		// signaled when something completes
+	int reaping;				// a thread is in io_uring_enter
+
+	/* The ring.  ring_fd < 0 means we use the pread/pwrite fallback.
+	 */
+	int ring_fd;
+	int fixed;					// buffers were registered
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int to_submit;		// #sqes queued but not yet entered
+
+	/* Request slots and their buffers.
+	 */
+	struct uringdisk_slot *slots;
+	block_t *buffers;
+	int free_slot;				// head of free list, -1 if none
+	unsigned int inflight;		// #slots in use
+
+	/* Completions reaped from the ring but not yet handed out.
+	 */
+	struct uringdisk_completion *ready;
+	unsigned int nready, ready_size;
+
+	/* Stats.
+	 */
+	unsigned long nread, nwrite;	// # requests submitted
+	unsigned long nenter;		// # io_uring_enter calls
+};
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p){
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+							unsigned int min_complete, unsigned int flags){
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+															flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg,
+														unsigned int nr_args){
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Map the submission and completion rings.  Returns -1 if io_uring is
+ * not usable, in which case the caller falls back to pread/pwrite.
+ */
+static int uringdisk_ring_init(struct uringdisk_state *us){
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	if ((us->ring_fd = io_uring_setup(us->depth, &p)) < 0) {
+		return -1;
+	}
+
+	us->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	us->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (us->cq_len > us->sq_len) {
+			us->sq_len = us->cq_len;
+		}
+		us->cq_len = us->sq_len;
+	}
+	us->sq_ptr = mmap(0, us->sq_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, us->ring_fd, IORING_OFF_SQ_RING);
+	if (us->sq_ptr == MAP_FAILED) {
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		us->cq_ptr = us->sq_ptr;
+	}
+	else {
+		us->cq_ptr = mmap(0, us->cq_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, us->ring_fd, IORING_OFF_CQ_RING);
+		if (us->cq_ptr == MAP_FAILED) {
+			munmap(us->sq_ptr, us->sq_len);
+			goto fail;
+		}
+	}
+	us->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	us->sqes = mmap(0, us->sqes_len,
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				us->ring_fd, IORING_OFF_SQES);
+	if (us->sqes == MAP_FAILED) {
+		if (us->cq_ptr != us->sq_ptr) {
+			munmap(us->cq_ptr, us->cq_len);
+		}
+		munmap(us->sq_ptr, us->sq_len);
+		goto fail;
+	}
+
+	char *sq = us->sq_ptr, *cq = us->cq_ptr;
+	us->sq_head = (unsigned int *) (sq + p.sq_off.head);
+	us->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+	us->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	us->sq_array = (unsigned int *) (sq + p.sq_off.array);
+	us->cq_head = (unsigned int *) (cq + p.cq_off.head);
+	us->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+	us->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+	us->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	/* Register the slot buffers.  Not fatal if this fails.
+	 */
+	struct iovec *iov = calloc(us->depth, sizeof(*iov));
+	unsigned int i;
+	for (i = 0; i < us->depth; i++) {
+		iov[i].iov_base = &us->buffers[i];
+		iov[i].iov_len = BLOCK_SIZE;
+	}
+	us->fixed = io_uring_register(us->ring_fd, IORING_REGISTER_BUFFERS,
+														iov, us->depth) == 0;
+	free(iov);
+	return 0;
+
+fail:
+	close(us->ring_fd);
+	us->ring_fd = -1;
+	return -1;
+}
+
+/* Finish the request in 'slot' with result 'res' from the kernel, and free
+ * the slot.  A synchronous request is marked finished, and a completion
+ * without a callback goes on the ready list for poll or wait.  Returns 1
+ * if the callback in *cb is to be invoked, which the caller does after
+ * releasing the lock.  Called with the lock held.
+ */
+static int uringdisk_complete(struct uringdisk_state *us, int slot, int res,
+										struct uringdisk_callback *cb){
+	struct uringdisk_slot *s = &us->slots[slot];
+	int result = 0;
+
+	if (res < 0) {
+		errno = -res;
+		perror(s->is_read ? "uringdisk_read" : "uringdisk_write");
+		result = -1;
+	}
+	else if (s->is_read) {
+		if (res < BLOCK_SIZE) {
+			memset((char *) &us->buffers[slot] + res, 0, BLOCK_SIZE - res);
+		}
+		memcpy(s->user, &us->buffers[slot], BLOCK_SIZE);
+	}
+	else if (res != BLOCK_SIZE) {
+		fprintf(stderr, "uringdisk_write: wrote only %d bytes\n", res);
+		result = -1;
+	}
+
+	s->next_free = us->free_slot;
+	us->free_slot = slot;
+	us->inflight--;
+
+	if (s->sync != 0) {
+		s->sync->result = result;
+		s->sync->finished = 1;
+		return 0;
+	}
+	if (s->done != 0) {
+		cb->done = s->done;
+		cb->arg = s->arg;
+		cb->result = result;
+		return 1;
+	}
+	if (us->nready == us->ready_size) {
+		us->ready_size = us->ready_size == 0 ? us->depth : 2 * us->ready_size;
+		us->ready = realloc(us->ready, us->ready_size * sizeof(*us->ready));
+	}
+	us->ready[us->nready].tag = s->tag;
+	us->ready[us->nready].result = result;
+	us->nready++;
+	return 0;
+}
+
+/* Invoke n completion callbacks without holding the lock, as they may
+ * well submit (and even wait for) new requests.
+ */
+static void uringdisk_callbacks(struct uringdisk_state *us,
+								struct uringdisk_callback *cbs, unsigned int n){
+	unsigned int i;
+
+	pthread_mutex_unlock(&us->lock);
+	for (i = 0; i < n; i++) {
+		(*cbs[i].done)(cbs[i].arg, cbs[i].result);
+	}
+	pthread_mutex_lock(&us->lock);
+}
+
+/* Hand queued submissions to the kernel and move whatever has completed
+ * into the ready list.  If 'wait' is set, block for at least one.  Only
+ * one thread at a time may be in the kernel, where it waits without the
+ * lock held, and nobody else touches the completion queue meanwhile (it
+ * could take the completion that thread is waiting for); other threads
+ * that want to wait wait for it instead.  Called with the lock held, which
+ * may be released in between.
+ */
+static int uringdisk_reap(struct uringdisk_state *us, int wait){
+	if (us->ring_fd < 0) {
+		/* The fallback completes at submission, without the lock.
+		 */
+		if (wait && us->inflight > 0) {
+			pthread_cond_wait(&us->cond, &us->lock);
+		}
+		return 0;
+	}
+	if (us->reaping) {
+		if (wait) {
+			pthread_cond_wait(&us->cond, &us->lock);
+		}
+		return 0;
+	}
+
+	unsigned int to_submit = us->to_submit;
+	unsigned int min_complete = wait && us->inflight > 0 ? 1 : 0;
+	if (to_submit > 0 || min_complete > 0) {
+		us->reaping = 1;
+		us->nenter++;
+		pthread_mutex_unlock(&us->lock);
+		int n = io_uring_enter(us->ring_fd, to_submit, min_complete,
+						min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+		int error = errno;
+		pthread_mutex_lock(&us->lock);
+		us->reaping = 0;
+		if (n < 0) {
+			pthread_cond_broadcast(&us->cond);
+			if (error == EINTR) {
+				return 0;
+			}
+			errno = error;
+			perror("uringdisk: io_uring_enter");
+			return -1;
+		}
+		us->to_submit -= n;
+	}
+
+	/* Consume each entry before completing it.  The lock is held
+	 * throughout; callbacks are collected and run afterwards, and whatever
+	 * does not fit is left for the next call.
+	 */
+	struct uringdisk_callback cbs[URING_MAX_CALLBACKS];
+	unsigned int head, ncbs = 0;
+	while (ncbs < URING_MAX_CALLBACKS &&
+			(head = *us->cq_head) != __atomic_load_n(us->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe cqe = us->cqes[head & *us->cq_mask];
+		__atomic_store_n(us->cq_head, head + 1, __ATOMIC_RELEASE);
+		ncbs += uringdisk_complete(us, (int) cqe.user_data, cqe.res, &cbs[ncbs]);
+	}
+	pthread_cond_broadcast(&us->cond);
+	if (ncbs > 0) {
+		uringdisk_callbacks(us, cbs, ncbs);
+	}
+	return 0;
+}
+
+static int uringdisk_submit(block_store_t *this_bs, int is_read, block_no offset,
+				block_t *block, void *tag, block_done_t done, void *arg,
+				struct uringdisk_sync *sync){
+	struct uringdisk_state *us = this_bs->state;
+
+	if (offset >= us->nblocks) {
+		fprintf(stderr, "uringdisk_submit: bad offset %u\n", offset);
+		return -1;
+	}
+
+	/* Wait for a slot if all are in use.
+	 */
+	pthread_mutex_lock(&us->lock);
+	while (us->free_slot < 0) {
+		if (uringdisk_reap(us, 1) < 0) {
+			pthread_mutex_unlock(&us->lock);
+			return -1;
+		}
+	}
+	int slot = us->free_slot;
+	struct uringdisk_slot *s = &us->slots[slot];
+	us->free_slot = s->next_free;
+	us->inflight++;
+	s->user = block;
+	s->tag = tag;
+	s->done = done;
+	s->arg = arg;
+	s->sync = sync;
+	s->is_read = is_read;
+	if (is_read) {
+		us->nread++;
+	}
+	else {
+		us->nwrite++;
+		memcpy(&us->buffers[slot], block, BLOCK_SIZE);
+	}
+
+	/* No ring: just do it now.  The slot is ours, so the lock need not be
+	 * held for the I/O.
+	 */
+	if (us->ring_fd < 0) {
+		pthread_mutex_unlock(&us->lock);
+		off_t off = (off_t) offset * BLOCK_SIZE;
+		int n = is_read ? pread(us->fd, &us->buffers[slot], BLOCK_SIZE, off)
+						: pwrite(us->fd, &us->buffers[slot], BLOCK_SIZE, off);
+		pthread_mutex_lock(&us->lock);
+		struct uringdisk_callback cb;
+		int call = uringdisk_complete(us, slot, n < 0 ? -errno : n, &cb);
+		pthread_cond_broadcast(&us->cond);
+		pthread_mutex_unlock(&us->lock);
+		if (call) {
+			(*cb.done)(cb.arg, cb.result);
+		}
+		return 0;
+	}
+
+	unsigned int tail = *us->sq_tail;
+	unsigned int index = tail & *us->sq_mask;
+	struct io_uring_sqe *sqe = &us->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	if (us->fixed) {
+		sqe->opcode = is_read ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+		sqe->buf_index = slot;
+	}
+	else {
+		sqe->opcode = is_read ? IORING_OP_READ : IORING_OP_WRITE;
+	}
+	sqe->fd = us->fd;
+	sqe->off = (unsigned long long) offset * BLOCK_SIZE;
+	sqe->addr = (unsigned long) &us->buffers[slot];
+	sqe->len = BLOCK_SIZE;
+	sqe->user_data = slot;
+	us->sq_array[index] = index;
+	__atomic_store_n(us->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	us->to_submit++;
+	pthread_mutex_unlock(&us->lock);
+	return 0;
+}
+
+int uringdisk_submit_read(block_store_t *this_bs, block_no offset,
+												block_t *block, void *tag){
+	return uringdisk_submit(this_bs, 1, offset, block, tag, 0, 0, 0);
+}
+
+int uringdisk_submit_write(block_store_t *this_bs, block_no offset,
+												block_t *block, void *tag){
+	return uringdisk_submit(this_bs, 0, offset, block, tag, 0, 0, 0);
+}
+
+/* Hand out up to 'max' ready completions, oldest first.  Called with the
+ * lock held.
+ */
+static int uringdisk_harvest(struct uringdisk_state *us,
+							struct uringdisk_completion *done, int max){
+	int n = (unsigned int) max < us->nready ? max : (int) us->nready;
+
+	memcpy(done, us->ready, n * sizeof(*done));
+	us->nready -= n;
+	memmove(us->ready, us->ready + n, us->nready * sizeof(*us->ready));
+	return n;
+}
+
+int uringdisk_poll(block_store_t *this_bs,
+							struct uringdisk_completion *done, int max){
+	struct uringdisk_state *us = this_bs->state;
+	int n = -1;
+
+	pthread_mutex_lock(&us->lock);
+	if (uringdisk_reap(us, 0) == 0) {
+		n = uringdisk_harvest(us, done, max);
+	}
+	pthread_mutex_unlock(&us->lock);
+	return n;
+}
+
+int uringdisk_wait(block_store_t *this_bs,
+							struct uringdisk_completion *done, int max){
+	struct uringdisk_state *us = this_bs->state;
+	int n = -1;
+
+	pthread_mutex_lock(&us->lock);
+	while (us->nready == 0 && us->inflight > 0) {
+		if (uringdisk_reap(us, 1) < 0) {
+			goto out;
+		}
+	}
+	if (uringdisk_reap(us, 0) == 0) {
+		n = uringdisk_harvest(us, done, max);
+	}
+out:
+	pthread_mutex_unlock(&us->lock);
+	return n;
+}
+
+/* Synchronous adapter: submit one request and wait until it is finished.
+ * Whichever thread reaps the completion marks it finished, so other
+ * threads may be waiting at the same time.
+ */
+static int uringdisk_sync(block_store_t *this_bs, int is_read,
+										block_no offset, block_t *block){
+	struct uringdisk_state *us = this_bs->state;
+	struct uringdisk_sync sync = { 0, 0 };
+
+	if (uringdisk_submit(this_bs, is_read, offset, block, 0, 0, 0, &sync) < 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&us->lock);
+	while (!sync.finished) {
+		if (uringdisk_reap(us, 1) < 0) {
+			/* Nobody may touch 'sync' once we are gone.
+			 */
+			unsigned int i;
+			for (i = 0; i < us->depth; i++) {
+				if (us->slots[i].sync == &sync) {
+					us->slots[i].sync = 0;
+				}
+			}
+			pthread_mutex_unlock(&us->lock);
+			return -1;
+		}
+	}
+	pthread_mutex_unlock(&us->lock);
+	return sync.result;
+}
+
+static int uringdisk_read(block_store_t *this_bs, block_no offset, block_t *block){
+	return uringdisk_sync(this_bs, 1, offset, block);
+}
+
+static int uringdisk_write(block_store_t *this_bs, block_no offset, block_t *block){
+	return uringdisk_sync(this_bs, 0, offset, block);
+}
+
+static int uringdisk_read_async(block_store_t *this_bs, block_no offset, block_t *block,
+											block_done_t done, void *arg){
+	return uringdisk_submit(this_bs, 1, offset, block, 0, done, arg, 0);
+}
+
+static int uringdisk_write_async(block_store_t *this_bs, block_no offset, block_t *block,
+											block_done_t done, void *arg){
+	return uringdisk_submit(this_bs, 0, offset, block, 0, done, arg, 0);
+}
+
+static int uringdisk_block_poll(block_store_t *this_bs, int wait){
+	struct uringdisk_state *us = this_bs->state;
+
+	pthread_mutex_lock(&us->lock);
+	int result = uringdisk_reap(us, wait);
+	pthread_mutex_unlock(&us->lock);
+	return result;
+}
+
+static int uringdisk_nblocks(block_store_t *this_bs){
+	struct uringdisk_state *us = this_bs->state;
+
+	return us->nblocks;
+}
+
+static int uringdisk_setsize(block_store_t *this_bs, block_no nblocks){
+	struct uringdisk_state *us = this_bs->state;
+
+	int before = us->nblocks;
+	if (ftruncate(us->fd, (off_t) nblocks * BLOCK_SIZE) < 0) {
+		perror("uringdisk_setsize");
+		return -1;
+	}
+	us->nblocks = nblocks;
+	return before;
+}
+
+static void uringdisk_stats(block_store_t *this_bs, block_stat_t emit, void *arg){
+	struct uringdisk_state *us = this_bs->state;
+
+	(*emit)(arg, "nread", BLOCK_STAT_COUNTER, us->nread);
+	(*emit)(arg, "nwrite", BLOCK_STAT_COUNTER, us->nwrite);
+	(*emit)(arg, "nenter", BLOCK_STAT_COUNTER, us->nenter);
+	(*emit)(arg, "nblocks", BLOCK_STAT_GAUGE, us->nblocks);
+	(*emit)(arg, "depth", BLOCK_STAT_GAUGE, us->depth);
+	(*emit)(arg, "inflight", BLOCK_STAT_GAUGE, us->inflight);
+	(*emit)(arg, "fallback", BLOCK_STAT_GAUGE, us->ring_fd < 0);
+}
+
+static void uringdisk_destroy(block_store_t *this_bs){
+	struct uringdisk_state *us = this_bs->state;
+
+	/* Let outstanding requests finish; their completions are dropped.
+	 */
+	pthread_mutex_lock(&us->lock);
+	while (us->inflight > 0) {
+		if (uringdisk_reap(us, 1) < 0) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&us->lock);
+	pthread_cond_destroy(&us->cond);
+	pthread_mutex_destroy(&us->lock);
+	if (us->ring_fd >= 0) {
+		munmap(us->sqes, us->sqes_len);
+		if (us->cq_ptr != us->sq_ptr) {
+			munmap(us->cq_ptr, us->cq_len);
+		}
+		munmap(us->sq_ptr, us->sq_len);
+		close(us->ring_fd);
+	}
+	close(us->fd);
+	free(us->ready);
+	free(us->buffers);
+	free(us->slots);
+	free(us);
+	free(this_bs);
+}
+
+block_store_t *uringdisk_init(char *file_name, block_no nblocks, unsigned int depth){
+	struct uringdisk_state *us = calloc(1, sizeof(*us));
+
+	us->fd = open(file_name, O_RDWR | O_CREAT, 0600);
+	if (us->fd < 0) {
+		perror(file_name);
+		panic("uringdisk_init");
+	}
+	us->nblocks = nblocks;
+	us->depth = depth == 0 ? 1 : depth;
+	pthread_mutex_init(&us->lock, 0);
+	pthread_cond_init(&us->cond, 0);
+
+	/* Set up the slots, all free.
+	 */
+	us->slots = calloc(us->depth, sizeof(*us->slots));
+	if (posix_memalign((void **) &us->buffers, 4096, us->depth * BLOCK_SIZE) != 0) {
+		panic("uringdisk_init: buffers");
+	}
+	unsigned int i;
+	for (i = 0; i < us->depth; i++) {
+		us->slots[i].next_free = (int) i + 1 < (int) us->depth ? (int) i + 1 : -1;
+	}
+	us->free_slot = 0;
+
+	if (uringdisk_ring_init(us) < 0) {
+		fprintf(stderr, "uringdisk_init: io_uring unavailable, using pread/pwrite\n");
+	}
+
+	block_store_t *this_bs = calloc(1, sizeof(*this_bs));
+	this_bs->state = us;
+	this_bs->nblocks = uringdisk_nblocks;
+	this_bs->setsize = uringdisk_setsize;
+	this_bs->read = uringdisk_read;
+	this_bs->write = uringdisk_write;
+	this_bs->destroy = uringdisk_destroy;
+	this_bs->read_async = uringdisk_read_async;
+	this_bs->write_async = uringdisk_write_async;
+	this_bs->poll = uringdisk_block_poll;
+	this_bs->name = "uringdisk";
+	this_bs->stats = uringdisk_stats;
+	return this_bs;
+}